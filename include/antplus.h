@@ -27,21 +27,58 @@
 #define ANTPLUS_LIB_ANTPLUS_H_
 
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <vector>
-#include <queue>
 #include <memory>
 #include <chrono>
 #include <utility>
 #include <map>
+#include <deque>
+#include <unordered_map>
 #include <string>
+#include <functional>
+#include <future>
+#include <type_traits>
+#include <random>
 
 #include "antinterface.h"
 #include "antchannel.h"
 
 #define ANTPLUS_MAX_MESSAGE_SIZE   128
+#define ANTPLUS_USB_PACKET_SIZE    64
+#define ANTPLUS_MAX_DATA_SIZE      40
+#define ANTPLUS_REASSEMBLER_SIZE   1024
 #define ANTPLUS_SLEEP_DURATION     50000L
+#define ANTPLUS_QUEUE_SIZE         1024
+#define ANTPLUS_CHANNEL_QUEUE_SIZE 256
+#define ANTPLUS_TS_CHUNK_SIZE      256
+#define ANTPLUS_QUEUE_BATCH        32
+#define ANTPLUS_QUEUE_SPIN         100
+#define ANTPLUS_SIM_CHANNELS       16
+#define ANTPLUS_CAPTURE_MAGIC      "ANTCAP01"
+#define ANTPLUS_RSSI_NONE          -128
+#define ANTPLUS_DEDUP_HISTORY      4
+#define ANTPLUS_DEDUP_WINDOW       100
+#define ANTPLUS_DEDUP_ACTIVE       2000
+#define ANTPLUS_RECONNECT_TIMEOUT  250
+#define ANTPLUS_COMMAND_TIMEOUT    250
+#define ANTPLUS_COMMAND_RETRIES    2
+#define ANTPLUS_RESET_TIMEOUT      1000
+#define ANTPLUS_PAGE_FIELDS        6
+#define ANTPLUS_PAGE_ANY           -1
+#define ANTPLUS_POWER_GAP          8000
+#define ANTPLUS_POWER_EVENTS       32
+#define ANTPLUS_TORQUE_EVENTS      8
+#define ANTPLUS_WHEEL_CIRCUMFERENCE 2.07
+#define ANTPLUS_HR_GAP             30000
+#define ANTPLUS_HRV_WINDOW         300000
+#define ANTPLUS_STORE_HEARTBEAT    60000
 
 //
 // Version / Debug info created by cmake
@@ -81,29 +118,46 @@ class ANTDeviceID {
     ANTDeviceID(void) {
         antID   = 0x0000;
         antType = 0x00;
+        antTransType = 0x00;
     }
-    ANTDeviceID(uint16_t id, uint8_t type) {
+    ANTDeviceID(uint16_t id, uint8_t type, uint8_t transType = 0x00) {
         antID = id;
         antType = type;
+        antTransType = transType;
     }
-    uint16_t getID(void)   { return antID; }
-    uint8_t  getType(void) { return antType; }
+    uint16_t getID(void)        { return antID; }
+    uint8_t  getType(void)      { return antType; }
+    uint8_t  getTransType(void) { return antTransType; }
     bool     isValid(void) {
         return (antID != 0x000) && (antType != 0x00);
     }
+    // Packed device number, type and transmission type
+    uint32_t getKey(void) const {
+        return ((uint32_t)antID << 16) | ((uint32_t)antType << 8)
+            | antTransType;
+    }
     friend bool operator== (
             const ANTDeviceID &a, const ANTDeviceID &b) {
-        return (a.antID == b.antID) && (a.antType == b.antType);
+        return a.getKey() == b.getKey();
     }
     friend bool operator< (
             const ANTDeviceID &a, const ANTDeviceID &b) {
-        return (a.antID < b.antID) && (a.antType < b.antType);
+        return a.getKey() < b.getKey();
     }
 
  private:
     uint16_t antID;
     uint8_t antType;
+    uint8_t antTransType;
+};
+
+namespace std {
+template <> struct hash<ANTDeviceID> {
+    size_t operator()(const ANTDeviceID &id) const {
+        return std::hash<uint32_t>()(id.getKey());
+    }
 };
+}  // namespace std
 
 /**
  * @brief
@@ -119,7 +173,7 @@ class ANTMessage {
     };
 
     ANTMessage(void);
-    ANTMessage(uint8_t *data, int data_len);
+    ANTMessage(const uint8_t *data, int data_len);
     ANTMessage(uint8_t type, uint8_t chan, uint8_t *data, int len);
     ANTMessage(uint8_t type, uint8_t *data, int len);
     ANTMessage(uint8_t type, uint8_t chan);
@@ -132,80 +186,406 @@ class ANTMessage {
     ANTMessage(uint8_t type, uint8_t chan, uint8_t b0, uint8_t b1,
             uint8_t b2, uint8_t b3, uint8_t b4);
 
-    // Copy Constructor
-    ANTMessage(const ANTMessage& obj)
-        : ANTMessage() {
-        antType = obj.antType;
-        antChannel = obj.antChannel;
-        antDataLen = obj.antDataLen;
-        antDeviceID = obj.antDeviceID;
-        ts = obj.ts;
-        for (int i=0; i < ANTPLUS_MAX_MESSAGE_SIZE; i++) {
-            antData[i] = obj.antData[i];
-        }
-    }
-
-    ANTMessage& operator=(ANTMessage other) {
-        swap(*this, other);
-        return *this;
-    }
-
-    friend void swap(ANTMessage& a, ANTMessage& b) {
-        std::swap(a.antType, b.antType);
-        std::swap(a.antChannel, b.antChannel);
-        std::swap(a.antData, b.antData);
-        std::swap(a.antDataLen, b.antDataLen);
-        std::swap(a.antDeviceID, b.antDeviceID);
-        std::swap(a.ts, b.ts);
-    }
-
-    ~ANTMessage(void);
-
     void         encode(uint8_t *msg, int *len);
-    int          decode(uint8_t *data, int data_len);
+    int          decode(const uint8_t *data, int data_len);
     uint8_t      getType(void)               { return antType;}
     uint8_t      getChannel(void)            { return antChannel;}
     uint8_t      getData(int n)              { return antData[n];}
     int          getDataLen(void)            { return antDataLen;}
     void         setTimestamp(void)          { ts = ant_clock::now(); }
+    void         setTimestamp(ant_time_point t) { ts = t; }
     ANTDeviceID  getDeviceID(void)           { return antDeviceID; }
     ant_time_point getTimestamp(void)        { return ts; }
-    shared_ptr<uint8_t[]> getData(void) { return antData;}
+    const uint8_t* getData(void)             { return antData;}
+    // Signal strength (dBm) when extended RSSI data was included,
+    // otherwise ANTPLUS_RSSI_NONE
+    int8_t       getRSSI(void)               { return antRssi; }
 
  private:
+    // Laid out so that a message (and a queue slot) fits
+    // in a single cache line.
+    ant_time_point ts;
+    ANTDeviceID    antDeviceID;
     uint8_t        antType;
     uint8_t        antChannel;
-    int            antDataLen;
-    ANTDeviceID    antDeviceID;
-    ant_time_point ts;
-    shared_ptr<uint8_t[]> antData;
+    uint8_t        antDataLen;
+    int8_t         antRssi;
+    uint8_t        antData[ANTPLUS_MAX_DATA_SIZE];
 };
 
+static_assert(std::is_trivially_copyable<ANTMessage>::value,
+        "ANTMessage must be trivially copyable");
+
 /**
- * @brief
+ * @brief View of a single raw ANT frame
+ *
+ * The data is owned by the ANTReassembler which produced the frame
+ * and is only valid until the next call to ANTReassembler::push().
+ */
+struct ANTFrame {
+    const uint8_t *data;
+    int           len;
+};
+
+/**
+ * @brief Reassemble ANT frames from a byte stream
  *
+ * Bytes are pushed in as they arrive from the transport. Partial frames
+ * are carried over to the next push and the stream is resynced on the
+ * sync byte, length and checksum when corrupt data is seen.
+ */
+class ANTReassembler {
+ public:
+    ANTReassembler(void);
+    int  push(const uint8_t *bytes, int nbytes);
+    bool nextFrame(ANTFrame *frame);
+    void reset(void);
+    int  getDropped(void)   { return dropped; }
+
+ private:
+    uint8_t buffer[ANTPLUS_REASSEMBLER_SIZE];
+    int     head;
+    int     tail;
+    int     dropped;
+};
+
+/**
+ * @brief Bounded single producer / single consumer queue
+ *
+ * Lock free on the fast path. The consumer spins briefly when the queue
+ * is empty and then parks on a condition variable, the producer only
+ * takes the lock to signal when the consumer is parked.
+ */
+template <class T> class ANTRingBuffer {
+ public:
+    explicit ANTRingBuffer(size_t size = ANTPLUS_QUEUE_SIZE) {
+        // Round up to a power of two so we can mask the indices
+        size_t n = 1;
+        while (n < size) {
+            n <<= 1;
+        }
+        buffer.resize(n);
+        mask = n - 1;
+        head = 0;
+        tail = 0;
+        parked = false;
+        dropped = 0;
+        pthread_mutex_init(&park_lock, NULL);
+        pthread_cond_init(&park_cond, NULL);
+    }
+    ~ANTRingBuffer(void) {
+        pthread_mutex_destroy(&park_lock);
+        pthread_cond_destroy(&park_cond);
+    }
+
+    // Producer side
+    bool push(const T &v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if ((t - head.load(std::memory_order_acquire)) > mask) {
+            dropped++;
+            return false;
+        }
+        buffer[t & mask] = v;
+        tail.store(t + 1, std::memory_order_seq_cst);
+        if (parked.exchange(false, std::memory_order_seq_cst)) {
+            notify();
+        }
+        return true;
+    }
+
+    // Consumer side, take up to max entries at once
+    size_t pop(T *out, size_t max) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t n = tail.load(std::memory_order_acquire) - h;
+        if (n > max) {
+            n = max;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[i] = buffer[(h + i) & mask];
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    // Consumer side, block for up to timeout (us) for entries
+    size_t wait(T *out, size_t max, long timeout) {
+        for (int i = 0; i < ANTPLUS_QUEUE_SPIN; i++) {
+            size_t n = pop(out, max);
+            if (n) {
+                return n;
+            }
+        }
+
+        pthread_mutex_lock(&park_lock);
+        parked.store(true, std::memory_order_seq_cst);
+        if (empty()) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (timeout % 1000000L) * 1000L;
+            ts.tv_sec  += (timeout / 1000000L) + (ts.tv_nsec / 1000000000L);
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&park_cond, &park_lock, &ts);
+        }
+        parked.store(false, std::memory_order_relaxed);
+        pthread_mutex_unlock(&park_lock);
+
+        return pop(out, max);
+    }
+
+    // Wake the consumer (if parked)
+    void notify(void) {
+        pthread_mutex_lock(&park_lock);
+        pthread_cond_signal(&park_cond);
+        pthread_mutex_unlock(&park_lock);
+    }
+
+    bool empty(void) {
+        return tail.load(std::memory_order_seq_cst)
+            == head.load(std::memory_order_seq_cst);
+    }
+    // Only meaningful on the producer side
+    bool full(void) {
+        return (tail.load(std::memory_order_relaxed)
+            - head.load(std::memory_order_acquire)) > mask;
+    }
+    size_t getDropped(void) { return dropped; }
+
+ private:
+    std::vector<T> buffer;
+    size_t mask;
+    size_t dropped;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<bool> parked;
+    pthread_mutex_t park_lock;
+    pthread_cond_t  park_cond;
+};
+
+/**
+ * @brief Time series column for a single device field
+ *
+ * Values and timestamps are kept as parallel arrays in fixed size
+ * chunks, so appending never moves existing samples and only allocates
+ * once every ANTPLUS_TS_CHUNK_SIZE samples.
+ *
+ * Timestamps are int64 nanoseconds. Within a chunk they are stored as
+ * 32 bit deltas from the previous sample, a new chunk is started when
+ * the delta does not fit, so the export is always exact.
+ *
+ * The chunks live in a ring. By default it grows without limit, with
+ * a retention policy set the oldest chunks are evicted (and optionally
+ * spilled) and their memory reused, so the size stays constant.
  */
 template <class T> class ANTDeviceData {
  public:
+    typedef std::function<void(const int64_t*, const T*, int)> SpillFn;
+
     ANTDeviceData(void) {
-        value = std::make_shared<std::vector<T>>();
-        ts = std::make_shared<std::vector<T>>();
+        nSamples = 0;
+        first = 0;
+        count = 0;
+        maxSamples = 0;
+        window = 0;
+        pthread_mutex_init(&data_lock, NULL);
     }
-    void addDatum(T v, ant_time_point t) {
-        float ft = t.time_since_epoch().count();
-        value->push_back(v);
-        ts->push_back(ft);
+    ~ANTDeviceData(void) {
+        pthread_mutex_destroy(&data_lock);
+    }
+
+    // Keep at most max samples and / or samples newer than
+    // window ns (0 is unlimited). Evicted data is passed to spill.
+    void setRetention(size_t max, int64_t win, SpillFn fn = nullptr) {
+        pthread_mutex_lock(&data_lock);
+        maxSamples = max;
+        window = win;
+        spill = fn;
+        pthread_mutex_unlock(&data_lock);
+    }
+
+    void addDatum(T v, int64_t t) {
+        pthread_mutex_lock(&data_lock);
+        Chunk *c = count ? chunkAt(count - 1) : nullptr;
+        if ((c == nullptr) || (c->n == ANTPLUS_TS_CHUNK_SIZE)
+                || (t < c->tsLast) || ((t - c->tsLast) > UINT32_MAX)) {
+            evict(t);
+            c = newChunk();
+            c->tsBase = t;
+            c->tsLast = t;
+        }
+        c->value[c->n] = v;
+        c->tsDelta[c->n] = t - c->tsLast;
+        c->tsLast = t;
+        c->n++;
+        nSamples++;
+        pthread_mutex_unlock(&data_lock);
+    }
+    size_t size(void) {
+        // The number of samples getValue() returns, which is
+        // trimmed to the retention policy (see forEach())
+        pthread_mutex_lock(&data_lock);
+        size_t n = nSamples;
+        if (maxSamples && (n > maxSamples)) {
+            n = maxSamples;
+        }
+        if (window) {
+            n = 0;
+            forEach([&n](int64_t t, T v) {
+                (void)t;
+                (void)v;
+                n++;
+            });
+        }
+        pthread_mutex_unlock(&data_lock);
+        return n;
     }
     shared_ptr<std::vector<T>> getValue(void) {
-        return value;
+        auto out = std::make_shared<std::vector<T>>();
+        pthread_mutex_lock(&data_lock);
+        out->reserve(nSamples);
+        forEach([&out](int64_t t, T v) {
+            (void)t;
+            out->push_back(v);
+        });
+        pthread_mutex_unlock(&data_lock);
+        return out;
     }
-    shared_ptr<std::vector<T>> getTimestamp(void) {
-        return ts;
+    shared_ptr<std::vector<int64_t>> getTimestamp(void) {
+        auto out = std::make_shared<std::vector<int64_t>>();
+        pthread_mutex_lock(&data_lock);
+        out->reserve(nSamples);
+        forEach([&out](int64_t t, T v) {
+            (void)v;
+            out->push_back(t);
+        });
+        pthread_mutex_unlock(&data_lock);
+        return out;
     }
 
  private:
-    shared_ptr<std::vector<T>> value;
-    shared_ptr<std::vector<T>> ts;
+    struct Chunk {
+        T        value[ANTPLUS_TS_CHUNK_SIZE];
+        uint32_t tsDelta[ANTPLUS_TS_CHUNK_SIZE];
+        int64_t  tsBase;
+        int64_t  tsLast;
+        int      n;
+    };
+
+    Chunk* chunkAt(size_t i) {
+        return ring[(first + i) % ring.size()].get();
+    }
+
+    Chunk* newChunk(void) {
+        if (count == ring.size()) {
+            // Grow the ring, this only moves the chunk pointers
+            std::vector<std::unique_ptr<Chunk>> r(ring.size() ?
+                    ring.size() * 2 : 4);
+            for (size_t i = 0; i < count; i++) {
+                r[i] = std::move(ring[(first + i) % ring.size()]);
+            }
+            ring.swap(r);
+            first = 0;
+        }
+        auto& slot = ring[(first + count) % ring.size()];
+        if (!slot) {
+            slot = std::make_unique<Chunk>();
+        }
+        slot->n = 0;
+        count++;
+        return slot.get();
+    }
+
+    void evict(int64_t t) {
+        // Drop whole chunks which are no longer needed to
+        // satisfy the retention policy. The slot is kept for reuse.
+        while (count) {
+            Chunk *c = chunkAt(0);
+            bool full = maxSamples && ((nSamples - c->n) >= maxSamples);
+            bool old = window && ((t - c->tsLast) > window);
+            if (!full && !old) {
+                break;
+            }
+            if (spill) {
+                int64_t ts[ANTPLUS_TS_CHUNK_SIZE];
+                int64_t _t = c->tsBase;
+                for (int i = 0; i < c->n; i++) {
+                    _t += c->tsDelta[i];
+                    ts[i] = _t;
+                }
+                spill(ts, c->value, c->n);
+            }
+            nSamples -= c->n;
+            first = (first + 1) % ring.size();
+            count--;
+        }
+    }
+
+    template <class F> void forEach(F f) {
+        // Walk the retained samples, trimmed exactly
+        // to the retention policy
+        size_t skip = 0;
+        if (maxSamples && (nSamples > maxSamples)) {
+            skip = nSamples - maxSamples;
+        }
+        int64_t oldest = INT64_MIN;
+        if (window && count) {
+            oldest = chunkAt(count - 1)->tsLast - window;
+        }
+        for (size_t j = 0; j < count; j++) {
+            Chunk *c = chunkAt(j);
+            int64_t t = c->tsBase;
+            for (int i = 0; i < c->n; i++) {
+                t += c->tsDelta[i];
+                if (skip) {
+                    skip--;
+                } else if (t >= oldest) {
+                    f(t, c->value[i]);
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Chunk>> ring;
+    size_t first;
+    size_t count;
+    size_t nSamples;
+    size_t maxSamples;
+    int64_t window;
+    SpillFn spill;
+    pthread_mutex_t data_lock;
+};
+
+/**
+ * @brief Destination for time series data evicted by a retention policy
+ *
+ */
+class ANTDataSink {
+ public:
+    virtual ~ANTDataSink(void) {}
+    virtual int write(ANTDeviceID id, const char *field,
+            const int64_t *ts, const float *value, int n) = 0;
+};
+
+/**
+ * @brief Write evicted time series data to a binary file
+ *
+ * Each record is the device ID (uint16), device type (uint8), the
+ * field name length (uint8) and name, the number of samples (uint32)
+ * followed by the int64 timestamps and float values.
+ */
+class ANTFileDataSink : public ANTDataSink {
+ public:
+    enum {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    explicit ANTFileDataSink(std::string filename);
+    ~ANTFileDataSink(void);
+    int write(ANTDeviceID id, const char *field,
+            const int64_t *ts, const float *value, int n);
+
+ private:
+    FILE *file;
+    pthread_mutex_t file_lock;
 };
 
 //
@@ -213,13 +593,166 @@ template <class T> class ANTDeviceData {
 //
 
 typedef std::map<std::string, float> ANTMetaData;
-typedef std::map<std::string, ANTDeviceData<float>> ANTTsData;
+typedef std::map<std::string, shared_ptr<ANTDeviceData<float>>> ANTTsData;
+
+/**
+ * @brief Time weighted mean over a sliding window
+ *
+ * Each sample covers weight seconds ending at t (ns). Adding a
+ * sample drops those which have left the window, so reading the
+ * mean is O(1) and adding is amortised O(1).
+ */
+class ANTRollingAverage {
+ public:
+    explicit ANTRollingAverage(int window);  // ms
+    void   add(int64_t t, double value, double weight);
+    double get(void);
+    double getSpan(void)           { return weight; }
+    void   clear(void);
+
+ private:
+    struct Sample {
+        int64_t t;
+        double  value;
+        double  weight;
+    };
+    std::deque<Sample> samples;
+    int64_t window;  // ns
+    double  sum;
+    double  weight;
+};
+
+/**
+ * @brief Heart rate variability over a sliding window of beats
+ *
+ * Each beat is its RR interval (ms) at time t (ns), successive
+ * differences are only taken between consecutive beats (no missed
+ * beats in between). All statistics are kept as running sums so
+ * adding a beat is amortised O(1).
+ */
+class ANTHrv {
+ public:
+    explicit ANTHrv(int window);  // ms
+    void   setWindow(int window);
+    void   addBeat(int64_t t, double rr, bool consecutive);
+    double getRMSSD(void);
+    double getSDNN(void);
+    double getPNN50(void);
+    int    getBeats(void)              { return beats.size(); }
+    void   clear(void);
+
+ private:
+    struct Beat {
+        int64_t t;
+        double  rr;
+        bool    hasDiff;
+        double  diff2;
+    };
+    std::deque<Beat> beats;
+    int64_t window;  // ns
+    double  sumRR;
+    double  sumRR2;
+    double  sumDiff2;
+    int     nDiff;
+    int     nNN50;
+    double  lastRR;
+};
+
+/**
+ * @brief Layout of one field in an ANT+ data page
+ *
+ * The raw value is bits wide, starting shift bits into the little
+ * endian value at byte, and is stored as raw * scale + offset in
+ * field (or as the meta datum meta when that is set). The field is
+ * skipped when validBit (of the byte) is clear or the raw value is
+ * invalid, ANTPLUS_PAGE_ANY turns either check off.
+ */
+struct ANTPageField {
+    uint8_t     byte;
+    uint8_t     shift;
+    uint8_t     bits;
+    bool        isSigned;
+    double      scale;
+    double      offset;
+    int         field;
+    const char *meta;
+    int8_t      validBit;
+    int64_t     invalid;
+};
+
+/**
+ * @brief The fields of one data page (and subpage, the second byte)
+ *
+ * Unused entries of fields are left zero (bits = 0), nFields is
+ * filled in by makePageTable().
+ */
+struct ANTPage {
+    uint8_t      page;
+    int16_t      subpage;
+    ANTPageField fields[ANTPLUS_PAGE_FIELDS];
+    int          nFields;
+};
+
+/**
+ * @brief Page decoder table, built at compile time
+ *
+ * Pages are looked up through a 256 entry index on the page number.
+ * Pages with subpages must be listed next to each other.
+ */
+template <size_t N>
+struct ANTPageTable {
+    // The index holds entry + 1 in a byte
+    static_assert(N <= UINT8_MAX, "Too many pages for an ANTPageTable");
+
+    ANTPage pages[N];
+    uint8_t index[256];   // page number -> first entry + 1, 0 for none
+
+    constexpr const ANTPage* find(uint8_t page, uint8_t subpage) const {
+        int i = index[page];
+        if (!i--) {
+            return nullptr;
+        }
+        for (; (i < static_cast<int>(N)) && (pages[i].page == page); i++) {
+            if ((pages[i].subpage == ANTPLUS_PAGE_ANY)
+                    || (pages[i].subpage == subpage)) {
+                return &pages[i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+template <size_t N>
+constexpr ANTPageTable<N> makePageTable(const ANTPage (&pages)[N]) {
+    ANTPageTable<N> table = {};
+    for (size_t i = 0; i < N; i++) {
+        table.pages[i] = pages[i];
+        table.pages[i].nFields = 0;
+        while ((table.pages[i].nFields < ANTPLUS_PAGE_FIELDS)
+                && pages[i].fields[table.pages[i].nFields].bits) {
+            table.pages[i].nFields++;
+        }
+        if (!table.index[pages[i].page]) {
+            table.index[pages[i].page] = i + 1;
+        }
+    }
+    return table;
+}
 
 class ANTDevice {
  public:
+    enum STORE {
+        // When a new value of a field is stored
+        STORE_ALWAYS    = 0,
+        STORE_ON_CHANGE = 1,
+        // On change, or if nothing was stored for the heartbeat
+        STORE_HEARTBEAT = 2
+    };
+
     ANTDevice(void);
-    explicit ANTDevice(const ANTDeviceID &id);
-    ~ANTDevice(void);
+    explicit ANTDevice(const ANTDeviceID &id,
+            const char * const *fieldNames = nullptr, int nFields = 0);
+    virtual ~ANTDevice(void);
 
     friend bool operator== (
             const ANTDevice &a, const ANTDevice &b) {
@@ -230,18 +763,52 @@ class ANTDevice {
         return a.devID == b;
     }
 
-    void parseMessage(ANTMessage *message) {
+    void parseMessage(ANTMessage *message, int receiver = 0) {
         lock();
-        processMessage(message);
+        if (!isDuplicate(message, receiver)) {
+            processMessage(message);
+        }
         unlock();
     }
 
+    // With more than one receiver the same page can arrive several
+    // times, copies seen within window (ms) are dropped. Zero turns
+    // this off. The smoothed RSSI is kept for each receiver, while
+    // the receiver with the best signal is delivering, a copy from
+    // another receiver is held back for up to the window and only
+    // processed if the preferred receiver's copy does not arrive.
+    void         setDedupWindow(int window);
+    uint64_t     getDuplicates(void)         { return duplicates; }
+    int          getPreferredReceiver(void)  { return preferredReceiver; }
+    float        getRSSI(int receiver);
+
     ANTDeviceID  getDeviceID(void)   { return devID; }
     std::string& getDeviceName(void) { return deviceName; }
 
-    shared_ptr<ANTTsData> getTsData(void) {
-        return tsData;
-    }
+    // Timestamps are stored in ns relative to this time
+    void setStartTime(ant_time_point t) { startTime = t; }
+    ant_time_point getStartTime(void)   { return startTime; }
+
+    // Time series data is stored by field ID (see the FIELD enum of
+    // each device), getTsData() gives a name keyed view of it.
+    int          getNumFields(void)  { return tsData.size(); }
+
+    // Bound the stored time series to maxSamples per field and / or
+    // window (ms), zero is unlimited. Evicted data goes to sink.
+    void         setRetention(size_t maxSamples, int window,
+            shared_ptr<ANTDataSink> sink = nullptr);
+    const char*  getFieldName(int field);
+    shared_ptr<ANTDeviceData<float>> getTsData(int field);
+    shared_ptr<ANTTsData> getTsData(void);
+
+    // Sensors repeat pages whether or not anything changed, fields
+    // which change slowly can skip the repeats (see STORE). The
+    // heartbeat (ms) is only used by STORE_HEARTBEAT. Fields default
+    // to STORE_ALWAYS, except the PWR battery and parameter fields
+    // and the FE-C settings and status which are STORE_HEARTBEAT.
+    void         setStorePolicy(int field, int policy,
+            int heartbeat = ANTPLUS_STORE_HEARTBEAT);
+
     shared_ptr<ANTMetaData> getMetaData(void) {
         return metaData;
     }
@@ -258,17 +825,65 @@ class ANTDevice {
 
     virtual void processMessage(ANTMessage *message);
 
-    void addDatum(std::string name, float val, ant_time_point t);
-    void addDatum(const char *name, float val, ant_time_point t);
+    void addDatum(int field, float val, ant_time_point t);
     void addMetaDatum(std::string name, float val);
     void addMetaDatum(const char *name, float val);
 
+    // Store every field of a page described by an ANTPageTable
+    void decodePage(const ANTPage *page, const uint8_t *data,
+            ant_time_point t);
+
  private:
-    shared_ptr<ANTTsData>        tsData;
+    std::vector<shared_ptr<ANTDeviceData<float>>> tsData;
+    struct StorePolicy {
+        int     policy;
+        int64_t heartbeat;  // ns
+        bool    stored;
+        float   value;
+        int64_t t;
+    };
+    std::vector<StorePolicy> tsPolicy;
+    const char * const *tsFieldNames;
     shared_ptr<ANTMetaData>      metaData;
     bool            storeTsData;
     ANTDeviceID     devID;
+    ant_time_point  startTime;
     pthread_mutex_t thread_lock;
+
+    bool isDuplicate(ANTMessage *message, int receiver);
+    struct DedupEntry {
+        uint8_t payload[8];
+        ant_time_point t;
+    };
+    DedupEntry      dedup[ANTPLUS_DEDUP_HISTORY];
+    int             dedupNext;
+    int64_t         dedupWindow;  // ns
+    uint64_t        duplicates;
+    std::vector<float> rssi;
+    std::vector<ant_time_point> lastHeard;
+    int             preferredReceiver;
+    ANTMessage      heldMessage;
+    bool            held;
+};
+
+/**
+ * @brief Hashed lookup of devices by ANTDeviceID
+ *
+ */
+class ANTDeviceRegistry {
+ public:
+    ANTDeviceRegistry(void);
+    ~ANTDeviceRegistry(void);
+
+    shared_ptr<ANTDevice> find(const ANTDeviceID &id);
+    shared_ptr<ANTDevice> add(shared_ptr<ANTDevice> dev);
+    size_t size(void);
+    std::vector<shared_ptr<ANTDevice>> getDeviceList(void);
+
+ private:
+    std::unordered_map<ANTDeviceID, shared_ptr<ANTDevice>> devices;
+    std::vector<shared_ptr<ANTDevice>> deviceList;
+    pthread_mutex_t registry_lock;
 };
 
 class ANTDeviceNONE : public ANTDevice {
@@ -279,6 +894,22 @@ class ANTDeviceNONE : public ANTDevice {
 
 class ANTDeviceFEC : public ANTDevice {
  public:
+    enum FIELD {
+        FIELD_GENERAL_INST_SPEED = 0,
+        FIELD_SETTINGS_CYCLE_LENGTH,
+        FIELD_SETTINGS_RESISTANCE,
+        FIELD_SETTINGS_INCLINE,
+        FIELD_TRAINER_CADENCE,
+        FIELD_TRAINER_ACC_POWER,
+        FIELD_TRAINER_INST_POWER,
+        FIELD_TRAINER_STATUS,
+        FIELD_TRAINER_FLAGS,
+        FIELD_TRAINER_TARGET_RESISTANCE,
+        FIELD_TRAINER_TARGET_POWER,
+        FIELD_COUNT
+    };
+    static const char* fieldNames[FIELD_COUNT];
+
     explicit ANTDeviceFEC(const ANTDeviceID &id);
     virtual ~ANTDeviceFEC(void) {}
     void processMessage(ANTMessage *message);
@@ -289,33 +920,172 @@ class ANTDeviceFEC : public ANTDevice {
 
 class ANTDevicePWR : public ANTDevice {
  public:
+    enum FIELD {
+        FIELD_BALANCE = 0,
+        FIELD_CADENCE,
+        FIELD_ACC_POWER,
+        FIELD_INST_POWER,
+        FIELD_LEFT_TE,
+        FIELD_RIGHT_TE,
+        FIELD_LEFT_PS,
+        FIELD_RIGHT_PS,
+        FIELD_N_BATTERIES,
+        FIELD_OPERATING_TIME,
+        FIELD_BATTERY_VOLTAGE,
+        FIELD_CRANK_LENGTH,
+        FIELD_CRANK_STATUS,
+        FIELD_SENSOR_STATUS,
+        FIELD_PEAK_TORQUE_THRESHOLD,
+        FIELD_AVG_POWER,
+        FIELD_TORQUE,
+        FIELD_TORQUE_POWER,
+        FIELD_TORQUE_CADENCE,
+        FIELD_WHEEL_SPEED,
+        FIELD_COUNT
+    };
+    static const char* fieldNames[FIELD_COUNT];
+
     explicit ANTDevicePWR(const ANTDeviceID &id);
     virtual ~ANTDevicePWR(void) {}
     void processMessage(ANTMessage *message);
+
+    // Power from the accumulated power (see FIELD_AVG_POWER) over
+    // the last 3 s and 30 s, and the normalized power of the whole
+    // session. NAN until there is enough data.
+    float getPower3s(void);
+    float getPower30s(void);
+    float getNormalizedPower(void);
+
+    // Used for the wheel speed from the wheel torque page (m)
+    void  setWheelCircumference(float c)   { wheelCircumference = c; }
+    float getWheelCircumference(void)      { return wheelCircumference; }
+
+ private:
+    void accumulatePower(const uint8_t *data, ant_time_point t);
+    void accumulateTorque(const uint8_t *data, ant_time_point t);
+    void addPower(ant_time_point t, double power, double dt);
+
+    // Last crank (0x12) or wheel (0x11) torque page
+    struct TorqueAccumulator {
+        bool           valid;
+        uint8_t        eventCount;
+        uint16_t       period;   // 1/2048 s
+        uint16_t       torque;   // 1/32 Nm
+        ant_time_point t;
+    };
+    TorqueAccumulator crankTorque;
+    TorqueAccumulator wheelTorque;
+    // Once torque pages are seen they, not page 0x10, feed the
+    // power windows (meters send both).
+    bool           torqueSource;
+    float          wheelCircumference;
+
+    bool           accValid;
+    uint8_t        lastEventCount;
+    uint16_t       lastAccPower;
+    ant_time_point lastAccTime;
+
+    ANTRollingAverage power3s;
+    ANTRollingAverage power30s;
+    double         npSum;
+    uint64_t       npCount;
+    ant_time_point npNext;
 };
 
 class ANTDeviceHR : public ANTDevice {
  public:
+    enum FIELD {
+        FIELD_HEARTRATE = 0,
+        FIELD_RR_INTERVAL,
+        FIELD_COUNT
+    };
+    static const char* fieldNames[FIELD_COUNT];
+
     explicit ANTDeviceHR(const ANTDeviceID &id);
     virtual ~ANTDeviceHR(void) {}
     void processMessage(ANTMessage *message);
 
+    // HRV (in ms, pNN50 in %) over the last window ms of beats,
+    // NAN until there are enough beats. Missed beats are those the
+    // beat count says happened but we have no RR interval for.
+    void     setHrvWindow(int window);
+    float    getRMSSD(void);
+    float    getSDNN(void);
+    float    getPNN50(void);
+    uint64_t getMissedBeats(void)          { return missedBeats; }
+
  private:
+    void processBeat(bool havePrevious, ant_time_point t);
+
     uint16_t hbEventTime;
     uint16_t previousHbEventTime;
     uint8_t hbCount;
     bool toggled;
     uint8_t lastToggleBit;
+
+    // The beat stream, beat times are rebuilt from the event time
+    // (1/1024 s) relative to the time of the first beat.
+    bool           beatValid;
+    uint8_t        lastHbCount;
+    uint16_t       lastHbEventTime;
+    uint64_t       beatClock;
+    ant_time_point beatStart;
+    ant_time_point lastBeat;
+    bool           lastRRValid;
+    uint64_t       missedBeats;
+    ANTHrv         hrv;
 };
 
 
+/**
+ * @brief Record raw ANT frames to a binary log
+ *
+ * The file starts with the 8 byte magic ANTPLUS_CAPTURE_MAGIC, each
+ * record is the monotonic timestamp in ns (int64), the direction
+ * (uint8), the frame length (uint8) and the frame from the sync byte
+ * to the checksum.
+ */
+class ANTCapture {
+ public:
+    enum {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    enum DIRECTION {
+        DIR_READ = 0,
+        DIR_WRITE = 1
+    };
+    explicit ANTCapture(std::string filename);
+    ~ANTCapture(void);
+    bool isOpen(void)   { return file != NULL; }
+    int record(int dir, const uint8_t *frame, int len, ant_time_point t);
+    int flush(void);
+
+ private:
+    FILE *file;
+    pthread_mutex_t file_lock;
+};
+
 /**
  * @brief
  *
  */
 class ANTInterface {
  public:
-    int reset(void);
+    enum COMMAND {
+        // Command results which are not response codes
+        CMD_ERROR     = -1,
+        CMD_TIMEOUT   = -2,
+        CMD_CANCELLED = -3
+    };
+
+    ANTInterface(void);
+    virtual ~ANTInterface(void);
+
+    // Reset the stick. The future completes with RESPONSE_NO_ERROR
+    // once the stick reports it has started (ANT_NOTIF_STARTUP), or
+    // with CMD_TIMEOUT if it has not within timeout (ms).
+    std::future<int> reset(int timeout = ANTPLUS_RESET_TIMEOUT);
     int setNetworkKey(uint8_t net);
     int assignChannel(uint8_t chanNum, uint8_t chanType,
             uint8_t net, uint8_t ext = 0x00);
@@ -332,6 +1102,88 @@ class ANTInterface {
     virtual int close(void) = 0;
     virtual int sendMessage(ANTMessage *message) = 0;
     virtual int readMessage(std::vector<ANTMessage> *message) = 0;
+
+    // Send several messages, in order, with as few writes as the
+    // interface allows. The default sends them one at a time.
+    virtual int sendMessages(ANTMessage *messages, int n);
+
+    // Event loop support. The read timeout (ms) bounds how long
+    // readMessage() may block, zero means do not block. Interfaces
+    // which can be driven from an external poll() loop return the
+    // descriptors to watch from getPollFds().
+    virtual void setReadTimeout(int timeout) { (void)timeout; }
+    virtual int getPollFds(std::vector<struct pollfd> *fds) {
+        (void)fds;
+        return -1;
+    }
+
+    // True once the device has gone (unplugged, reset or hung up),
+    // other read errors are transient. ANT only reconnects when the
+    // device is lost.
+    virtual bool isDeviceLost(void) { return false; }
+
+    // Get the interface back after the device was lost, waiting for
+    // up to timeout (ms). The default closes and opens again.
+    virtual int reopen(int timeout);
+
+    // Send a command and track its response. The future (and the
+    // callback) complete with the response code from the stick,
+    // RESPONSE_NO_ERROR on success, or with CMD_TIMEOUT if there
+    // was no response within timeout (ms) after the given number
+    // of retries. Commands are matched on channel and message ID,
+    // ones with the same key complete in the order they were sent.
+    // If it can not be sent it completes with CMD_ERROR straight
+    // away.
+    typedef std::function<void(int)> CommandCallback;
+    std::future<int> sendCommand(ANTMessage *message,
+            int timeout = ANTPLUS_COMMAND_TIMEOUT,
+            int retries = ANTPLUS_COMMAND_RETRIES,
+            CommandCallback callback = nullptr);
+    // The same for several commands sent in one batch (see
+    // sendMessages()), with a callback (or nullptr) for each.
+    std::vector<std::future<int>> sendCommands(ANTMessage *messages,
+            int n, int timeout = ANTPLUS_COMMAND_TIMEOUT,
+            int retries = ANTPLUS_COMMAND_RETRIES,
+            const CommandCallback *callbacks = nullptr);
+
+    // Called (by ANT) with each channel event and startup message,
+    // returns true if it was the response to a command we track.
+    bool completeCommand(ANTMessage *response);
+    // Resend, or time out, commands past their deadline
+    void checkCommands(void);
+    // Complete everything in flight with CMD_CANCELLED (e.g. the
+    // stick was lost, so there will be no response)
+    void cancelCommands(void);
+    // Stop resending the commands in flight on chan (e.g. a config
+    // was rolled back). They still take their responses, so newer
+    // commands are not matched to them.
+    void abandonCommands(uint8_t chan);
+    int  getCommandsInFlight(void);
+
+ protected:
+    // Put bytes read from the stick through the reassembler, adding
+    // each whole frame (timestamped and teed to the capture log) to
+    // message. Frames can be split across reads.
+    void processBytes(uint8_t *bytes, int nbytes,
+            std::vector<ANTMessage> *message);
+    ANTReassembler reassembler;
+    shared_ptr<ANTCapture> capture;
+
+ private:
+    struct Command {
+        ANTMessage         message;
+        ant_time_point     deadline;
+        int                timeout;
+        int                retries;
+        std::promise<int>  result;
+        CommandCallback    callback;
+    };
+    std::map<uint16_t, std::deque<Command>> commands;
+    pthread_mutex_t command_lock;
+
+    static uint16_t commandKey(uint8_t chan, uint8_t type) {
+        return (chan << 8) | type;
+    }
 };
 
 /**
@@ -344,22 +1196,308 @@ class ANTUSBInterface : public ANTInterface {
         NOERROR = 0,
         ERROR = -1
     };
-    ANTUSBInterface(void);
+    // Open the index'th attached stick
+    explicit ANTUSBInterface(int index = 0);
     ~ANTUSBInterface(void);
+    static int countDevices(void);
     int open(void);
     int close(void);
     int sendMessage(ANTMessage *message);
+    int sendMessages(ANTMessage *messages, int n);
     int readMessage(std::vector<ANTMessage> *message);
+    void setReadTimeout(int timeout)  { readTimeout = timeout; }
+    int getPollFds(std::vector<struct pollfd> *fds);
+
+    // Reopen the stick after it was unplugged or reset, using
+    // hotplug events (when libusb has them) to wait for it.
+    int reopen(int timeout);
+    bool isDeviceLost(void) {
+        return deviceLost || (usb_handle == NULL);
+    }
+
+    // Tee every frame read and written to a capture log
+    void setCapture(shared_ptr<ANTCapture> c)  { capture = c; }
+
+    // Number of asynchronous read transfers kept in flight.
+    // Zero selects the synchronous (blocking) read path.
+    void setReadTransfers(int n)    { readTransfers = n; }
+    int  getReadTransfers(void)     { return readTransfers; }
+
  private:
     int bulkRead(uint8_t *bytes, int size, int timeout);
     int bulkWrite(uint8_t *bytes, int size, int timeout);
+
+    int startTransfers(void);
+    int stopTransfers(void);
+    int asyncRead(std::vector<ANTMessage> *message);
+    void transferCallback(libusb_transfer *transfer);
+    static void LIBUSB_CALL callTransferCallback(libusb_transfer *transfer) {
+        ((ANTUSBInterface*)transfer->user_data)->transferCallback(transfer);
+    }
+
+    int openDevice(void);
+    int closeDevice(void);
+    void hotplugCallback(libusb_device *dev, libusb_hotplug_event event);
+    static int LIBUSB_CALL callHotplugCallback(libusb_context *ctx,
+            libusb_device *dev, libusb_hotplug_event event, void *data) {
+        (void)ctx;
+        ((ANTUSBInterface*)data)->hotplugCallback(dev, event);
+        return 0;
+    }
+
+    int deviceIndex;
     libusb_context *usb_ctx;
     libusb_device_handle *usb_handle;
     libusb_config_descriptor *usb_config;
     int readEndpoint;
     int writeEndpoint;
+    int writePacketSize;
     int readTimeout;
     int writeTimeout;
+
+    int readTransfers;
+    std::atomic<int> activeTransfers;
+    int transferBytes;
+    std::vector<libusb_transfer*> transfers;
+    // Transfers not in flight (failed), resubmitted on the next read
+    std::vector<libusb_transfer*> idleTransfers;
+    std::vector<uint8_t> transferBuffer;
+    std::vector<ANTMessage> transferQueue;
+    pthread_mutex_t transfer_lock;
+
+    bool hotplug;
+    libusb_hotplug_callback_handle hotplugHandle;
+    std::atomic<bool> deviceLost;
+    std::atomic<bool> deviceArrived;
+    pthread_mutex_t write_lock;
+};
+
+/**
+ * @brief Simulated ANT stick
+ *
+ * Answers the channel configuration commands and broadcasts
+ * HR, power and FE-C pages from a set of virtual sensors, so the
+ * library can be exercised (and load tested) without hardware.
+ * Sensors are heard on the first open channel whose type and
+ * device number match (zero is a wildcard).
+ */
+class ANTSimInterface : public ANTInterface {
+ public:
+    enum rtn {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    ANTSimInterface(void);
+    ~ANTSimInterface(void);
+    int open(void);
+    int close(void);
+    int sendMessage(ANTMessage *message);
+    int readMessage(std::vector<ANTMessage> *message);
+    void setReadTimeout(int timeout)  { readTimeout = timeout; }
+
+    // Add virtual sensors of an ANT+ device type (0x78, 0x0B, 0x11).
+    // addDevices() numbers them from firstID upwards.
+    int addDevice(uint8_t type, uint16_t id, uint8_t transType = 0x01);
+    int addDevices(uint8_t type, int n, uint16_t firstID = 1);
+
+    // Broadcast rate as a multiple of the ANT+ channel period,
+    // fraction of broadcasts lost and the timing jitter (us).
+    void setRate(float r)            { rate = r; }
+    void setLoss(float l)            { loss = l; }
+    void setJitter(int j)            { jitter = j; }
+    void setSeed(uint32_t seed)      { rng.seed(seed); }
+    // Signal level (dBm) reported when RSSI is enabled
+    void setRSSI(int r)              { rssi = r; }
+
+    // Simulate the stick being unplugged (and plugged back in),
+    // while disconnected reads fail and open() does not work.
+    void setConnected(bool c);
+    bool isDeviceLost(void);
+
+    uint64_t getSent(void)           { return sent; }
+    uint64_t getLost(void)           { return lost; }
+
+ private:
+    struct SimDevice {
+        ANTDeviceID id;
+        int64_t period;       // ns
+        ant_time_point next;
+        uint32_t count;
+        double simTime;       // s, sensor time
+        double nextBeat;      // s
+        uint16_t beatTime;    // 1/1024 s
+        uint16_t prevBeatTime;
+        uint8_t beatCount;
+        uint16_t accPower;
+    };
+    struct SimChannel {
+        bool open;
+        uint8_t type;
+        uint16_t id;
+    };
+
+    void respond(uint8_t chan, uint8_t msg, uint8_t code);
+    int generate(ant_time_point now, std::vector<ANTMessage> *message,
+            ant_time_point *nextDue);
+    void makePage(SimDevice *dev, uint8_t *data);
+    int findChannel(ANTDeviceID id);
+
+    bool isOpen;
+    bool connected;
+    int readTimeout;
+    float rate;
+    float loss;
+    int jitter;
+    int rssi;
+    uint8_t libConfig;
+    uint64_t sent;
+    uint64_t lost;
+
+    std::vector<SimDevice> devices;
+    SimChannel channels[ANTPLUS_SIM_CHANNELS];
+    std::vector<ANTMessage> pending;
+    std::mt19937 rng;
+
+    pthread_mutex_t sim_lock;
+    pthread_cond_t sim_cond;
+};
+
+/**
+ * @brief ANT network processor on a serial port (UART)
+ *
+ * The port is opened non-blocking in raw mode and reads wait on epoll,
+ * so the framing is identical to the USB stick (the byte stream goes
+ * through the same reassembler).
+ */
+class ANTSerialInterface : public ANTInterface {
+ public:
+    enum {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    explicit ANTSerialInterface(std::string device, int baud = 57600);
+    ~ANTSerialInterface(void);
+    int open(void);
+    int close(void);
+    int sendMessage(ANTMessage *message);
+    int sendMessages(ANTMessage *messages, int n);
+    int readMessage(std::vector<ANTMessage> *message);
+    void setReadTimeout(int timeout)  { readTimeout = timeout; }
+    int getPollFds(std::vector<struct pollfd> *fds);
+    bool isDeviceLost(void)          { return deviceLost || (fd < 0); }
+
+    // Settings used the next time the port is opened
+    void setBaudRate(int b)          { baud = b; }
+    int getBaudRate(void)            { return baud; }
+    void setFlowControl(bool f)      { flowControl = f; }
+
+    void setCapture(shared_ptr<ANTCapture> c)  { capture = c; }
+
+ private:
+    int writeBytes(uint8_t *bytes, int size);
+
+    std::string device;
+    int baud;
+    bool flowControl;
+    int fd;
+    int epollFd;
+    bool deviceLost;
+    int readTimeout;
+    int writeTimeout;
+    // Commands are sent from several threads, a frame must go
+    // out (and into the capture log) whole and in order
+    pthread_mutex_t write_lock;
+};
+
+/**
+ * @brief Replay a capture log made with ANTCapture
+ *
+ * Frames read from the stick are played back with their original
+ * spacing scaled by the replay speed (zero plays back as fast as the
+ * library can take them). Message timestamps keep the captured spacing,
+ * starting from the time the replay started. Anything sent to the
+ * interface is discarded.
+ */
+class ANTReplayInterface : public ANTInterface {
+ public:
+    enum {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    explicit ANTReplayInterface(std::string filename);
+    ~ANTReplayInterface(void);
+    int open(void);
+    int close(void);
+    int sendMessage(ANTMessage *message);
+    int readMessage(std::vector<ANTMessage> *message);
+    void setReadTimeout(int timeout)  { readTimeout = timeout; }
+
+    void setSpeed(float s)           { speed = s; }
+    float getSpeed(void)             { return speed; }
+    bool isDone(void)                { return done; }
+    uint64_t getFrames(void)         { return frames; }
+
+ private:
+    int nextRecord(void);
+
+    std::string filename;
+    FILE *file;
+    int readTimeout;
+    float speed;
+    bool done;
+    uint64_t frames;
+
+    bool started;
+    int64_t firstTs;
+    ant_time_point replayStart;
+
+    int64_t recTs;
+    uint8_t recDir;
+    uint8_t recLen;
+    uint8_t recFrame[256];
+};
+
+class ANTChannel;
+
+/**
+ * @brief Pool of threads processing channel messages
+ *
+ * Channels are sharded onto the workers by channel number, so all
+ * messages for a channel are handled in order by the same thread.
+ */
+class ANTWorkerPool {
+ public:
+    enum {
+        NOERROR = 0,
+        ERROR = -1
+    };
+    explicit ANTWorkerPool(int nWorkers = 1);
+    ~ANTWorkerPool(void);
+
+    int submit(ANTChannel *channel, ANTMessage *message);
+    int stop(void);
+    int getNumWorkers(void) { return workers.size(); }
+
+ private:
+    struct Task {
+        ANTChannel *channel;
+        ANTMessage message;
+    };
+    struct Worker {
+        Worker(void) : queue(ANTPLUS_QUEUE_SIZE) {}
+        ANTWorkerPool *pool;
+        ANTRingBuffer<Task> queue;
+        pthread_t threadId;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    bool threadRun;
+
+    static void* callThread(void *ctx) {
+        Worker *w = (Worker*)ctx;
+        return w->pool->thread(w);
+    }
+    void* thread(Worker *w);
 };
 
 /**
@@ -408,7 +1546,8 @@ class ANTChannel {
         STATE_CLOSED         = 9
     };
 
-    ANTChannel(int type, int num, shared_ptr<ANTInterface> interface);
+    ANTChannel(int type, int num, shared_ptr<ANTInterface> interface,
+            shared_ptr<ANTWorkerPool> pool = nullptr);
     ~ANTChannel(void);
 
     int             getChannelNum(void)          { return channelNum; }
@@ -422,27 +1561,97 @@ class ANTChannel {
     int             getType(void)                { return type; }
     int             getState(void)               { return currentState; }
     ANTDeviceParams getDeviceParams(void)        { return deviceParams; }
-
+    void            setStartTime(ant_time_point t) { startTime = t; }
+    void            setRetention(size_t maxSamples, int window,
+            shared_ptr<ANTDataSink> sink = nullptr);
+
+    // Start opening the channel and return straight away. The
+    // future (and the callback, if given) completes with NOERROR
+    // from the listener (or runOnce()) as soon as the channel is
+    // open, or with ERROR if the config fails. Use wait_for() on
+    // the future to bound how long to wait.
+    typedef std::function<void(int)> OpenCallback;
+    std::future<int> openAsync(int type, uint16_t id = 0x0000,
+            OpenCallback callback = nullptr);
     int open(int type, uint16_t id = 0x0000, bool wait = true);
     int close(void);
 
+    // Configure the channel again with its last settings
+    // (after the stick was reset), idle channels are left alone
+    int  reopen(void);
+
     int  processEvent(ANTMessage *m);
     void parseMessage(ANTMessage *message);
+    void dispatchMessage(ANTMessage *m);
     int  processId(ANTMessage *m);
 
     shared_ptr<ANTDevice> addDevice(ANTDeviceID *id);
     std::vector<shared_ptr<ANTDevice>> getDeviceList(void) {
-        return deviceList;
+        return registry->getDeviceList();
+    }
+    shared_ptr<ANTDeviceRegistry> getRegistry(void) {
+        return registry;
+    }
+    // Share a registry between channels (and sticks), this
+    // should be done before the channel is opened.
+    void setRegistry(shared_ptr<ANTDeviceRegistry> r) {
+        registry = r;
     }
 
+    // Which receiver (stick) this channel belongs to and the
+    // duplicate window given to its devices (see ANTDevice).
+    void setReceiver(int r)                { receiver = r; }
+    int  getReceiver(void)                 { return receiver; }
+    void setDedupWindow(int window);
+
+    // When pipelined (the default) open() sends the whole channel
+    // config in one batch, tracked by the interface (with deadlines
+    // and retries) as the responses come back, otherwise each
+    // command waits for the previous response.
+    void setPipelined(bool p)              { pipelined = p; }
+    bool getPipelined(void)                { return pipelined; }
+
  private:
-    int startThread(void);
-    int stopThread(void);
+    // A command in a config batch, the state to move to when it
+    // succeeds (-1 to stay put) and if the config fails without it.
+    struct ConfigStep {
+        int     state;
+        bool    required;
+    };
+    // A batch in flight, the channel moves to state once all the
+    // required commands have succeeded. Only the latest batch (gen)
+    // may change the state.
+    struct ConfigBatch {
+        int     gen;
+        int     state;
+        std::atomic<int>  remaining;
+        std::atomic<bool> failed;
+    };
+
     int changeStateTo(int state);
+    void setState(int state);
+    void completeOpen(int rc);
+    void configure(void);
+    void sendConfig(ANTMessage *msg, const ConfigStep *steps, int n,
+            int state);
+    void configResponse(shared_ptr<ConfigBatch> batch, uint8_t command,
+            ConfigStep step, int code);
+    void rollback(void);
+
+    bool     pipelined;
+    std::atomic<int> configGen;
+    // Closes sent by rollback() whose EVENT_CHANNEL_CLOSED is due
+    std::atomic<int> staleCloses;
+
+    // The open in progress, if any
+    std::promise<int> openPromise;
+    OpenCallback openCallback;
+    bool     openPending;
+    pthread_mutex_t open_lock;
 
     int      channelStartTimeout;
     uint8_t  network;
-    int      currentState;
+    std::atomic<int> currentState;
     uint8_t  channelType;
     uint8_t  channelTypeExtended;
     int      channelNum;
@@ -451,20 +1660,16 @@ class ANTChannel {
     int      type;
     uint16_t deviceId;
     bool     autoOpen;
+    ant_time_point startTime;
+    size_t   retentionSamples;
+    int      retentionWindow;
+    shared_ptr<ANTDataSink> retentionSink;
+    int      receiver;
+    int      dedupWindow;
     shared_ptr<ANTInterface> iface;
     ANTDeviceParams deviceParams;
-    std::vector<shared_ptr<ANTDevice>> deviceList;
-
-    bool     threadRun;
-    pthread_t       threadId;
-    pthread_mutex_t message_lock;
-    pthread_cond_t  message_cond;
-    static void* callThread(void *ctx) {
-        return ((ANTChannel*)ctx)->thread();
-    }
-    void *thread(void);
-
-    std::queue<ANTMessage> messageQueue;
+    shared_ptr<ANTDeviceRegistry> registry;
+    shared_ptr<ANTWorkerPool> workerPool;
 };
 
 /**
@@ -478,11 +1683,41 @@ class ANT {
         ERROR = -1
     };
 
-    explicit ANT(shared_ptr<ANTInterface> iface, int nChannels = 8);
+    enum MODE {
+        MODE_THREADED = 0,
+        MODE_EVENT_LOOP = 1
+    };
+
+    explicit ANT(shared_ptr<ANTInterface> iface, int nChannels = 8,
+            int nWorkers = 1, int mode = MODE_THREADED);
     ~ANT(void);
 
     int init(void);
 
+    // Event loop mode. No threads are started, the caller drives
+    // the library by calling runOnce() (or by watching the fds from
+    // getPollFds() and calling runOnce(0) when they are ready).
+    // Channels must be opened with wait = false in this mode as
+    // their responses are only processed from runOnce().
+    int runOnce(int timeout);
+    int getPollFds(std::vector<struct pollfd> *fds) {
+        return iface->getPollFds(fds);
+    }
+    int getMode(void) {
+        return mode;
+    }
+
+    // Reopen the interface and restore the channels that were
+    // in use, waiting up to timeout (ms). The listener does this
+    // when reading fails, the data already collected is kept.
+    int reconnect(int timeout = ANTPLUS_RECONNECT_TIMEOUT);
+
+    // Number of channels which are not idle
+    int getLoad(void);
+    void setRegistry(shared_ptr<ANTDeviceRegistry> registry);
+    void setReceiver(int receiver);
+    void setDedupWindow(int window);
+
     shared_ptr<ANTChannel> getChannel(uint8_t chan);
     std::vector<shared_ptr<ANTChannel>> getChannels(void) {
         return antChannel;
@@ -493,6 +1728,9 @@ class ANT {
     void setPollTime(int t) {
         pollTime = t;
     }
+    // Device data is timestamped relative to the start time. Set it
+    // before opening channels so that several sticks share one.
+    void setStartTime(ant_time_point t);
     ant_time_point getStartTime(void) {
         return startTime;
     }
@@ -503,21 +1741,28 @@ class ANT {
 
     shared_ptr<ANTInterface> iface;
     std::vector<shared_ptr<ANTChannel>> antChannel;
-    std::queue<ANTMessage> messageQueue;
+    shared_ptr<ANTWorkerPool> workerPool;
+    ANTRingBuffer<ANTMessage> messageQueue;
+    std::vector<ANTMessage> loopMessages;
 
+    int mode;
     pthread_t listenerId;
     pthread_t pollerId;
     pthread_t processorId;
-    pthread_mutex_t message_lock;
-    pthread_cond_t message_cond;
     bool threadRun;
     int pollTime;
+    ant_time_point pollStart;
 
     int startThreads(void);
     int stopThreads(void);
     void* listenerThread(void);
     void* pollerThread(void);
     void* processorThread(void);
+    void processMessage(ANTMessage *m);
+    // Queue what was read for the processor, or process it
+    // now in event loop mode
+    void handleMessages(std::vector<ANTMessage> *message);
+    bool pollChannels(void);
     static void* callListenerThread(void *ctx) {
         return ((ANT*)ctx)->listenerThread();
     }
@@ -529,4 +1774,66 @@ class ANT {
     }
 };
 
+/**
+ * @brief Run several ANT sticks as one
+ *
+ * Each interface gets its own ANT instance. Channels are numbered
+ * across all of them in the order the interfaces were added, new
+ * channels are opened on the least loaded stick and all channels
+ * share one device registry and start time.
+ */
+class ANTAggregator {
+ public:
+    enum RETURN {
+        NOERROR = 0,
+        ERROR = -1
+    };
+
+    explicit ANTAggregator(int nWorkers = 1,
+            int mode = ANT::MODE_THREADED);
+    ~ANTAggregator(void);
+
+    int addInterface(shared_ptr<ANTInterface> iface, int nChannels = 8);
+    int addUSBInterfaces(int nChannels = 8);
+    int init(void);
+    int runOnce(int timeout);
+
+    shared_ptr<ANTChannel> openChannel(int type, uint16_t id = 0x0000,
+            bool wait = true);
+    shared_ptr<ANTChannel> getChannel(int chan);
+    std::vector<shared_ptr<ANTChannel>> getChannels(void);
+    int getNumChannels(void);
+    int getNumInterfaces(void) {
+        return ants.size();
+    }
+    shared_ptr<ANT> getANT(int n);
+
+    shared_ptr<ANTDeviceRegistry> getRegistry(void) {
+        return registry;
+    }
+    std::vector<shared_ptr<ANTDevice>> getDeviceList(void) {
+        return registry->getDeviceList();
+    }
+
+    // Copies of a page heard by several sticks within window (ms)
+    // are only processed once, zero keeps every copy.
+    void setDedupWindow(int window);
+    int  getDedupWindow(void) {
+        return dedupWindow;
+    }
+
+    // Data from every stick is timestamped relative to this time
+    ant_time_point getStartTime(void) {
+        return startTime;
+    }
+
+ private:
+    int nWorkers;
+    int mode;
+    int dedupWindow;
+    ant_time_point startTime;
+    std::vector<shared_ptr<ANT>> ants;
+    shared_ptr<ANTDeviceRegistry> registry;
+};
+
 #endif  // ANTPLUS_LIB_ANTPLUS_H_
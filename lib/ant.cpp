@@ -25,6 +25,7 @@
 //
 
 #include <unistd.h>
+#include <sched.h>
 
 #include <cstdio>
 #include <chrono>
@@ -36,36 +37,49 @@
 #include "antdebug.h"
 #include "antdefs.h"
 
-ANT::ANT(shared_ptr<ANTInterface> interface, int nChannels) {
+ANT::ANT(shared_ptr<ANTInterface> interface, int nChannels, int nWorkers,
+        int m) {
     threadRun     = false;
     pollTime      = 2000;  // ms
     extMessages   = true;
+    mode          = m;
 
     iface = interface;
     iface->open();
 
+    // Set the start time
+    startTime = ant_clock::now();
+    pollStart = startTime;
+
+    // In event loop mode there is no pool, the channels
+    // process messages on the thread calling runOnce()
+    if (mode == MODE_THREADED) {
+        DEBUG_PRINT("Creating %d workers.\n", nWorkers);
+        workerPool = std::make_shared<ANTWorkerPool>(nWorkers);
+    }
+
     DEBUG_PRINT("Creating %d channels.\n", nChannels);
     for (int i=0; i < nChannels; i++) {
         antChannel.push_back(shared_ptr<ANTChannel>
-            (new ANTChannel(ANTChannel::TYPE_NONE, i, iface)));
+            (new ANTChannel(ANTChannel::TYPE_NONE, i, iface, workerPool)));
+        antChannel.back()->setStartTime(startTime);
     }
 
-    // Set the start time
-    startTime = ant_clock::now();
-
-    // Setup the mutexes
-    pthread_mutex_init(&message_lock, NULL);
-    pthread_cond_init(&message_cond, NULL);
-
     // Start the threads
-    startThreads();
+    if (mode == MODE_THREADED) {
+        startThreads();
+    }
 }
 
 ANT::~ANT(void) {
     // Stop the threads
-    stopThreads();
-    pthread_mutex_destroy(&message_lock);
-    pthread_cond_destroy(&message_cond);
+    if (mode == MODE_THREADED) {
+        stopThreads();
+    }
+
+    // The channels go with us, so their callbacks must be
+    // done with before the interface (which may outlive us).
+    iface->cancelCommands();
 }
 
 shared_ptr<ANTChannel> ANT::getChannel(uint8_t chan) {
@@ -77,8 +91,89 @@ shared_ptr<ANTChannel> ANT::getChannel(uint8_t chan) {
     return nullptr;
 }
 
+int ANT::reconnect(int timeout) {
+    // Nothing in flight will be answered now
+    iface->cancelCommands();
+
+    if (iface->reopen(timeout)) {
+        return ERROR;
+    }
+
+    DEBUG_COMMENT("Interface reopened, restoring channels\n");
+
+    // Reset, set the key again and put back every channel
+    // which was in use. Their devices and data are kept.
+    init();
+    for (auto chan : antChannel) {
+        chan->reopen();
+    }
+
+    return NOERROR;
+}
+
+int ANT::getLoad(void) {
+    int load = 0;
+    for (auto chan : antChannel) {
+        int state = chan->getState();
+        if ((state != ANTChannel::STATE_IDLE)
+                && (state != ANTChannel::STATE_CLOSED)) {
+            load++;
+        }
+    }
+
+    return load;
+}
+
+void ANT::setRegistry(shared_ptr<ANTDeviceRegistry> registry) {
+    for (auto chan : antChannel) {
+        chan->setRegistry(registry);
+    }
+}
+
+void ANT::setReceiver(int receiver) {
+    for (auto chan : antChannel) {
+        chan->setReceiver(receiver);
+    }
+}
+
+void ANT::setDedupWindow(int window) {
+    for (auto chan : antChannel) {
+        chan->setDedupWindow(window);
+    }
+}
+
+void ANT::setStartTime(ant_time_point t) {
+    startTime = t;
+    for (auto chan : antChannel) {
+        chan->setStartTime(t);
+    }
+}
+
 int ANT::init(void) {
-    iface->reset();
+    // Wait for the stick to start before sending it anything else.
+    // The listener reads the reply if it is running (and we are not
+    // it), otherwise we read until it comes in.
+    std::future<int> started = iface->reset();
+
+    bool listening = threadRun
+        && !pthread_equal(pthread_self(), listenerId);
+
+    std::vector<ANTMessage> message;
+    while (!listening && (started.wait_for(std::chrono::seconds(0))
+                != std::future_status::ready)) {
+        message.clear();
+        if (iface->readMessage(&message) <= 0) {
+            usleep(1000);
+        }
+        handleMessages(&message);
+        iface->checkCommands();
+    }
+
+    if (started.get() != RESPONSE_NO_ERROR) {
+        DEBUG_COMMENT("No startup message after reset\n");
+        return ERROR;
+    }
+
     iface->setNetworkKey(0);
 
     return NOERROR;
@@ -104,7 +199,7 @@ int ANT::stopThreads(void) {
     threadRun = false;
 
     // Wakeup the processor thread
-    pthread_cond_signal(&message_cond);
+    messageQueue.notify();
 
     pthread_join(listenerId, NULL);
     DEBUG_COMMENT("Listener Thread Joined.\n");
@@ -115,36 +210,22 @@ int ANT::stopThreads(void) {
     pthread_join(processorId, NULL);
     DEBUG_COMMENT("Processor Thread Joined.\n");
 
+    // Workers hold pointers to the channels, so
+    // make sure they are done before we go away
+    workerPool->stop();
+    DEBUG_COMMENT("Worker Threads Joined.\n");
+
     return NOERROR;
 }
 
 void* ANT::pollerThread(void) {
     DEBUG_COMMENT("Poller Thread Started\n");
 
-    ant_time_point pollStart = ant_clock::now();
+    pollStart = ant_clock::now();
 
     while (threadRun) {
-        ant_time_point now = ant_clock::now();
-
-        auto poll = std::chrono::duration_cast
-            <std::chrono::milliseconds> (now - pollStart);
-
-        if (poll.count() >= getPollTime()) {
-            for (auto chan : antChannel) {
-                int state = chan->getState();
-                if ((state == ANTChannel::STATE_OPEN_UNPAIRED) ||
-                        (state == ANTChannel::STATE_OPEN_PAIRED)) {
-                    if (chan->getType() == ANTChannel::TYPE_FEC) {
-                        iface->requestDataPage(chan->getChannelNum(),
-                                ANT_DEVICE_COMMON_STATUS);
-                        DEBUG_COMMENT("Polling completed\n");
-                    }
-                }
-            }
-
-            pollStart = ant_clock::now();
-
-        } else {
+        iface->checkCommands();
+        if (!pollChannels()) {
             usleep(ANTPLUS_SLEEP_DURATION);  // be a nice thread ...
         }
     }
@@ -152,60 +233,145 @@ void* ANT::pollerThread(void) {
     return NULL;
 }
 
+bool ANT::pollChannels(void) {
+    auto poll = std::chrono::duration_cast
+        <std::chrono::milliseconds> (ant_clock::now() - pollStart);
+
+    if (poll.count() < getPollTime()) {
+        return false;
+    }
+
+    for (auto chan : antChannel) {
+        int state = chan->getState();
+        if ((state == ANTChannel::STATE_OPEN_UNPAIRED) ||
+                (state == ANTChannel::STATE_OPEN_PAIRED)) {
+            if (chan->getType() == ANTChannel::TYPE_FEC) {
+                iface->requestDataPage(chan->getChannelNum(),
+                        ANT_DEVICE_COMMON_STATUS);
+                DEBUG_COMMENT("Polling completed\n");
+            }
+        }
+    }
+
+    pollStart = ant_clock::now();
+    return true;
+}
+
 void* ANT::listenerThread(void) {
     DEBUG_COMMENT("Listener Thread Started\n");
 
+    std::vector<ANTMessage> message;
     while (threadRun) {
-        std::vector<ANTMessage> message;
-        iface->readMessage(&message);
-        pthread_mutex_lock(&message_lock);
-        for (ANTMessage& m : message) {
-            messageQueue.push(m);
+        message.clear();
+        if (iface->readMessage(&message) < 0) {
+            if (!iface->isDeviceLost()) {
+                // A transient error, don't spin if it persists
+                DEBUG_COMMENT("Read failed, retrying\n");
+                usleep(1000);
+                continue;
+            }
+
+            // Lost the stick (unplugged or reset), keep
+            // trying to get it back until we are stopped.
+            while (threadRun && reconnect()) {
+                DEBUG_COMMENT("Reconnect failed, retrying\n");
+            }
+            continue;
         }
-        pthread_cond_signal(&message_cond);
-        pthread_mutex_unlock(&message_lock);
+        handleMessages(&message);
     }
 
     return NULL;
 }
 
-void* ANT::processorThread(void) {
-    while (threadRun) {
-        pthread_mutex_lock(&message_lock);
-        pthread_cond_wait(&message_cond, &message_lock);
+void ANT::handleMessages(std::vector<ANTMessage> *message) {
+    if (mode == MODE_EVENT_LOOP) {
+        for (ANTMessage& m : *message) {
+            processMessage(&m);
+        }
+        return;
+    }
 
-        // Check if we woke up becuase of queued
-        // messages
-        if (messageQueue.empty()) {
-            pthread_mutex_unlock(&message_lock);
-            continue;
+    for (ANTMessage& m : *message) {
+        // Apply backpressure rather than drop messages, this
+        // matters when the interface can outrun the processor
+        // (e.g. replaying a capture at full speed).
+        while (messageQueue.full() && threadRun) {
+            sched_yield();
         }
+        if (!messageQueue.push(m)) {
+            DEBUG_COMMENT("Message queue full, dropping message\n");
+        }
+    }
+}
 
-        ANTMessage m = messageQueue.front();
-        messageQueue.pop();
-
-        pthread_mutex_unlock(&message_lock);
-
-        switch (m.getType()) {
-            case ANT_NOTIF_STARTUP:
-                DEBUG_COMMENT("RESET OK\n");
-                break;
-            case ANT_CHANNEL_EVENT:
-                antChannel[m.getChannel()]->processEvent(&m);
-                break;
-            case ANT_CHANNEL_ID:
-                antChannel[m.getChannel()]->processId(&m);
-                break;
-            case ANT_BROADCAST_DATA:
-            case ANT_ACK_DATA:
-                antChannel[m.getChannel()]->parseMessage(&m);
-                break;
-            default:
-                DEBUG_PRINT("UNKNOWN TYPE 0x%02X\n",
-                        m.getType());
-                break;
+void* ANT::processorThread(void) {
+    ANTMessage batch[ANTPLUS_QUEUE_BATCH];
+
+    while (threadRun) {
+        size_t n = messageQueue.wait(batch, ANTPLUS_QUEUE_BATCH,
+                ANTPLUS_SLEEP_DURATION);
+        for (size_t i = 0; i < n; i++) {
+            processMessage(&batch[i]);
         }
     }
 
     return NULL;
 }
+
+int ANT::runOnce(int timeout) {
+    if (mode != MODE_EVENT_LOOP) {
+        DEBUG_COMMENT("runOnce() called when not in event loop mode\n");
+        return ERROR;
+    }
+
+    // Read whatever is available (waiting at most timeout ms)
+    // and process it inline, then do any polling which is due.
+    loopMessages.clear();
+    iface->setReadTimeout(timeout);
+    int rc = iface->readMessage(&loopMessages);
+    if ((rc < 0) && iface->isDeviceLost()) {
+        // One attempt per call, the caller keeps calling
+        if (!reconnect(timeout)) {
+            rc = 0;
+        }
+    }
+
+    handleMessages(&loopMessages);
+
+    iface->checkCommands();
+    pollChannels();
+
+    if (rc < 0) {
+        return ERROR;
+    }
+
+    return loopMessages.size();
+}
+
+void ANT::processMessage(ANTMessage *m) {
+    switch (m->getType()) {
+        case ANT_NOTIF_STARTUP:
+            DEBUG_COMMENT("RESET OK\n");
+            iface->completeCommand(m);
+            break;
+        case ANT_CHANNEL_EVENT:
+            // Responses to commands we track are handled by their
+            // callbacks, everything else goes to the channel.
+            if (!iface->completeCommand(m)) {
+                antChannel[m->getChannel()]->processEvent(m);
+            }
+            break;
+        case ANT_CHANNEL_ID:
+            antChannel[m->getChannel()]->processId(m);
+            break;
+        case ANT_BROADCAST_DATA:
+        case ANT_ACK_DATA:
+            antChannel[m->getChannel()]->parseMessage(m);
+            break;
+        default:
+            DEBUG_PRINT("UNKNOWN TYPE 0x%02X\n",
+                    m->getType());
+            break;
+    }
+}
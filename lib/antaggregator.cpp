@@ -0,0 +1,186 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antaggregator.h"
+#include "antdebug.h"
+
+ANTAggregator::ANTAggregator(int workers, int m) {
+    nWorkers = workers;
+    mode     = m;
+    registry = std::make_shared<ANTDeviceRegistry>();
+
+    dedupWindow = ANTPLUS_DEDUP_WINDOW;
+
+    // One time origin for every stick, each ANT would otherwise
+    // take its own once its stick had been opened.
+    startTime = ant_clock::now();
+}
+
+ANTAggregator::~ANTAggregator(void) {
+}
+
+int ANTAggregator::addInterface(shared_ptr<ANTInterface> iface,
+        int nChannels) {
+    auto ant = std::make_shared<ANT>(iface, nChannels, nWorkers, mode);
+    ant->setRegistry(registry);
+    ant->setStartTime(startTime);
+    ant->setReceiver(ants.size());
+    ant->setDedupWindow(dedupWindow);
+    ants.push_back(ant);
+
+    DEBUG_PRINT("Added interface %d with %d channels\n",
+            (int)ants.size() - 1, nChannels);
+
+    return NOERROR;
+}
+
+int ANTAggregator::addUSBInterfaces(int nChannels) {
+    int n = ANTUSBInterface::countDevices();
+    DEBUG_PRINT("Found %d USB sticks\n", n);
+
+    for (int i = 0; i < n; i++) {
+        auto iface = std::make_shared<ANTUSBInterface>(i);
+        addInterface(iface, nChannels);
+    }
+
+    return n;
+}
+
+void ANTAggregator::setDedupWindow(int window) {
+    dedupWindow = window;
+    for (auto ant : ants) {
+        ant->setDedupWindow(window);
+    }
+}
+
+int ANTAggregator::init(void) {
+    int rtn = NOERROR;
+    for (auto ant : ants) {
+        if (ant->init()) {
+            rtn = ERROR;
+        }
+    }
+
+    return rtn;
+}
+
+int ANTAggregator::runOnce(int timeout) {
+    // Only the first interface waits, the rest are
+    // serviced with whatever they have ready.
+    int count = 0;
+    for (auto ant : ants) {
+        int n = ant->runOnce(timeout);
+        if (n < 0) {
+            return ERROR;
+        }
+        count += n;
+        timeout = 0;
+    }
+
+    return count;
+}
+
+shared_ptr<ANTChannel> ANTAggregator::openChannel(int type, uint16_t id,
+        bool wait) {
+    // Pick the least loaded stick which has a free channel
+    shared_ptr<ANTChannel> chan = nullptr;
+    int minLoad = 0;
+
+    for (auto ant : ants) {
+        int load = ant->getLoad();
+        if ((chan != nullptr) && (load >= minLoad)) {
+            continue;
+        }
+
+        for (auto c : ant->getChannels()) {
+            if (c->getState() == ANTChannel::STATE_IDLE) {
+                chan = c;
+                minLoad = load;
+                break;
+            }
+        }
+    }
+
+    if (chan == nullptr) {
+        DEBUG_COMMENT("No free channels\n");
+        return nullptr;
+    }
+
+    if (chan->open(type, id, wait)) {
+        return nullptr;
+    }
+
+    return chan;
+}
+
+shared_ptr<ANTChannel> ANTAggregator::getChannel(int chan) {
+    if (chan < 0) {
+        return nullptr;
+    }
+
+    for (auto ant : ants) {
+        int n = ant->getChannels().size();
+        if (chan < n) {
+            return ant->getChannel(chan);
+        }
+        chan -= n;
+    }
+
+    return nullptr;
+}
+
+std::vector<shared_ptr<ANTChannel>> ANTAggregator::getChannels(void) {
+    std::vector<shared_ptr<ANTChannel>> channels;
+    for (auto ant : ants) {
+        for (auto c : ant->getChannels()) {
+            channels.push_back(c);
+        }
+    }
+
+    return channels;
+}
+
+int ANTAggregator::getNumChannels(void) {
+    int n = 0;
+    for (auto ant : ants) {
+        n += ant->getChannels().size();
+    }
+
+    return n;
+}
+
+shared_ptr<ANT> ANTAggregator::getANT(int n) {
+    if ((n < 0) || (n >= (int)ants.size())) {
+        return nullptr;
+    }
+
+    return ants[n];
+}
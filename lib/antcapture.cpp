@@ -0,0 +1,92 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "antplus.h"
+#include "antcapture.h"
+#include "antdebug.h"
+
+ANTCapture::ANTCapture(std::string filename) {
+    pthread_mutex_init(&file_lock, NULL);
+
+    file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        DEBUG_PRINT("Unable to open %s\n", filename.c_str());
+        return;
+    }
+
+    fwrite(ANTPLUS_CAPTURE_MAGIC, 1, strlen(ANTPLUS_CAPTURE_MAGIC), file);
+}
+
+ANTCapture::~ANTCapture(void) {
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    pthread_mutex_destroy(&file_lock);
+}
+
+int ANTCapture::record(int dir, const uint8_t *frame, int len,
+        ant_time_point t) {
+    if ((file == NULL) || (len < 0) || (len > 255)) {
+        return ERROR;
+    }
+
+    int64_t ts = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (t.time_since_epoch()).count();
+    uint8_t recDir = dir;
+    uint8_t recLen = len;
+
+    pthread_mutex_lock(&file_lock);
+    fwrite(&ts, sizeof(ts), 1, file);
+    fwrite(&recDir, sizeof(recDir), 1, file);
+    fwrite(&recLen, sizeof(recLen), 1, file);
+    size_t rc = fwrite(frame, 1, len, file);
+    pthread_mutex_unlock(&file_lock);
+
+    if (rc != (size_t)len) {
+        DEBUG_COMMENT("Error writing to capture\n");
+        return ERROR;
+    }
+
+    return NOERROR;
+}
+
+int ANTCapture::flush(void) {
+    if (file == NULL) {
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&file_lock);
+    int rc = fflush(file);
+    pthread_mutex_unlock(&file_lock);
+
+    return rc ? ERROR : NOERROR;
+}
@@ -43,7 +43,8 @@ ANTDeviceParams antDeviceParams[] = {
 };
 
 ANTChannel::ANTChannel(int type, int num,
-        shared_ptr<ANTInterface> interface) {
+        shared_ptr<ANTInterface> interface,
+        shared_ptr<ANTWorkerPool> pool) {
     network             = 0x00;
     searchTimeout       = 0x05;
     channelNum          = num;
@@ -53,89 +54,44 @@ ANTChannel::ANTChannel(int type, int num,
     deviceId            = 0x0000;
     extended            = 0x00;
     iface               = interface;
-    threadRun           = true;
+    workerPool          = pool;
     channelStartTimeout = 5;  // seconds
     autoOpen            = true;
+    retentionSamples    = 0;
+    retentionWindow     = 0;
+    registry            = std::make_shared<ANTDeviceRegistry>();
+    receiver            = 0;
+    dedupWindow         = 0;
+    pipelined           = true;
+    openPending         = false;
+    configGen           = 0;
+    staleCloses         = 0;
+
+    pthread_mutex_init(&open_lock, NULL);
 
     setType(type);
-
-    // Setup the mutexes
-    pthread_mutex_init(&message_lock, NULL);
-    pthread_cond_init(&message_cond, NULL);
-
-    // Start the thread
-    startThread();
 }
 
 ANTChannel::~ANTChannel(void) {
-    stopThread();
-    pthread_mutex_destroy(&message_lock);
-    pthread_cond_destroy(&message_cond);
-}
-
-int ANTChannel::startThread(void) {
-    threadRun = true;
-
-    DEBUG_COMMENT("Starting channel thread ...\n");
-    pthread_create(&threadId, NULL, callThread, (void *)this);
-
-    return NOERROR;
-}
-
-int ANTChannel::stopThread(void) {
-    DEBUG_COMMENT("Stopping threads.....\n");
-    threadRun = false;
-
-    // Wakeup the processor thread
-    pthread_cond_signal(&message_cond);
-
-    pthread_join(threadId, NULL);
-    DEBUG_COMMENT("Channel Thread Joined.\n");
-
-    return NOERROR;
+    pthread_mutex_destroy(&open_lock);
 }
 
-void* ANTChannel::thread(void) {
-    DEBUG_COMMENT("Thread started.....\n");
-    while (threadRun) {
-        pthread_mutex_lock(&message_lock);
-        pthread_cond_wait(&message_cond, &message_lock);
+void ANTChannel::dispatchMessage(ANTMessage *m) {
+    ANTDeviceID devID = m->getDeviceID();
 
-        // Check if we woke up becuase of queued
-        // messages
-
-        if (messageQueue.empty()) {
-            pthread_mutex_unlock(&message_lock);
-            continue;
-        }
-
-        ANTMessage m = messageQueue.front();
-        messageQueue.pop();
-
-        pthread_mutex_unlock(&message_lock);
-
-        ANTDeviceID devID = m.getDeviceID();
-
-        if (!devID.isValid()) {
-            DEBUG_COMMENT("Processing with no device id info\n");
-            continue;
-        }
-
-        bool found = false;
-        for (auto dev : deviceList) {
-            if (*dev == devID) {
-                dev->parseMessage(&m);
-                found = true;
-                break;
-            }
-        }
+    if (!devID.isValid()) {
+        DEBUG_COMMENT("Processing with no device id info\n");
+        return;
+    }
 
-        if (!found) {
-            addDevice(&devID)->parseMessage(&m);
-        }
+    auto dev = registry->find(devID);
+    if (dev == nullptr) {
+        dev = addDevice(&devID);
     }
 
-    return NULL;
+    if (dev != nullptr) {
+        dev->parseMessage(m, receiver);
+    }
 }
 
 void ANTChannel::setType(int t) {
@@ -178,20 +134,49 @@ shared_ptr<ANTDevice> ANTChannel::addDevice(ANTDeviceID *id) {
         DEBUG_PRINT("Adding device type = 0x%02X, %p\n",
                 id->getType(), (void*)dev);
         shared_ptr<ANTDevice> sharedDev(dev);
-        deviceList.push_back(sharedDev);
-        return sharedDev;
+        sharedDev->setStartTime(startTime);
+        sharedDev->setRetention(retentionSamples, retentionWindow,
+                retentionSink);
+        sharedDev->setDedupWindow(dedupWindow);
+        return registry->add(sharedDev);
     }
 
     return nullptr;
 }
 
+void ANTChannel::setRetention(size_t maxSamples, int window,
+        shared_ptr<ANTDataSink> sink) {
+    // Set for devices we find from now on and
+    // the ones we already know about.
+    retentionSamples = maxSamples;
+    retentionWindow  = window;
+    retentionSink    = sink;
+
+    for (auto dev : registry->getDeviceList()) {
+        dev->setRetention(maxSamples, window, sink);
+    }
+}
+
+void ANTChannel::setDedupWindow(int window) {
+    dedupWindow = window;
+
+    for (auto dev : registry->getDeviceList()) {
+        dev->setDedupWindow(window);
+    }
+}
+
 void ANTChannel::parseMessage(ANTMessage *message) {
-    ANTMessage m = *message;
+    // Hand off to the worker pool, without one
+    // we process the message on the calling thread.
+    if (workerPool == nullptr) {
+        dispatchMessage(message);
+        return;
+    }
 
-    pthread_mutex_lock(&message_lock);
-    messageQueue.push(m);
-    pthread_cond_signal(&message_cond);
-    pthread_mutex_unlock(&message_lock);
+    if (workerPool->submit(this, message)) {
+        DEBUG_PRINT("Message queue full on channel %d, dropping message\n",
+                channelNum);
+    }
 }
 
 int ANTChannel::processEvent(ANTMessage *m) {
@@ -202,6 +187,13 @@ int ANTChannel::processEvent(ANTMessage *m) {
     }
 
     uint8_t commandCode = m->getData(0);
+    if ((commandCode != 0x01) && pipelined) {
+        // The interface hands the responses to our config to the
+        // callbacks, anything else must not restart the config.
+        DEBUG_PRINT("Ignoring response to 0x%02X\n", commandCode);
+        return NOERROR;
+    }
+
     if (commandCode != 0x01) {
         switch (commandCode) {
             case ANT_SET_NETWORK:
@@ -212,12 +204,12 @@ int ANTChannel::processEvent(ANTMessage *m) {
                 break;
             case ANT_ASSIGN_CHANNEL:
                 DEBUG_COMMENT("ANT_ASSIGN_CHANNEL Recieved\n");
-                currentState = STATE_ASSIGNED;
+                setState(STATE_ASSIGNED);
                 changeStateTo(STATE_ID_SET);
                 break;
             case ANT_CHANNEL_ID:
                 DEBUG_COMMENT("ANT_CHANNEL_ID Recieved\n");
-                currentState = STATE_ID_SET;
+                setState(STATE_ID_SET);
                 changeStateTo(STATE_SET_TIMEOUT);
                 break;
             case ANT_SEARCH_TIMEOUT:
@@ -226,17 +218,17 @@ int ANTChannel::processEvent(ANTMessage *m) {
                 break;
             case ANT_LP_SEARCH_TIMEOUT:
                 DEBUG_COMMENT("ANT_LP_SEARCH_TIMEOUT Recieved\n");
-                currentState = STATE_SET_TIMEOUT;
+                setState(STATE_SET_TIMEOUT);
                 changeStateTo(STATE_SET_PERIOD);
                 break;
             case ANT_CHANNEL_PERIOD:
                 DEBUG_COMMENT("ANT_CHANNEL_PERIOD Recieved\n");
-                currentState = STATE_SET_PERIOD;
+                setState(STATE_SET_PERIOD);
                 changeStateTo(STATE_SET_FREQ);
                 break;
             case ANT_CHANNEL_FREQUENCY:
                 DEBUG_COMMENT("ANT_CHANNEL_FREQUENCY Recieved\n");
-                currentState = STATE_SET_FREQ;
+                setState(STATE_SET_FREQ);
                 changeStateTo(STATE_OPEN_UNPAIRED);
                 break;
             case ANT_LIB_CONFIG:
@@ -245,7 +237,7 @@ int ANTChannel::processEvent(ANTMessage *m) {
             case ANT_OPEN_CHANNEL:
                 DEBUG_COMMENT("ANT_OPEN_CHANNEL Recieved\n");
                 // Do nothing, but set state
-                currentState = STATE_OPEN_UNPAIRED;
+                setState(STATE_OPEN_UNPAIRED);
                 break;
             default:
                 DEBUG_PRINT("Unknown command 0x%02X\n", commandCode);
@@ -273,11 +265,35 @@ int ANTChannel::processEvent(ANTMessage *m) {
                 break;
             case EVENT_CHANNEL_CLOSED:
                 DEBUG_PRINT("Channel closed %d\n", channelNum);
-                currentState = STATE_CLOSED;
+                if (staleCloses > 0) {
+                    // From a rollback, the channel may be in use
+                    // again by now
+                    staleCloses--;
+                    break;
+                }
+                if (currentState == STATE_IDLE) {
+                    // Closed by a rollback, leave it be
+                    break;
+                }
+                setState(STATE_CLOSED);
                 // If we reopen, we can try now
                 if (autoOpen) {
                     // Attempt to open the channel
-                    iface->openChannel(channelNum, true);
+                    if (pipelined) {
+                        ANTMessage msg[] = {
+                            ANTMessage(ANT_LIB_CONFIG, 0x00,
+                                    (uint8_t)(ANT_EXT_MSG_CHAN_ID
+                                        | ANT_EXT_MSG_RSSI)),
+                            ANTMessage(ANT_OPEN_CHANNEL, channelNum)
+                        };
+                        ConfigStep steps[] = {
+                            { -1, false },
+                            { -1, true  }
+                        };
+                        sendConfig(msg, steps, 2, STATE_OPEN_UNPAIRED);
+                    } else {
+                        iface->openChannel(channelNum, true);
+                    }
                 }
                 break;
             default:
@@ -286,10 +302,41 @@ int ANTChannel::processEvent(ANTMessage *m) {
         }
     }
 
-    DEBUG_PRINT("currentState = %d\n", currentState);
+    DEBUG_PRINT("currentState = %d\n", currentState.load());
     return NOERROR;
 }
 
+void ANTChannel::setState(int state) {
+    currentState = state;
+
+    if ((state == STATE_OPEN_UNPAIRED) || (state == STATE_OPEN_PAIRED)) {
+        completeOpen(NOERROR);
+    } else if (state == STATE_IDLE) {
+        completeOpen(ERROR);
+    }
+}
+
+void ANTChannel::completeOpen(int rc) {
+    pthread_mutex_lock(&open_lock);
+    if (!openPending) {
+        pthread_mutex_unlock(&open_lock);
+        return;
+    }
+
+    openPending = false;
+    std::promise<int> promise = std::move(openPromise);
+    OpenCallback callback = std::move(openCallback);
+    openCallback = nullptr;
+    pthread_mutex_unlock(&open_lock);
+
+    DEBUG_PRINT("Open of channel %d completed (rc = %d)\n",
+            channelNum, rc);
+    if (callback) {
+        callback(rc);
+    }
+    promise.set_value(rc);
+}
+
 int ANTChannel::changeStateTo(int state) {
     DEBUG_PRINT("Changing State to %d\n", state);
 
@@ -323,6 +370,134 @@ int ANTChannel::changeStateTo(int state) {
     return NOERROR;
 }
 
+void ANTChannel::configure(void) {
+    // Send the whole config (the same commands changeStateTo()
+    // walks through) in one batch. The unassign fails if the
+    // channel was never assigned, that's fine. The channel is
+    // open once the rest have succeeded.
+    ANTMessage msg[] = {
+        ANTMessage(ANT_UNASSIGN_CHANNEL, channelNum),
+        ANTMessage(ANT_ASSIGN_CHANNEL, channelNum, channelType,
+                network, channelTypeExtended),
+        ANTMessage(ANT_CHANNEL_ID, channelNum,
+                (uint8_t)(deviceId & 0xFF), (uint8_t)(deviceId >> 8),
+                deviceParams.deviceType, (uint8_t)ANT_TX_TYPE_SLAVE),
+        ANTMessage(ANT_SEARCH_TIMEOUT, channelNum, 0),
+        ANTMessage(ANT_LP_SEARCH_TIMEOUT, channelNum, searchTimeout),
+        ANTMessage(ANT_CHANNEL_PERIOD, channelNum,
+                (uint8_t)(deviceParams.devicePeriod & 0xFF),
+                (uint8_t)(deviceParams.devicePeriod >> 8)),
+        ANTMessage(ANT_CHANNEL_FREQUENCY, channelNum,
+                deviceParams.deviceFrequency),
+        ANTMessage(ANT_LIB_CONFIG, 0x00,
+                (uint8_t)(ANT_EXT_MSG_CHAN_ID | ANT_EXT_MSG_RSSI)),
+        ANTMessage(ANT_OPEN_CHANNEL, channelNum)
+    };
+    ConfigStep steps[] = {
+        { -1,                  false },
+        { STATE_ASSIGNED,      true  },
+        { STATE_ID_SET,        true  },
+        { -1,                  true  },
+        { STATE_SET_TIMEOUT,   true  },
+        { STATE_SET_PERIOD,    true  },
+        { STATE_SET_FREQ,      true  },
+        { -1,                  false },
+        { -1,                  true  }
+    };
+
+    DEBUG_PRINT("Sending config for channel %d\n", channelNum);
+    sendConfig(msg, steps, sizeof(msg) / sizeof(msg[0]),
+            STATE_OPEN_UNPAIRED);
+}
+
+void ANTChannel::sendConfig(ANTMessage *msg, const ConfigStep *steps,
+        int n, int state) {
+    // This replaces any batch still in flight, which must not
+    // resend its commands now.
+    iface->abandonCommands(channelNum);
+
+    auto batch = std::make_shared<ConfigBatch>();
+    batch->gen       = ++configGen;
+    batch->state     = state;
+    batch->remaining = 0;
+    batch->failed    = false;
+
+    std::vector<ANTInterface::CommandCallback> callbacks;
+    for (int i = 0; i < n; i++) {
+        ConfigStep step = steps[i];
+        uint8_t command = msg[i].getType();
+        if (step.required) {
+            batch->remaining++;
+        }
+        callbacks.push_back([this, batch, command, step](int code) {
+            configResponse(batch, command, step, code);
+        });
+    }
+
+    // A batch which can not be sent fails (through the
+    // callbacks) before this returns.
+    iface->sendCommands(msg, n, ANTPLUS_COMMAND_TIMEOUT,
+            ANTPLUS_COMMAND_RETRIES, callbacks.data());
+}
+
+void ANTChannel::configResponse(shared_ptr<ConfigBatch> batch,
+        uint8_t command, ConfigStep step, int code) {
+    if (code == ANTInterface::CMD_CANCELLED) {
+        // The stick was lost, reopen() starts again
+        return;
+    }
+
+    if (batch->failed || (batch->gen != configGen)) {
+        DEBUG_PRINT("Ignoring stale response to 0x%02X\n", command);
+        return;
+    }
+
+    if (code == RESPONSE_NO_ERROR) {
+        if (!step.required) {
+            return;
+        }
+        // Move on, but only open once everything has gone through
+        if (step.state > currentState) {
+            currentState = step.state;
+        }
+        if (--batch->remaining == 0) {
+            setState(batch->state);
+        }
+        return;
+    }
+
+    if (!step.required || batch->failed.exchange(true)) {
+        return;
+    }
+
+    DEBUG_PRINT("Command 0x%02X failed (%d) on channel %d\n",
+            command, code, channelNum);
+    iface->abandonCommands(channelNum);
+    rollback();
+    setState(STATE_IDLE);
+}
+
+void ANTChannel::rollback(void) {
+    // The rest of the batch may still have gone through, so close
+    // and unassign to leave the channel free for another open.
+    DEBUG_PRINT("Rolling back config of channel %d\n", channelNum);
+    ANTMessage msg[] = {
+        ANTMessage(ANT_CLOSE_CHANNEL, channelNum),
+        ANTMessage(ANT_UNASSIGN_CHANNEL, channelNum)
+    };
+    ANTInterface::CommandCallback callbacks[] = {
+        [this](int code) {
+            // If it was open, EVENT_CHANNEL_CLOSED follows
+            if (code == RESPONSE_NO_ERROR) {
+                staleCloses++;
+            }
+        },
+        nullptr
+    };
+    iface->sendCommands(msg, 2, ANTPLUS_COMMAND_TIMEOUT,
+            ANTPLUS_COMMAND_RETRIES, callbacks);
+}
+
 int ANTChannel::processId(ANTMessage *m) {
     // Parse the ID
     uint16_t id;
@@ -338,7 +513,23 @@ int ANTChannel::processId(ANTMessage *m) {
     return NOERROR;
 }
 
-int ANTChannel::open(int type, uint16_t id, bool wait) {
+std::future<int> ANTChannel::openAsync(int type, uint16_t id,
+        OpenCallback callback) {
+    // Claim the channel, marking it as taken now so another
+    // open can not pick it before the response comes in.
+
+    int idle = STATE_IDLE;
+    if (!currentState.compare_exchange_strong(idle, STATE_ASSIGNED)) {
+        DEBUG_PRINT("Cannot start channel when not IDLE"
+        "(current state = %d)\n", idle);
+        std::promise<int> failed;
+        failed.set_value(ERROR);
+        if (callback) {
+            callback(ERROR);
+        }
+        return failed.get_future();
+    }
+
     // Start a channel config
 
     deviceId = id;
@@ -349,33 +540,64 @@ int ANTChannel::open(int type, uint16_t id, bool wait) {
         channelTypeExtended = CHANNEL_TYPE_EXT_BACKGROUND_SCAN;
     }
 
-    // Claim the channel.
+    pthread_mutex_lock(&open_lock);
+    openPromise  = std::promise<int>();
+    openCallback = callback;
+    openPending  = true;
+    std::future<int> result = openPromise.get_future();
+    pthread_mutex_unlock(&open_lock);
 
-    if (currentState != STATE_IDLE) {
-        DEBUG_PRINT("Cannot start channel when not IDLE"
-        "(current state = %d)\n", currentState);
-        return ERROR;
+    // Start with ASSIGNING the channel
+
+    if (pipelined) {
+        configure();
+    } else {
+        changeStateTo(STATE_ASSIGNED);
     }
 
-    // Start with ASSIGNING the channel
+    return result;
+}
 
-    changeStateTo(STATE_ASSIGNED);
-
-    // Spinlock until timeout
-    auto start = ant_clock::now();
-    if (wait) {
-        while ((currentState != STATE_OPEN_UNPAIRED)
-                && (currentState != STATE_OPEN_PAIRED)) {
-            usleep(ANTPLUS_SLEEP_DURATION);
-            auto t = std::chrono::duration_cast<std::chrono::seconds>
-                (ant_clock::now() - start).count();
-            DEBUG_PRINT("Waiting .. currentState = %d, t = %ld\n",
-                currentState, t)
-            if (t > channelStartTimeout) {
-                DEBUG_COMMENT("Returning ERROR\n");
-                return ERROR;
-            }
+int ANTChannel::open(int type, uint16_t id, bool wait) {
+    std::future<int> result = openAsync(type, id);
+
+    if (!wait) {
+        // Only fail now if we know it already failed
+        if (result.wait_for(std::chrono::seconds(0))
+                == std::future_status::ready) {
+            return result.get();
         }
+        return NOERROR;
+    }
+
+    if (result.wait_for(std::chrono::seconds(channelStartTimeout))
+            != std::future_status::ready) {
+        DEBUG_PRINT("Timeout opening channel %d (currentState = %d)\n",
+                channelNum, currentState.load());
+        return ERROR;
+    }
+
+    return result.get();
+}
+
+int ANTChannel::reopen(void) {
+    // Closed by the user, or never used
+    if ((currentState == STATE_IDLE) || !autoOpen) {
+        return NOERROR;
+    }
+
+    DEBUG_PRINT("Reopening channel %d\n", channelNum);
+
+    // The stick was reset, so nothing is open on it and no close
+    // is due. The registry (and so the device data) is untouched,
+    // as is an open in progress, which completes when this does.
+    staleCloses  = 0;
+    currentState = STATE_ASSIGNED;
+
+    if (pipelined) {
+        configure();
+    } else {
+        changeStateTo(STATE_ASSIGNED);
     }
 
     return NOERROR;
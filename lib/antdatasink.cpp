@@ -0,0 +1,80 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "antplus.h"
+#include "antdatasink.h"
+#include "antdebug.h"
+
+ANTFileDataSink::ANTFileDataSink(std::string filename) {
+    pthread_mutex_init(&file_lock, NULL);
+
+    file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        DEBUG_PRINT("Unable to open %s\n", filename.c_str());
+    }
+}
+
+ANTFileDataSink::~ANTFileDataSink(void) {
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    pthread_mutex_destroy(&file_lock);
+}
+
+int ANTFileDataSink::write(ANTDeviceID id, const char *field,
+        const int64_t *ts, const float *value, int n) {
+    if (file == NULL) {
+        return ERROR;
+    }
+
+    uint16_t devID = id.getID();
+    uint8_t devType = id.getType();
+    uint8_t nameLen = strlen(field);
+    uint32_t nSamples = n;
+
+    pthread_mutex_lock(&file_lock);
+    fwrite(&devID, sizeof(devID), 1, file);
+    fwrite(&devType, sizeof(devType), 1, file);
+    fwrite(&nameLen, sizeof(nameLen), 1, file);
+    fwrite(field, 1, nameLen, file);
+    fwrite(&nSamples, sizeof(nSamples), 1, file);
+    fwrite(ts, sizeof(int64_t), n, file);
+    size_t rc = fwrite(value, sizeof(float), n, file);
+    pthread_mutex_unlock(&file_lock);
+
+    if (rc != nSamples) {
+        DEBUG_COMMENT("Error writing to data sink\n");
+        return ERROR;
+    }
+
+    return NOERROR;
+}
@@ -98,6 +98,8 @@
 #define INVALID_MESSAGE                     0x28
 #define INVALID_NETWORK_NUMBER              0x29
 
+#define ANT_MAX_MESSAGE_LEN                 41
+
 #define ANT_OFFSET_DATA                     0
 #define ANT_OFFSET_CHANNEL_NUMBER           0
 #define ANT_OFFSET_MESSAGE_ID               1
@@ -141,6 +143,8 @@
 #define ANT_DEVICE_FEC_COMMAND_TRACK        0x33
 
 #define ANT_DEVICE_POWER_STANDARD           0x10
+#define ANT_DEVICE_POWER_WHEEL_TORQUE       0x11
+#define ANT_DEVICE_POWER_CRANK_TORQUE       0x12
 #define ANT_DEVICE_POWER_TEPS               0x13
 #define ANT_DEVICE_POWER_BATTERY            0x52
 #define ANT_DEVICE_POWER_PARAMS             0x02
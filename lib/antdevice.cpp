@@ -26,26 +26,184 @@
 
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <cstring>
+#include <cmath>
 
 #include "antplus.h"
 #include "antdevice.h"
 #include "antdebug.h"
 #include "antdefs.h"
 
+const char* ANTDeviceFEC::fieldNames[] = {
+    "GENERAL_INST_SPEED",
+    "SETTINGS_CYCLE_LENGTH",
+    "SETTINGS_RESISTANCE",
+    "SETTINGS_INCLINE",
+    "TRAINER_CADENCE",
+    "TRAINER_ACC_POWER",
+    "TRAINER_INST_POWER",
+    "TRAINER_STATUS",
+    "TRAINER_FLAGS",
+    "TRAINER_TARGET_RESISTANCE",
+    "TRAINER_TARGET_POWER"
+};
+
+const char* ANTDevicePWR::fieldNames[] = {
+    "BALANCE",
+    "CADENCE",
+    "ACC_POWER",
+    "INST_POWER",
+    "LEFT_TE",
+    "RIGHT_TE",
+    "LEFT_PS",
+    "RIGHT_PS",
+    "N_BATTERIES",
+    "OPERATING_TIME",
+    "BATTERY_VOLTAGE",
+    "CRANK_LENGTH",
+    "CRANK_STATUS",
+    "SENSOR_STATUS",
+    "PEAK_TORQUE_THRESHOLD",
+    "AVG_POWER",
+    "TORQUE",
+    "TORQUE_POWER",
+    "TORQUE_CADENCE",
+    "WHEEL_SPEED"
+};
+
+const char* ANTDeviceHR::fieldNames[] = {
+    "HEARTRATE",
+    "RR_INTERVAL"
+};
+
+//
+// Page layouts, see ANTPageField
+//
+
+constexpr ANTPageField tsField(int field, uint8_t byte, uint8_t shift,
+        uint8_t bits, double scale = 1.0, double offset = 0.0,
+        bool isSigned = false) {
+    return { byte, shift, bits, isSigned, scale, offset, field, nullptr,
+        ANTPLUS_PAGE_ANY, ANTPLUS_PAGE_ANY };
+}
+
+constexpr ANTPageField metaField(const char *name, uint8_t byte,
+        uint8_t bits) {
+    return { byte, 0, bits, false, 1.0, 0.0, -1, name,
+        ANTPLUS_PAGE_ANY, ANTPLUS_PAGE_ANY };
+}
+
+constexpr ANTPageField validField(ANTPageField f, int8_t validBit,
+        int64_t invalid) {
+    return { f.byte, f.shift, f.bits, f.isSigned, f.scale, f.offset,
+        f.field, f.meta, validBit, invalid };
+}
+
+constexpr ANTPage commonPageList[] = {
+    { ANT_DEVICE_COMMON_DATA, ANTPLUS_PAGE_ANY, {
+        metaField("HW_REVISION", 3, 8),
+        metaField("MANUFACTURER_ID", 4, 16),
+        metaField("MODEL_NUMBER", 6, 16) }, 0 },
+    { ANT_DEVICE_COMMON_INFO, ANTPLUS_PAGE_ANY, {
+        metaField("SERIAL_NUMBER", 4, 32) }, 0 }
+};
+constexpr auto commonPages = makePageTable(commonPageList);
+
+constexpr ANTPage fecPageList[] = {
+    { ANT_DEVICE_FEC_GENERAL, ANTPLUS_PAGE_ANY, {
+        tsField(ANTDeviceFEC::FIELD_GENERAL_INST_SPEED, 4, 0, 16, 0.001) },
+        0 },
+    { ANT_DEVICE_FEC_GENERAL_SETTINGS, ANTPLUS_PAGE_ANY, {
+        tsField(ANTDeviceFEC::FIELD_SETTINGS_CYCLE_LENGTH, 3, 0, 8, 0.01),
+        tsField(ANTDeviceFEC::FIELD_SETTINGS_INCLINE, 4, 0, 16, 0.01,
+                0.0, true),
+        tsField(ANTDeviceFEC::FIELD_SETTINGS_RESISTANCE, 6, 0, 8, 0.5) },
+        0 },
+    { ANT_DEVICE_FEC_TRAINER, ANTPLUS_PAGE_ANY, {
+        tsField(ANTDeviceFEC::FIELD_TRAINER_CADENCE, 2, 0, 8),
+        tsField(ANTDeviceFEC::FIELD_TRAINER_ACC_POWER, 3, 0, 16),
+        tsField(ANTDeviceFEC::FIELD_TRAINER_INST_POWER, 5, 0, 12),
+        tsField(ANTDeviceFEC::FIELD_TRAINER_STATUS, 6, 4, 4),
+        tsField(ANTDeviceFEC::FIELD_TRAINER_FLAGS, 7, 0, 4) }, 0 }
+};
+constexpr auto fecPages = makePageTable(fecPageList);
+
+constexpr ANTPage pwrPageList[] = {
+    { ANT_DEVICE_POWER_PARAMS, ANT_DEVICE_POWER_PARAMS_CRANK, {
+        tsField(ANTDevicePWR::FIELD_CRANK_LENGTH, 4, 0, 8, 0.5, 110.0),
+        tsField(ANTDevicePWR::FIELD_CRANK_STATUS, 5, 0, 2),
+        tsField(ANTDevicePWR::FIELD_SENSOR_STATUS, 6, 3, 1) }, 0 },
+    { ANT_DEVICE_POWER_PARAMS, ANT_DEVICE_POWER_PARAMS_TORQUE, {
+        tsField(ANTDevicePWR::FIELD_PEAK_TORQUE_THRESHOLD, 7, 0, 8, 0.5) },
+        0 },
+    { ANT_DEVICE_POWER_STANDARD, ANTPLUS_PAGE_ANY, {
+        // Balance is only there when bit 7 is set (and not 0xFF)
+        validField(tsField(ANTDevicePWR::FIELD_BALANCE, 2, 0, 7), 7, 0x7F),
+        tsField(ANTDevicePWR::FIELD_CADENCE, 3, 0, 8),
+        tsField(ANTDevicePWR::FIELD_ACC_POWER, 4, 0, 16),
+        tsField(ANTDevicePWR::FIELD_INST_POWER, 6, 0, 16) }, 0 },
+    { ANT_DEVICE_POWER_WHEEL_TORQUE, ANTPLUS_PAGE_ANY, {
+        validField(tsField(ANTDevicePWR::FIELD_CADENCE, 3, 0, 8),
+                ANTPLUS_PAGE_ANY, 0xFF) }, 0 },
+    { ANT_DEVICE_POWER_CRANK_TORQUE, ANTPLUS_PAGE_ANY, {
+        validField(tsField(ANTDevicePWR::FIELD_CADENCE, 3, 0, 8),
+                ANTPLUS_PAGE_ANY, 0xFF) }, 0 },
+    { ANT_DEVICE_POWER_TEPS, ANTPLUS_PAGE_ANY, {
+        tsField(ANTDevicePWR::FIELD_LEFT_TE, 2, 0, 8, 0.5),
+        tsField(ANTDevicePWR::FIELD_RIGHT_TE, 3, 0, 8, 0.5),
+        tsField(ANTDevicePWR::FIELD_LEFT_PS, 4, 0, 8, 0.5),
+        tsField(ANTDevicePWR::FIELD_RIGHT_PS, 5, 0, 8, 0.5) }, 0 },
+    { ANT_DEVICE_POWER_BATTERY, ANTPLUS_PAGE_ANY, {
+        tsField(ANTDevicePWR::FIELD_N_BATTERIES, 2, 0, 4),
+        tsField(ANTDevicePWR::FIELD_OPERATING_TIME, 3, 0, 24),
+        tsField(ANTDevicePWR::FIELD_BATTERY_VOLTAGE, 6, 0, 8) }, 0 }
+};
+constexpr auto pwrPages = makePageTable(pwrPageList);
+
+constexpr ANTPage hrPageList[] = {
+    { ANT_DEVICE_HR_MF_INFO, ANTPLUS_PAGE_ANY, {
+        metaField("HR_MANUFACTURER_ID", 1, 8),
+        metaField("HR_SERIAL_NUMBER", 2, 16) }, 0 },
+    { ANT_DEVICE_HR_INFO, ANTPLUS_PAGE_ANY, {
+        metaField("HR_HW_VERSION", 1, 8),
+        metaField("HR_SW_VERSION", 2, 8),
+        metaField("HR_MODEL_NUMBER", 3, 8) }, 0 }
+};
+constexpr auto hrPages = makePageTable(hrPageList);
+
 ANTDevice::ANTDevice(void) {
     pthread_mutex_init(&thread_lock, NULL);
 
-    tsData = std::make_shared<ANTTsData>();
+    tsFieldNames = nullptr;
     metaData = std::make_shared<ANTMetaData>();
 
     storeTsData = true;
+
+    dedupNext = 0;
+    dedupWindow = 0;
+    duplicates = 0;
+    preferredReceiver = 0;
+    held = false;
+    for (int i = 0; i < ANTPLUS_DEDUP_HISTORY; i++) {
+        memset(dedup[i].payload, 0, sizeof(dedup[i].payload));
+    }
 }
 
-ANTDevice::ANTDevice(const ANTDeviceID &id)
+ANTDevice::ANTDevice(const ANTDeviceID &id,
+        const char * const *fieldNames, int nFields)
     : ANTDevice() {
     devID = id;
+
+    // One column per field, allocated up front so that
+    // adding data never has to look anything up.
+    tsFieldNames = fieldNames;
+    for (int i = 0; i < nFields; i++) {
+        tsData.push_back(std::make_shared<ANTDeviceData<float>>());
+        tsPolicy.push_back({ STORE_ALWAYS, 0, false, 0, 0 });
+    }
 }
 
 ANTDevice::~ANTDevice(void) {
@@ -60,54 +218,226 @@ void ANTDevice::addMetaDatum(const char* name, float val) {
     addMetaDatum(std::string(name), val);
 }
 
-void ANTDevice::addDatum(std::string name, float val,
-        ant_time_point t) {
+void ANTDevice::addDatum(int field, float val, ant_time_point t) {
     if (storeTsData) {
-        (*tsData)[name].addDatum(val, t);
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (t - startTime).count();
+
+        StorePolicy &p = tsPolicy[field];
+        if (p.stored && (p.policy != STORE_ALWAYS) && (val == p.value)
+                && ((p.policy == STORE_ON_CHANGE)
+                    || ((ns - p.t) < p.heartbeat))) {
+            return;
+        }
+        p.stored = true;
+        p.value  = val;
+        p.t      = ns;
+
+        tsData[field]->addDatum(val, ns);
     }
 }
 
-void ANTDevice::addDatum(const char *name, float val,
-        ant_time_point t) {
-    addDatum(std::string(name), val, t);
+void ANTDevice::setStorePolicy(int field, int policy, int heartbeat) {
+    lock();
+    if ((field >= 0) && (field < static_cast<int>(tsPolicy.size()))) {
+        tsPolicy[field].policy    = policy;
+        tsPolicy[field].heartbeat = static_cast<int64_t>(heartbeat)
+            * 1000000L;
+    }
+    unlock();
 }
 
-void ANTDevice::processMessage(ANTMessage *message) {
-    auto data = message->getData();
-    int dataLen = message->getDataLen();
+void ANTDevice::setRetention(size_t maxSamples, int window,
+        shared_ptr<ANTDataSink> sink) {
+    int64_t ns = (int64_t)window * 1000000L;
+    ANTDeviceID id = devID;
+
+    for (int i = 0; i < getNumFields(); i++) {
+        ANTDeviceData<float>::SpillFn spill = nullptr;
+        if (sink != nullptr) {
+            const char *name = tsFieldNames[i];
+            spill = [sink, id, name](const int64_t *ts, const float *v,
+                    int n) {
+                sink->write(id, name, ts, v, n);
+            };
+        }
+        tsData[i]->setRetention(maxSamples, ns, spill);
+    }
+}
 
-    if (dataLen < 8) {
-        return;
+void ANTDevice::setDedupWindow(int window) {
+    lock();
+    dedupWindow = (int64_t)window * 1000000L;
+    unlock();
+}
+
+float ANTDevice::getRSSI(int receiver) {
+    lock();
+    float r = ANTPLUS_RSSI_NONE;
+    if ((receiver >= 0) && (receiver < (int)rssi.size())) {
+        r = rssi[receiver];
+    }
+    unlock();
+
+    return r;
+}
+
+bool ANTDevice::isDuplicate(ANTMessage *message, int receiver) {
+    // Called with the device locked. Keep a smoothed RSSI for
+    // each receiver and prefer the one with the best signal.
+    ant_time_point t = message->getTimestamp();
+    int8_t r = message->getRSSI();
+    if (receiver >= 0) {
+        if ((int)rssi.size() <= receiver) {
+            rssi.resize(receiver + 1, ANTPLUS_RSSI_NONE);
+            lastHeard.resize(receiver + 1);
+        }
+        lastHeard[receiver] = t;
+    }
+    if ((r != ANTPLUS_RSSI_NONE) && (receiver >= 0)) {
+        if (rssi[receiver] == ANTPLUS_RSSI_NONE) {
+            rssi[receiver] = r;
+        } else {
+            rssi[receiver] += (r - rssi[receiver]) * 0.125;
+        }
+        if (rssi[receiver] > rssi[preferredReceiver]) {
+            preferredReceiver = receiver;
+        }
+    }
+
+    if (!dedupWindow || (message->getDataLen() < 8)) {
+        return false;
+    }
+
+    // The payload carries the page number and event counters,
+    // so the same 8 bytes inside the window is the same page.
+    const uint8_t *payload = message->getData();
+
+    if (held) {
+        int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (t - heldMessage.getTimestamp()).count();
+        if ((dt < dedupWindow) && (dt > -dedupWindow)
+                && !memcmp(heldMessage.getData(), payload, 8)) {
+            duplicates++;
+            if (receiver != preferredReceiver) {
+                return true;
+            }
+            // The preferred receiver's copy replaces the one held
+            held = false;
+            return false;
+        }
+
+        // Anything else means the preferred receiver missed it
+        held = false;
+        processMessage(&heldMessage);
+    }
+
+    for (int i = 0; i < ANTPLUS_DEDUP_HISTORY; i++) {
+        int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (t - dedup[i].t).count();
+        if ((dt < dedupWindow) && (dt > -dedupWindow)
+                && !memcmp(dedup[i].payload, payload, 8)) {
+            duplicates++;
+            return true;
+        }
+    }
+
+    memcpy(dedup[dedupNext].payload, payload, 8);
+    dedup[dedupNext].t = t;
+    dedupNext = (dedupNext + 1) % ANTPLUS_DEDUP_HISTORY;
+
+    // A first copy from a weaker receiver waits for the preferred
+    // receiver's copy, as long as that receiver is delivering.
+    if ((receiver >= 0) && (receiver != preferredReceiver)
+            && (rssi[preferredReceiver] != ANTPLUS_RSSI_NONE)
+            && ((t - lastHeard[preferredReceiver])
+                < std::chrono::milliseconds(ANTPLUS_DEDUP_ACTIVE))) {
+        heldMessage = *message;
+        held = true;
+        return true;
     }
 
-    if (data[0] == ANT_DEVICE_COMMON_DATA) {
-        uint8_t hwRevision;
-        uint16_t manufacturerID;
-        uint16_t modelNumber;
+    return false;
+}
+
+const char* ANTDevice::getFieldName(int field) {
+    if ((field < 0) || (field >= getNumFields())) {
+        return nullptr;
+    }
 
-        hwRevision      = data[3];
-        manufacturerID  = data[4];
-        manufacturerID |= (data[5] << 8);
-        modelNumber     = data[6];
-        modelNumber    |= data[7];
+    return tsFieldNames[field];
+}
 
-        addMetaDatum("HW_REVISION", hwRevision);
-        addMetaDatum("MANUFACTURER_ID", manufacturerID);
-        addMetaDatum("MODEL_NUMBER", modelNumber);
+shared_ptr<ANTDeviceData<float>> ANTDevice::getTsData(int field) {
+    if ((field < 0) || (field >= getNumFields())) {
+        return nullptr;
+    }
+
+    return tsData[field];
+}
 
-        DEBUG_PRINT("COMMON_DATA, %d, %d, %d\n",
-                hwRevision, manufacturerID, modelNumber);
-    } else if (data[0] == ANT_DEVICE_COMMON_INFO) {
-        uint32_t serialNumber;
+shared_ptr<ANTTsData> ANTDevice::getTsData(void) {
+    // Build the name keyed view. This only shares the
+    // columns, no data is copied.
+    auto data = std::make_shared<ANTTsData>();
+    for (int i = 0; i < getNumFields(); i++) {
+        if (tsData[i]->size()) {
+            (*data)[tsFieldNames[i]] = tsData[i];
+        }
+    }
+
+    return data;
+}
+
+void ANTDevice::decodePage(const ANTPage *page, const uint8_t *data,
+        ant_time_point t) {
+    for (int i = 0; i < page->nFields; i++) {
+        const ANTPageField &f = page->fields[i];
+
+        // Little endian, at most 4 bytes
+        uint32_t raw = 0;
+        int nBytes = (f.shift + f.bits + 7) / 8;
+        for (int b = 0; b < nBytes; b++) {
+            raw |= static_cast<uint32_t>(data[f.byte + b]) << (8 * b);
+        }
+        raw >>= f.shift;
+        if (f.bits < 32) {
+            raw &= (1UL << f.bits) - 1;
+        }
 
-        serialNumber  = data[4];
-        serialNumber |= (data[5] << 8);
-        serialNumber |= (data[6] << 16);
-        serialNumber |= (data[7] << 24);
+        if (((f.validBit != ANTPLUS_PAGE_ANY)
+                    && !(data[f.byte] & (1 << f.validBit)))
+                || (f.invalid == static_cast<int64_t>(raw))) {
+            continue;
+        }
 
-        addMetaDatum("SERIAL_NUMBER", serialNumber);
+        double val = raw;
+        if (f.isSigned && (raw & (1UL << (f.bits - 1)))) {
+            val -= static_cast<double>(static_cast<int64_t>(1) << f.bits);
+        }
+        val = (val * f.scale) + f.offset;
 
-        DEBUG_PRINT("COMMON_INFO, %d\n", serialNumber);
+        if (f.meta != nullptr) {
+            addMetaDatum(f.meta, val);
+        } else {
+            addDatum(f.field, val, t);
+        }
+    }
+
+    DEBUG_PRINT("Page 0x%02X, %d fields\n", page->page, page->nFields);
+}
+
+void ANTDevice::processMessage(ANTMessage *message) {
+    auto data = message->getData();
+    int dataLen = message->getDataLen();
+
+    if (dataLen < 8) {
+        return;
+    }
+
+    const ANTPage *page = commonPages.find(data[0], data[1]);
+    if (page != nullptr) {
+        decodePage(page, data, message->getTimestamp());
     }
 }
 
@@ -117,9 +447,14 @@ ANTDeviceNONE::ANTDeviceNONE(const ANTDeviceID &id)
 }
 
 ANTDeviceFEC::ANTDeviceFEC(const ANTDeviceID &id)
-     : ANTDevice(id) {
+     : ANTDevice(id, fieldNames, FIELD_COUNT) {
     deviceName = std::string("FE-C");
     lastCommandSeq = 0xFF;
+
+    // Settings and status which rarely change
+    setStorePolicy(FIELD_SETTINGS_CYCLE_LENGTH, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_TRAINER_STATUS, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_TRAINER_FLAGS, STORE_HEARTBEAT);
 }
 
 
@@ -135,51 +470,9 @@ void ANTDeviceFEC::processMessage(ANTMessage *message) {
         return;
     }
 
-    if (data[0] == ANT_DEVICE_FEC_GENERAL) {
-        uint16_t _instSpeed;
-        _instSpeed  = data[4];
-        _instSpeed |= (data[5] << 8);
-        float instSpeed = (float)_instSpeed * 0.001;
-
-        addDatum("GENERAL_INST_SPEED", instSpeed, ts);
-
-        DEBUG_PRINT("FE-C General, %f\n", instSpeed);
-
-    } else if (data[0] == ANT_DEVICE_FEC_GENERAL_SETTINGS) {
-        float cycleLength = (float)data[3] * 0.01;
-        int16_t _incline;
-        _incline  = data[4];
-        _incline |= (data[5] << 8);
-        float incline = (float)_incline * 0.01;
-        float resistance = (float)data[6] * 0.5;
-
-        addDatum("SETTINGS_CYCLE_LENGTH", cycleLength, ts);
-        addDatum("SETTINGS_RESISTANCE", resistance, ts);
-        addDatum("SETTINGS_INCLINE", incline, ts);
-
-        DEBUG_PRINT("FE-C General Data, %f, %f, %f\n",
-                cycleLength, resistance, incline);
-
-    } else if (data[0] == ANT_DEVICE_FEC_TRAINER) {
-        uint8_t cadence = data[2];
-        uint16_t accPower;
-        accPower  = data[3];
-        accPower |= (data[4] << 8);
-        uint16_t instPower;
-        instPower  = data[5];
-        instPower |= ((data[6] & 0x0F) << 8);
-        uint8_t trainerStatus = (data[6] >> 4);
-        uint8_t trainerFlags = data[7] & 0x0F;
-
-        addDatum("TRAINER_CADENCE", (float)cadence, ts);
-        addDatum("TRAINER_ACC_POWER", (float)accPower, ts);
-        addDatum("TRAINER_INST_POWER", (float)instPower, ts);
-        addDatum("TRAINER_STATUS", (float)trainerStatus, ts);
-        addDatum("TRAINER_FLAGS", (float)trainerFlags, ts);
-
-        DEBUG_PRINT("FE-C Trainer Data, %d, %d, %d, 0x%02X, 0x%02X\n",
-                cadence, accPower, instPower, trainerStatus, trainerFlags);
-
+    const ANTPage *page = fecPages.find(data[0], data[1]);
+    if (page != nullptr) {
+        decodePage(page, data, ts);
     } else if (data[0] == ANT_DEVICE_COMMON_STATUS) {
         // This gives us the requested control.
         if (data[3] == 0x00) {
@@ -191,7 +484,7 @@ void ANTDeviceFEC::processMessage(ANTMessage *message) {
                 if (data[1] == ANT_DEVICE_FEC_COMMAND_RESISTANCE) {
                     float resistance = (float)data[7] * 0.5;
 
-                    addDatum("TRAINER_TARGET_RESISTANCE",
+                    addDatum(FIELD_TRAINER_TARGET_RESISTANCE,
                             resistance, ts);
 
                     DEBUG_PRINT("FE-C Target Resistance, %f, %d\n",
@@ -203,7 +496,7 @@ void ANTDeviceFEC::processMessage(ANTMessage *message) {
                     _pwr |= data[6];
                     float pwr = _pwr * 0.25;
 
-                    addDatum("TRAINER_TARGET_POWER",
+                    addDatum(FIELD_TRAINER_TARGET_POWER,
                             pwr, ts);
 
                     DEBUG_PRINT("FE-C Target Power, %f, %d\n",
@@ -216,14 +509,212 @@ void ANTDeviceFEC::processMessage(ANTMessage *message) {
         } else {
             DEBUG_COMMENT("FE-C Last command invalid or uninitialized\n");
         }
-    } else {
+    } else if ((data[0] != ANT_DEVICE_COMMON_DATA)
+            && (data[0] != ANT_DEVICE_COMMON_INFO)) {
         DEBUG_PRINT("Unknown FEC Page 0x%02X\n", data[0]);
     }
 }
 
+ANTRollingAverage::ANTRollingAverage(int window) {
+    this->window = static_cast<int64_t>(window) * 1000000L;
+    sum    = 0;
+    weight = 0;
+}
+
+void ANTRollingAverage::add(int64_t t, double value, double weight) {
+    samples.push_back({ t, value * weight, weight });
+    sum += value * weight;
+    this->weight += weight;
+
+    while (!samples.empty() && ((t - samples.front().t) >= window)) {
+        sum -= samples.front().value;
+        this->weight -= samples.front().weight;
+        samples.pop_front();
+    }
+
+    if (samples.empty()) {
+        // Don't let rounding build up
+        sum = 0;
+        this->weight = 0;
+    }
+}
+
+double ANTRollingAverage::get(void) {
+    if (weight <= 0) {
+        return NAN;
+    }
+    return sum / weight;
+}
+
+void ANTRollingAverage::clear(void) {
+    samples.clear();
+    sum    = 0;
+    weight = 0;
+}
+
 ANTDevicePWR::ANTDevicePWR(const ANTDeviceID &id)
-    : ANTDevice(id) {
+    : ANTDevice(id, fieldNames, FIELD_COUNT),
+      power3s(3000), power30s(30000) {
     deviceName = std::string("POWER");
+
+    accValid       = false;
+    lastEventCount = 0;
+    lastAccPower   = 0;
+    npSum          = 0;
+    npCount        = 0;
+
+    crankTorque.valid  = false;
+    wheelTorque.valid  = false;
+    torqueSource       = false;
+    wheelCircumference = ANTPLUS_WHEEL_CIRCUMFERENCE;
+
+    // Battery and calibration pages, which rarely change
+    setStorePolicy(FIELD_N_BATTERIES, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_BATTERY_VOLTAGE, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_CRANK_LENGTH, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_CRANK_STATUS, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_SENSOR_STATUS, STORE_HEARTBEAT);
+    setStorePolicy(FIELD_PEAK_TORQUE_THRESHOLD, STORE_HEARTBEAT);
+}
+
+void ANTDevicePWR::accumulatePower(const uint8_t *data, ant_time_point t) {
+    uint8_t eventCount = data[1];
+    uint16_t accPower = data[4] | (data[5] << 8);
+
+    // Both counters roll over, unsigned arithmetic takes care of
+    // one wrap. The accumulated power wraps first, every 65536 W
+    // (16 s at 1000 W and 4 Hz). Below 2048 W it can not wrap in
+    // 32 events, which is 8 s at 4 Hz, so after a longer gap, or
+    // more events, start again from this page.
+    uint8_t events = eventCount - lastEventCount;
+    auto gap = std::chrono::duration_cast<std::chrono::milliseconds>
+        (t - lastAccTime).count();
+    if (!accValid || (gap > ANTPLUS_POWER_GAP) || (gap < 0)
+            || (events > ANTPLUS_POWER_EVENTS)) {
+        accValid       = true;
+        lastEventCount = eventCount;
+        lastAccPower   = accPower;
+        lastAccTime    = t;
+        return;
+    }
+
+    if (!events) {
+        // A repeat of the last page, nothing new
+        return;
+    }
+    uint16_t energy = accPower - lastAccPower;
+
+    double power = static_cast<double>(energy) / events;
+    double dt = std::chrono::duration<double>(t - lastAccTime).count();
+
+    lastEventCount = eventCount;
+    lastAccPower   = accPower;
+    lastAccTime    = t;
+
+    addDatum(FIELD_AVG_POWER, power, t);
+    if (!torqueSource) {
+        addPower(t, power, dt);
+    }
+
+    DEBUG_PRINT("POWER Average, %d, %d, %f\n", events, energy, power);
+}
+
+void ANTDevicePWR::accumulateTorque(const uint8_t *data, ant_time_point t) {
+    bool crank = (data[0] == ANT_DEVICE_POWER_CRANK_TORQUE);
+    TorqueAccumulator &acc = crank ? crankTorque : wheelTorque;
+
+    uint8_t eventCount = data[1];
+    uint16_t period = data[4] | (data[5] << 8);
+    uint16_t torque = data[6] | (data[7] << 8);
+
+    // The period counter wraps every 32 s and the accumulated
+    // torque every 2048 Nm, which is 8 events at 255 Nm. After a
+    // longer gap, or more events, start again from this page.
+    uint8_t events = eventCount - acc.eventCount;
+    auto gap = std::chrono::duration_cast<std::chrono::milliseconds>
+        (t - acc.t).count();
+    if (!acc.valid || (gap > ANTPLUS_POWER_GAP) || (gap < 0)
+            || (events > ANTPLUS_TORQUE_EVENTS)) {
+        acc = { true, eventCount, period, torque, t };
+        return;
+    }
+
+    if (!events) {
+        // No new rotation, a repeat or we are stopped
+        return;
+    }
+    uint16_t dPeriod = period - acc.period;
+    uint16_t dTorque = torque - acc.torque;
+    double dt = std::chrono::duration<double>(t - acc.t).count();
+
+    acc = { true, eventCount, period, torque, t };
+
+    if (!dPeriod) {
+        DEBUG_COMMENT("POWER Torque, no period\n");
+        return;
+    }
+
+    // Angular velocity is 2 pi events / (period / 2048) and torque
+    // is torque / (32 events), which gives the power.
+    double seconds = dPeriod / 2048.0;
+    double power = (128.0 * M_PI * dTorque) / dPeriod;
+    double avgTorque = dTorque / (32.0 * events);
+
+    addDatum(FIELD_TORQUE, avgTorque, t);
+    addDatum(FIELD_TORQUE_POWER, power, t);
+    if (crank) {
+        addDatum(FIELD_TORQUE_CADENCE, (60.0 * events) / seconds, t);
+    } else {
+        addDatum(FIELD_WHEEL_SPEED,
+                (wheelCircumference * events) / seconds, t);
+    }
+
+    torqueSource = true;
+    addPower(t, power, dt);
+
+    DEBUG_PRINT("POWER Torque, %d, %d, %d, %f\n", crank, events,
+            dPeriod, power);
+}
+
+void ANTDevicePWR::addPower(ant_time_point t, double power, double dt) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (t.time_since_epoch()).count();
+    power3s.add(ns, power, dt);
+    power30s.add(ns, power, dt);
+
+    // Normalized power, the 30 s average sampled each second (once
+    // there are 30 s of data) to the 4th power, averaged and 4th
+    // rooted.
+    if (power30s.getSpan() < 30.0) {
+        npNext = t;
+        return;
+    }
+    while (npNext <= t) {
+        npSum += std::pow(power30s.get(), 4);
+        npCount++;
+        npNext += std::chrono::seconds(1);
+    }
+}
+
+float ANTDevicePWR::getPower3s(void) {
+    lock();
+    float p = power3s.get();
+    unlock();
+    return p;
+}
+
+float ANTDevicePWR::getPower30s(void) {
+    lock();
+    float p = power30s.get();
+    unlock();
+    return p;
+}
+
+float ANTDevicePWR::getNormalizedPower(void) {
+    lock();
+    float np = npCount ? std::pow(npSum / npCount, 0.25) : NAN;
+    unlock();
+    return np;
 }
 
 void ANTDevicePWR::processMessage(ANTMessage *message) {
@@ -238,88 +729,203 @@ void ANTDevicePWR::processMessage(ANTMessage *message) {
         return;
     }
 
-    if (data[0] == ANT_DEVICE_POWER_STANDARD) {
-        uint8_t balance = data[2];
-        if ((balance & 0x80) && (balance != 0xFF)) {
-            // We have balance data
-            balance = balance & 0x7F;
-            addDatum("BALANCE", balance, ts);
-        }
-        uint8_t cadence = data[3];
-        addDatum("CADENCE", cadence, ts);
-
-        uint16_t accPower = data[4];
-        accPower |= (data[5] << 8);
-        addDatum("ACC_POWER", accPower, ts);
-
-        uint16_t instPower = data[6];
-        instPower |= (data[7] << 8);
-        addDatum("INST_POWER", instPower, ts);
-
-        DEBUG_PRINT("POWER Standard, %d, %d, %d, %d\n", balance, cadence,
-                accPower, instPower);
-    } else if (data[0] == ANT_DEVICE_POWER_TEPS) {
-        float leftTE = (float)data[2] * 0.5;
-        float rightTE = (float)data[3] * 0.5;
-        float leftPS = (float)data[4] * 0.5;
-        float rightPS = (float)data[5] * 0.5;
-
-        addDatum("LEFT_TE", leftTE, ts);
-        addDatum("RIGHT_TE", rightTE, ts);
-        addDatum("LEFT_PS", leftPS, ts);
-        addDatum("RIGHT_PS", rightPS, ts);
-        DEBUG_PRINT("POWER TEPS, %f, %f, %f, %f\n", leftTE, rightTE,
-                leftPS, rightPS);
-    } else if (data[0] == ANT_DEVICE_POWER_BATTERY) {
-        uint8_t nBatteries = data[2] & 0x0F;
-        uint32_t operatingTime = data[3];
-        operatingTime |= (data[4] << 8);
-        operatingTime |= (data[5] << 16);
-        uint8_t batteryVoltage = data[6];
-
-        addDatum("N_BATTERIES", nBatteries, ts);
-        addDatum("OPERATING_TIME", operatingTime, ts);
-        addDatum("BATTERY_VOLTAGE", batteryVoltage, ts);
-
-        DEBUG_PRINT("POWER Battery, %d, %d, %d\n", nBatteries,
-                operatingTime, batteryVoltage);
-    } else if (data[0] == ANT_DEVICE_POWER_PARAMS) {
-        if (data[1] == ANT_DEVICE_POWER_PARAMS_CRANK) {
-            float crankLength = (float)data[4];
-            crankLength = (crankLength * 0.5) + 110.0;
-            uint8_t crankStatus = data[5] & 0x03;
-            uint8_t sensorStatus = (data[6] >> 3) & 0x01;
-
-            DEBUG_PRINT("POWER Params Crank, %f, %d, %d\n",
-                    crankLength, crankStatus, sensorStatus);
-
-            addDatum("CRANK_LENGTH", crankLength, ts);
-            addDatum("CRANK_STATUS", crankStatus, ts);
-            addDatum("SENSOR_STATUS", sensorStatus, ts);
-        } else if (data[1] == ANT_DEVICE_POWER_PARAMS_TORQUE) {
-            float peakTorqueThresh = (float)data[7] * 0.5;
-            addDatum("PEAK_TORQUE_THRESHOLD",
-                    peakTorqueThresh, ts);
-            DEBUG_PRINT("POWER Params Torque, %f\n", peakTorqueThresh);
-        } else {
-            DEBUG_COMMENT("Unknown power Paramaters Page\n");
+    const ANTPage *page = pwrPages.find(data[0], data[1]);
+    if (page != nullptr) {
+        decodePage(page, data, ts);
+        if (data[0] == ANT_DEVICE_POWER_STANDARD) {
+            accumulatePower(data, ts);
+        } else if ((data[0] == ANT_DEVICE_POWER_CRANK_TORQUE)
+                || (data[0] == ANT_DEVICE_POWER_WHEEL_TORQUE)) {
+            accumulateTorque(data, ts);
         }
-    } else {
+    } else if ((data[0] != ANT_DEVICE_COMMON_DATA)
+            && (data[0] != ANT_DEVICE_COMMON_INFO)) {
         DEBUG_PRINT("Unknown Power Page 0x%02X\n", data[0]);
     }
 }
 
+ANTHrv::ANTHrv(int window) {
+    setWindow(window);
+    clear();
+}
+
+void ANTHrv::setWindow(int window) {
+    this->window = static_cast<int64_t>(window) * 1000000L;
+}
+
+void ANTHrv::addBeat(int64_t t, double rr, bool consecutive) {
+    Beat beat = { t, rr, consecutive && !beats.empty(), 0 };
+    if (beat.hasDiff) {
+        beat.diff2 = (rr - lastRR) * (rr - lastRR);
+        sumDiff2 += beat.diff2;
+        nDiff++;
+        if (beat.diff2 > (50.0 * 50.0)) {
+            nNN50++;
+        }
+    }
+    sumRR  += rr;
+    sumRR2 += rr * rr;
+    lastRR  = rr;
+    beats.push_back(beat);
+
+    while (!beats.empty() && ((t - beats.front().t) >= window)) {
+        Beat &old = beats.front();
+        sumRR  -= old.rr;
+        sumRR2 -= old.rr * old.rr;
+        if (old.hasDiff) {
+            sumDiff2 -= old.diff2;
+            nDiff--;
+            if (old.diff2 > (50.0 * 50.0)) {
+                nNN50--;
+            }
+        }
+        beats.pop_front();
+        // The new first beat has nothing to difference against
+        if (!beats.empty() && beats.front().hasDiff) {
+            Beat &first = beats.front();
+            first.hasDiff = false;
+            sumDiff2 -= first.diff2;
+            nDiff--;
+            if (first.diff2 > (50.0 * 50.0)) {
+                nNN50--;
+            }
+        }
+    }
+}
+
+double ANTHrv::getRMSSD(void) {
+    if (!nDiff) {
+        return NAN;
+    }
+    return std::sqrt(std::max(sumDiff2, 0.0) / nDiff);
+}
+
+double ANTHrv::getSDNN(void) {
+    int n = beats.size();
+    if (n < 2) {
+        return NAN;
+    }
+    double var = (sumRR2 - (sumRR * sumRR / n)) / (n - 1);
+    return std::sqrt(std::max(var, 0.0));
+}
+
+double ANTHrv::getPNN50(void) {
+    if (!nDiff) {
+        return NAN;
+    }
+    return (100.0 * nNN50) / nDiff;
+}
+
+void ANTHrv::clear(void) {
+    beats.clear();
+    sumRR    = 0;
+    sumRR2   = 0;
+    sumDiff2 = 0;
+    nDiff    = 0;
+    nNN50    = 0;
+    lastRR   = 0;
+}
+
 ANTDeviceHR::ANTDeviceHR(const ANTDeviceID &id)
-    : ANTDevice(id) {
+    : ANTDevice(id, fieldNames, FIELD_COUNT), hrv(ANTPLUS_HRV_WINDOW) {
     hbEventTime = 0;
     previousHbEventTime = 0;
     hbCount = 0;
     toggled = false;
     lastToggleBit = 0xFF;
 
+    beatValid       = false;
+    lastHbCount     = 0;
+    lastHbEventTime = 0;
+    beatClock       = 0;
+    lastRRValid     = false;
+    missedBeats     = 0;
+
     deviceName = std::string("HEARTRATE");
 }
 
+void ANTDeviceHR::processBeat(bool havePrevious, ant_time_point t) {
+    // Start again after a gap, the event time wraps every 64 s
+    auto gap = std::chrono::duration_cast<std::chrono::milliseconds>
+        (t - lastBeat).count();
+    if (!beatValid || (gap > ANTPLUS_HR_GAP) || (gap < 0)) {
+        beatValid       = true;
+        lastHbCount     = hbCount;
+        lastHbEventTime = hbEventTime;
+        beatClock       = 0;
+        beatStart       = t;
+        lastBeat        = t;
+        lastRRValid     = false;
+        hrv.clear();
+        return;
+    }
+
+    uint8_t beats = hbCount - lastHbCount;
+    if (!beats) {
+        // Same beat again
+        return;
+    }
+
+    uint16_t sinceLast = hbEventTime - lastHbEventTime;
+    beatClock += sinceLast;
+    ant_time_point beatTime = beatStart
+        + std::chrono::nanoseconds((beatClock * 1000000000ULL) / 1024);
+
+    // With one beat the RR interval is the time since the last one,
+    // with more we missed some and only the previous event time
+    // (page 4) gives the RR interval of the latest.
+    int rr = -1;
+    if (beats == 1) {
+        rr = sinceLast;
+    } else {
+        missedBeats += havePrevious ? (beats - 1) : beats;
+        if (havePrevious) {
+            rr = static_cast<uint16_t>(hbEventTime - previousHbEventTime);
+        }
+    }
+
+    if (rr >= 0) {
+        double rrInterval = (rr * 1000.0) / 1024.0;
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (beatTime.time_since_epoch()).count();
+        addDatum(FIELD_RR_INTERVAL, rrInterval, beatTime);
+        hrv.addBeat(ns, rrInterval, (beats == 1) && lastRRValid);
+        DEBUG_PRINT("HR Beat, %d, %d, %f\n", hbCount, beats, rrInterval);
+    }
+
+    lastRRValid     = (rr >= 0);
+    lastHbCount     = hbCount;
+    lastHbEventTime = hbEventTime;
+    lastBeat        = t;
+}
+
+void ANTDeviceHR::setHrvWindow(int window) {
+    lock();
+    hrv.setWindow(window);
+    unlock();
+}
+
+float ANTDeviceHR::getRMSSD(void) {
+    lock();
+    float v = hrv.getRMSSD();
+    unlock();
+    return v;
+}
+
+float ANTDeviceHR::getSDNN(void) {
+    lock();
+    float v = hrv.getSDNN();
+    unlock();
+    return v;
+}
+
+float ANTDeviceHR::getPNN50(void) {
+    lock();
+    float v = hrv.getPNN50();
+    unlock();
+    return v;
+}
+
 void ANTDeviceHR::processMessage(ANTMessage *message) {
     ANTDevice::processMessage(message);
 
@@ -350,30 +956,26 @@ void ANTDeviceHR::processMessage(ANTMessage *message) {
 
     lastToggleBit = toggleBit;
 
-    addDatum("HEARTRATE", heartRate, ts);
+    addDatum(FIELD_HEARTRATE, heartRate, ts);
 
     uint8_t page = data[0] & 0x7F;
 
-    if (page == ANT_DEVICE_HR_PREVIOUS) {
+    // Page numbers only mean something once the toggle bit has
+    // been seen to change (legacy straps send page 0 only).
+    bool havePrevious = toggled && (page == ANT_DEVICE_HR_PREVIOUS);
+    if (havePrevious) {
         previousHbEventTime = data[2];
         previousHbEventTime |= (data[3] << 8);
-        float rrInterval = (hbEventTime - previousHbEventTime);
-        rrInterval *= (1000 / 1024);
-        addDatum("RR_INTERVAL", rrInterval, ts);
-        DEBUG_PRINT("HR Previous, %d, %d, %f\n", previousHbEventTime,
-                hbEventTime, rrInterval);
-    } else if (page == ANT_DEVICE_HR_INFO) {
-        addMetaDatum("HR_HW_VERSION", data[1]);
-        addMetaDatum("HR_SW_VERSION", data[2]);
-        addMetaDatum("HR_MODEL_NUMBER", data[3]);
-    } else if (page == ANT_DEVICE_HR_MF_INFO) {
-        uint16_t serialnum;
-        serialnum  = data[2];
-        serialnum |= (data[3] << 8);
-        addMetaDatum("HR_MANUFACTURER_ID", data[1]);
-        addMetaDatum("HR_SERIAL_NUMBER", serialnum);
-    } else if (page != ANT_DEVICE_HR_COMMON) {
+        DEBUG_PRINT("HR Previous, %d, %d\n", previousHbEventTime,
+                hbEventTime);
+    }
+
+    processBeat(havePrevious, ts);
+
+    if (const ANTPage *p = hrPages.find(page, data[1])) {
+        decodePage(p, data, ts);
+    } else if ((page != ANT_DEVICE_HR_COMMON)
+            && (page != ANT_DEVICE_HR_PREVIOUS)) {
         DEBUG_PRINT("Unknown HR Page 0x%02X\n", data[0] & 0x7F);
     }
 }
-
@@ -26,23 +26,54 @@
 
 #include <unistd.h>
 
+#include <utility>
+#include <vector>
+
 #include "antplus.h"
 #include "antinterface.h"
 #include "antdefs.h"
 #include "ant_network_key.h"
 #include "antdebug.h"
 
+ANTInterface::ANTInterface(void) {
+    pthread_mutex_init(&command_lock, NULL);
+}
 
-int ANTInterface::reset(void) {
+ANTInterface::~ANTInterface(void) {
+    cancelCommands();
+    pthread_mutex_destroy(&command_lock);
+}
+
+std::future<int> ANTInterface::reset(int timeout) {
+    // The startup message completes this (see completeCommand()),
+    // one retry in case the reset itself was lost.
     DEBUG_COMMENT("Sending ANT_SYSTEM_RESET\n");
     ANTMessage resetMessage(ANT_SYSTEM_RESET, 0);
-    sendMessage(&resetMessage);
+    return sendCommand(&resetMessage, timeout, 1);
+}
 
-    usleep(RESET_DURATION);
+int ANTInterface::reopen(int timeout) {
+    close();
+    int rc = open();
+    if (rc) {
+        // Don't retry in a tight loop
+        usleep(timeout * 1000L);
+    }
+
+    return rc;
+}
 
-    ANTMessage reply;
+int ANTInterface::sendMessages(ANTMessage *messages, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        int rc = sendMessage(&messages[i]);
+        if (rc < 0) {
+            return rc;
+        }
+        total += rc;
+    }
 
-    return 0;
+    return total;
 }
 
 int ANTInterface::setNetworkKey(uint8_t net) {
@@ -55,13 +86,12 @@ int ANTInterface::setNetworkKey(uint8_t net) {
 
 int ANTInterface::assignChannel(uint8_t chanNum, uint8_t chanType,
         uint8_t net, uint8_t ext) {
-    DEBUG_COMMENT("Sending ANT_UNASSIGN_CHANNEL\n");
-    ANTMessage unassign(ANT_UNASSIGN_CHANNEL, chanNum);
-    sendMessage(&unassign);
-
-    DEBUG_COMMENT("Sending ANT_ASSIGN_CHANNEL\n");
-    ANTMessage assign(ANT_ASSIGN_CHANNEL, chanNum, chanType, net, ext);
-    return sendMessage(&assign);
+    DEBUG_COMMENT("Sending ANT_UNASSIGN_CHANNEL, ANT_ASSIGN_CHANNEL\n");
+    ANTMessage msg[] = {
+        ANTMessage(ANT_UNASSIGN_CHANNEL, chanNum),
+        ANTMessage(ANT_ASSIGN_CHANNEL, chanNum, chanType, net, ext)
+    };
+    return sendMessages(msg, 2);
 }
 
 int ANTInterface::setChannelID(uint8_t chan, uint16_t device,
@@ -76,18 +106,12 @@ int ANTInterface::setChannelID(uint8_t chan, uint16_t device,
 }
 
 int ANTInterface::setSearchTimeout(uint8_t chan, uint8_t timeout) {
-    int rc;
-
-    DEBUG_COMMENT("Sending ANT_SEARCH_TIMEOUT\n");
-
-    ANTMessage hpTimeout(ANT_SEARCH_TIMEOUT, chan, 0);
-    if (!(rc = sendMessage(&hpTimeout))) {
-        return rc;
-    }
-
-    DEBUG_COMMENT("Sending ANT_LP_SEARCH_TIMEOUT\n");
-    ANTMessage lpTimeout(ANT_LP_SEARCH_TIMEOUT, chan, timeout);
-    return sendMessage(&lpTimeout);
+    DEBUG_COMMENT("Sending ANT_SEARCH_TIMEOUT, ANT_LP_SEARCH_TIMEOUT\n");
+    ANTMessage msg[] = {
+        ANTMessage(ANT_SEARCH_TIMEOUT, chan, 0),
+        ANTMessage(ANT_LP_SEARCH_TIMEOUT, chan, timeout)
+    };
+    return sendMessages(msg, 2);
 }
 
 int ANTInterface::setChannelPeriod(uint8_t chan, uint16_t period) {
@@ -118,15 +142,21 @@ int ANTInterface::requestDataPage(uint8_t chan, uint8_t page) {
 }
 
 int ANTInterface::openChannel(uint8_t chan, bool extMessages) {
-    if (extMessages) {
-        // Set the LIB Config before opening channel
-        // if we want to get extended messages
-        setLibConfig(chan, 0x80);
+    if (!extMessages) {
+        DEBUG_COMMENT("Sending ANT_OPEN_CHANNEL\n");
+        ANTMessage open(ANT_OPEN_CHANNEL, chan);
+        return sendMessage(&open);
     }
 
-    DEBUG_COMMENT("Sending ANT_OPEN_CHANNEL\n");
-    ANTMessage open(ANT_OPEN_CHANNEL, chan);
-    return sendMessage(&open);
+    // Set the LIB Config before opening channel
+    // if we want to get extended messages (with RSSI)
+    DEBUG_COMMENT("Sending ANT_LIB_CONFIG, ANT_OPEN_CHANNEL\n");
+    ANTMessage msg[] = {
+        ANTMessage(ANT_LIB_CONFIG, 0x00,
+                (uint8_t)(ANT_EXT_MSG_CHAN_ID | ANT_EXT_MSG_RSSI)),
+        ANTMessage(ANT_OPEN_CHANNEL, chan)
+    };
+    return sendMessages(msg, 2);
 }
 
 int ANTInterface::requestMessage(uint8_t chan, uint8_t message) {
@@ -135,3 +165,217 @@ int ANTInterface::requestMessage(uint8_t chan, uint8_t message) {
     return sendMessage(&req);
 }
 
+std::future<int> ANTInterface::sendCommand(ANTMessage *message,
+        int timeout, int retries, CommandCallback callback) {
+    return std::move(sendCommands(message, 1, timeout, retries,
+                &callback)[0]);
+}
+
+std::vector<std::future<int>> ANTInterface::sendCommands(
+        ANTMessage *messages, int n, int timeout, int retries,
+        const CommandCallback *callbacks) {
+    std::vector<Command> cmds(n);
+    std::vector<std::future<int>> results;
+
+    auto deadline = ant_clock::now() + std::chrono::milliseconds(timeout);
+    for (int i = 0; i < n; i++) {
+        cmds[i].message  = messages[i];
+        cmds[i].deadline = deadline;
+        cmds[i].timeout  = timeout;
+        cmds[i].retries  = retries;
+        if (callbacks != nullptr) {
+            cmds[i].callback = callbacks[i];
+        }
+        results.push_back(cmds[i].result.get_future());
+    }
+
+    // Send with the lock held so that the responses can not
+    // beat the commands into the table.
+    pthread_mutex_lock(&command_lock);
+
+    DEBUG_PRINT("Sending %d command(s) from 0x%02X on channel %d\n",
+            n, messages[0].getType(), messages[0].getChannel());
+    if (sendMessages(messages, n) < 0) {
+        pthread_mutex_unlock(&command_lock);
+        DEBUG_COMMENT("Unable to send command\n");
+        for (Command &cmd : cmds) {
+            if (cmd.callback) {
+                cmd.callback(CMD_ERROR);
+            }
+            cmd.result.set_value(CMD_ERROR);
+        }
+        return results;
+    }
+
+    for (Command &cmd : cmds) {
+        uint16_t key = commandKey(cmd.message.getChannel(),
+                cmd.message.getType());
+        commands[key].push_back(std::move(cmd));
+    }
+    pthread_mutex_unlock(&command_lock);
+
+    return results;
+}
+
+bool ANTInterface::completeCommand(ANTMessage *response) {
+    uint8_t code;
+    uint16_t key;
+    if (response->getType() == ANT_NOTIF_STARTUP) {
+        // The stick is back from a reset
+        code = RESPONSE_NO_ERROR;
+        key  = commandKey(0x00, ANT_SYSTEM_RESET);
+    } else if ((response->getType() == ANT_CHANNEL_EVENT)
+            && (response->getData(0) != 0x01)) {
+        // Responses have the message ID in place of the event (0x01)
+        code = response->getData(1);
+        key  = commandKey(response->getChannel(), response->getData(0));
+    } else {
+        return false;
+    }
+
+    pthread_mutex_lock(&command_lock);
+
+    auto it = commands.find(key);
+    if ((it == commands.end()) || it->second.empty()) {
+        pthread_mutex_unlock(&command_lock);
+        return false;
+    }
+
+    Command &front = it->second.front();
+    if ((code == TRANSFER_IN_PROGRESS) && (front.retries > 0)) {
+        // The stick is busy, resend on the next check
+        DEBUG_PRINT("Command 0x%02X busy on channel %d\n",
+                key & 0xFF, key >> 8);
+        front.deadline = ant_clock::now();
+        pthread_mutex_unlock(&command_lock);
+        return true;
+    }
+
+    Command cmd = std::move(front);
+    it->second.pop_front();
+    if (it->second.empty()) {
+        commands.erase(it);
+    }
+
+    pthread_mutex_unlock(&command_lock);
+
+    DEBUG_PRINT("Command 0x%02X on channel %d completed (0x%02X)\n",
+            key & 0xFF, key >> 8, code);
+    if (cmd.callback) {
+        cmd.callback(code);
+    }
+    cmd.result.set_value(code);
+
+    return true;
+}
+
+void ANTInterface::checkCommands(void) {
+    std::vector<ANTMessage> resend;
+    std::vector<Command> expired;
+
+    auto now = ant_clock::now();
+
+    pthread_mutex_lock(&command_lock);
+
+    for (auto it = commands.begin(); it != commands.end();) {
+        // Only the oldest command for each key can have been
+        // answered, the others wait behind it.
+        Command &front = it->second.front();
+        if (front.deadline <= now) {
+            if (front.retries > 0) {
+                front.retries--;
+                front.deadline = now
+                    + std::chrono::milliseconds(front.timeout);
+                resend.push_back(front.message);
+            } else {
+                expired.push_back(std::move(front));
+                it->second.pop_front();
+            }
+        }
+
+        if (it->second.empty()) {
+            it = commands.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    pthread_mutex_unlock(&command_lock);
+
+    for (ANTMessage &m : resend) {
+        DEBUG_PRINT("Resending command 0x%02X on channel %d\n",
+                m.getType(), m.getChannel());
+        sendMessage(&m);
+    }
+
+    for (Command &cmd : expired) {
+        DEBUG_PRINT("Command 0x%02X on channel %d timed out\n",
+                cmd.message.getType(), cmd.message.getChannel());
+        if (cmd.callback) {
+            cmd.callback(CMD_TIMEOUT);
+        }
+        cmd.result.set_value(CMD_TIMEOUT);
+    }
+}
+
+void ANTInterface::cancelCommands(void) {
+    std::map<uint16_t, std::deque<Command>> cancelled;
+
+    pthread_mutex_lock(&command_lock);
+    cancelled.swap(commands);
+    pthread_mutex_unlock(&command_lock);
+
+    for (auto &key : cancelled) {
+        for (Command &cmd : key.second) {
+            if (cmd.callback) {
+                cmd.callback(CMD_CANCELLED);
+            }
+            cmd.result.set_value(CMD_CANCELLED);
+        }
+    }
+}
+
+void ANTInterface::abandonCommands(uint8_t chan) {
+    pthread_mutex_lock(&command_lock);
+    for (auto &key : commands) {
+        if ((key.first >> 8) == chan) {
+            for (Command &cmd : key.second) {
+                cmd.retries = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&command_lock);
+}
+
+int ANTInterface::getCommandsInFlight(void) {
+    int n = 0;
+
+    pthread_mutex_lock(&command_lock);
+    for (auto &key : commands) {
+        n += key.second.size();
+    }
+    pthread_mutex_unlock(&command_lock);
+
+    return n;
+}
+
+void ANTInterface::processBytes(uint8_t *bytes, int nbytes,
+        std::vector<ANTMessage> *message) {
+    ant_time_point now = ant_clock::now();
+    ANTFrame frame;
+
+    while (nbytes > 0) {
+        int n = reassembler.push(bytes, nbytes);
+        bytes += n;
+        nbytes -= n;
+
+        while (reassembler.nextFrame(&frame)) {
+            if (capture != nullptr) {
+                capture->record(ANTCapture::DIR_READ, frame.data,
+                        frame.len, now);
+            }
+            message->push_back(ANTMessage(frame.data, frame.len));
+            message->back().setTimestamp(now);
+        }
+    }
+}
@@ -27,6 +27,4 @@
 #ifndef ANTPLUS_LIB_ANTINTERFACE_H_
 #define ANTPLUS_LIB_ANTINTERFACE_H_
 
-#define RESET_DURATION      500000L
-
 #endif  // ANTPLUS_LIB_ANTINTERFACE_H_
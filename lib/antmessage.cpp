@@ -24,7 +24,7 @@
 // SOFTWARE.
 //
 
-#include <memory>
+#include <cstring>
 
 #include "antplus.h"
 #include "antmessage.h"
@@ -35,17 +35,12 @@ ANTMessage::ANTMessage(void) {
     antType = 0x00;
     antChannel = 0x00;
     antDataLen = 0;
+    antRssi = ANTPLUS_RSSI_NONE;
 
-    antData = std::make_unique<uint8_t[]> (ANTPLUS_MAX_MESSAGE_SIZE);
-    for (int i=0; i < ANTPLUS_MAX_MESSAGE_SIZE; i++) {
-        antData[i] = 0x00;
-    }
-}
-
-ANTMessage::~ANTMessage(void) {
+    memset(antData, 0, sizeof(antData));
 }
 
-ANTMessage::ANTMessage(uint8_t *data, int data_len)
+ANTMessage::ANTMessage(const uint8_t *data, int data_len)
     : ANTMessage() {
     decode(data, data_len);
 }
@@ -53,13 +48,15 @@ ANTMessage::ANTMessage(uint8_t *data, int data_len)
 ANTMessage::ANTMessage(uint8_t type, uint8_t chan, uint8_t *data, int len)
     : ANTMessage() {
     // Copy to internal structure
+    if (len > ANTPLUS_MAX_DATA_SIZE) {
+        len = ANTPLUS_MAX_DATA_SIZE;
+    }
+
     antType = type;
     antChannel = chan;
     antDataLen = len;
 
-    for (int i=0; i < len; i++) {
-        antData[i] = data[i];
-    }
+    memcpy(antData, data, len);
 }
 
 ANTMessage::ANTMessage(uint8_t type, uint8_t chan)
@@ -123,7 +120,7 @@ ANTMessage::ANTMessage(uint8_t type, uint8_t chan, uint8_t b0,
     antData[4] = b4;
 }
 
-int ANTMessage::decode(uint8_t *data, int data_len) {
+int ANTMessage::decode(const uint8_t *data, int data_len) {
     if (data_len < 5) {
         DEBUG_COMMENT("Data too short (< 5)\n");
         return ERROR_LEN;
@@ -150,34 +147,50 @@ int ANTMessage::decode(uint8_t *data, int data_len) {
         return ERROR_CRC;
     }
 
+    if ((data[1] - 1) > ANTPLUS_MAX_DATA_SIZE) {
+        DEBUG_COMMENT("Data length too long for message.\n");
+        return ERROR_LEN;
+    }
+
     // Now create the message structure
-    // We have a copy but its probably safer ....
 
     antDataLen = data[1] - 1;
     antType = data[2];
     antChannel = data[3];
 
-    for (int i=0; i < antDataLen; i++) {
-        antData[i] = data[4+i];
-    }
+    memcpy(antData, &data[4], antDataLen);
 
     DEBUG_PRINT("antDataLen = %d antType = 0x%02X antChannel = %d\n",
             antDataLen, antType, antChannel);
 
     if (antDataLen > 8) {
-        // We have an extended format
+        // We have an extended format, the flag byte says which
+        // blocks follow (in the order channel ID, RSSI, timestamp)
         uint8_t ext = antData[8];
+        int offset = 9;
         if (ext & ANT_EXT_MSG_CHAN_ID) {
-            uint16_t deviceID;
-            deviceID  = antData[9];
-            deviceID |= (antData[10] << 8);
-            uint8_t deviceType = antData[11];
-            uint8_t transType = antData[12];
-
-            antDeviceID = ANTDeviceID(deviceID, deviceType);
-
-            DEBUG_PRINT("Device ID = 0x%04X type = 0x%02X transType = 0x%02X\n",
-                    deviceID, deviceType, transType);
+            if (antDataLen >= (offset + 4)) {
+                uint16_t deviceID;
+                deviceID  = antData[offset];
+                deviceID |= (antData[offset + 1] << 8);
+                uint8_t deviceType = antData[offset + 2];
+                uint8_t transType = antData[offset + 3];
+
+                antDeviceID = ANTDeviceID(deviceID, deviceType, transType);
+
+                DEBUG_PRINT("Device ID = 0x%04X type = 0x%02X "
+                        "transType = 0x%02X\n",
+                        deviceID, deviceType, transType);
+            }
+            offset += 4;
+        }
+        if (ext & ANT_EXT_MSG_RSSI) {
+            // Measurement type, RSSI value, threshold
+            if (antDataLen >= (offset + 3)) {
+                antRssi = (int8_t)antData[offset + 1];
+                DEBUG_PRINT("RSSI = %d dBm\n", antRssi);
+            }
+            offset += 3;
         }
     }
 
@@ -0,0 +1,113 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cstring>
+
+#include "antplus.h"
+#include "antreassembler.h"
+#include "antdefs.h"
+#include "antdebug.h"
+
+ANTReassembler::ANTReassembler(void) {
+    reset();
+}
+
+void ANTReassembler::reset(void) {
+    head = 0;
+    tail = 0;
+    dropped = 0;
+}
+
+int ANTReassembler::push(const uint8_t *bytes, int nbytes) {
+    // Frames handed out by nextFrame() point into the buffer, so
+    // only move data once the caller comes back with more bytes.
+    if (head == tail) {
+        head = 0;
+        tail = 0;
+    } else if ((head > 0) && (nbytes > (ANTPLUS_REASSEMBLER_SIZE - tail))) {
+        memmove(buffer, &buffer[head], tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    int n = ANTPLUS_REASSEMBLER_SIZE - tail;
+    if (nbytes < n) {
+        n = nbytes;
+    }
+
+    memcpy(&buffer[tail], bytes, n);
+    tail += n;
+
+    return n;
+}
+
+bool ANTReassembler::nextFrame(ANTFrame *frame) {
+    while ((tail - head) >= 2) {
+        // Search for sync
+        if (buffer[head] != ANT_SYNC_BYTE) {
+            head++;
+            dropped++;
+            continue;
+        }
+
+        // Second byte is length, check it is sensible
+        // before we wait for the rest of the frame
+        if (buffer[head + 1] > ANT_MAX_MESSAGE_LEN) {
+            DEBUG_PRINT("Invalid frame length %d, resyncing\n",
+                    buffer[head + 1]);
+            head++;
+            dropped++;
+            continue;
+        }
+
+        int len = buffer[head + 1] + 4;
+        if ((tail - head) < len) {
+            // Partial frame, wait for more data
+            return false;
+        }
+
+        uint8_t crc = 0;
+        for (int i = 0; i < (len - 1); i++) {
+            crc ^= buffer[head + i];
+        }
+
+        if (crc != buffer[head + len - 1]) {
+            DEBUG_COMMENT("CRC MISMATCH, resyncing\n");
+            head++;
+            dropped++;
+            continue;
+        }
+
+        frame->data = &buffer[head];
+        frame->len = len;
+        head += len;
+
+        return true;
+    }
+
+    return false;
+}
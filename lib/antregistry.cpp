@@ -0,0 +1,84 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antregistry.h"
+#include "antdebug.h"
+
+ANTDeviceRegistry::ANTDeviceRegistry(void) {
+    pthread_mutex_init(&registry_lock, NULL);
+}
+
+ANTDeviceRegistry::~ANTDeviceRegistry(void) {
+    pthread_mutex_destroy(&registry_lock);
+}
+
+shared_ptr<ANTDevice> ANTDeviceRegistry::find(const ANTDeviceID &id) {
+    shared_ptr<ANTDevice> dev = nullptr;
+
+    pthread_mutex_lock(&registry_lock);
+    auto it = devices.find(id);
+    if (it != devices.end()) {
+        dev = it->second;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return dev;
+}
+
+shared_ptr<ANTDevice> ANTDeviceRegistry::add(shared_ptr<ANTDevice> dev) {
+    // If the device is already known, keep
+    // the existing one and return that
+    pthread_mutex_lock(&registry_lock);
+    auto rtn = devices.emplace(dev->getDeviceID(), dev);
+    if (rtn.second) {
+        deviceList.push_back(dev);
+    }
+    dev = rtn.first->second;
+    pthread_mutex_unlock(&registry_lock);
+
+    return dev;
+}
+
+size_t ANTDeviceRegistry::size(void) {
+    pthread_mutex_lock(&registry_lock);
+    size_t n = devices.size();
+    pthread_mutex_unlock(&registry_lock);
+
+    return n;
+}
+
+std::vector<shared_ptr<ANTDevice>> ANTDeviceRegistry::getDeviceList(void) {
+    pthread_mutex_lock(&registry_lock);
+    auto list = deviceList;
+    pthread_mutex_unlock(&registry_lock);
+
+    return list;
+}
@@ -0,0 +1,182 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "antplus.h"
+#include "antreplayinterface.h"
+#include "antdefs.h"
+#include "antdebug.h"
+
+ANTReplayInterface::ANTReplayInterface(std::string fname) {
+    filename    = fname;
+    file        = NULL;
+    readTimeout = 256;
+    speed       = 1.0;
+    done        = false;
+    frames      = 0;
+    started     = false;
+    firstTs     = 0;
+    recTs       = 0;
+    recDir      = 0;
+    recLen      = 0;
+}
+
+ANTReplayInterface::~ANTReplayInterface(void) {
+    close();
+}
+
+int ANTReplayInterface::open(void) {
+    close();
+
+    file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        DEBUG_PRINT("Unable to open %s\n", filename.c_str());
+        return ERROR;
+    }
+
+    char magic[sizeof(ANTPLUS_CAPTURE_MAGIC)] = {0};
+    size_t len = strlen(ANTPLUS_CAPTURE_MAGIC);
+    if ((fread(magic, 1, len, file) != len)
+            || strncmp(magic, ANTPLUS_CAPTURE_MAGIC, len)) {
+        DEBUG_PRINT("%s is not a capture file\n", filename.c_str());
+        fclose(file);
+        file = NULL;
+        return ERROR;
+    }
+
+    done    = false;
+    started = false;
+    frames  = 0;
+    recLen  = 0;
+
+    return NOERROR;
+}
+
+int ANTReplayInterface::close(void) {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+
+    return NOERROR;
+}
+
+int ANTReplayInterface::sendMessage(ANTMessage *message) {
+    // Nothing to send to, but look like a successful write
+    return message->getDataLen() + 5;
+}
+
+int ANTReplayInterface::nextRecord(void) {
+    if ((fread(&recTs, sizeof(recTs), 1, file) != 1)
+            || (fread(&recDir, sizeof(recDir), 1, file) != 1)
+            || (fread(&recLen, sizeof(recLen), 1, file) != 1)
+            || (fread(recFrame, 1, recLen, file) != recLen)) {
+        recLen = 0;
+        return ERROR;
+    }
+
+    return NOERROR;
+}
+
+int ANTReplayInterface::readMessage(std::vector<ANTMessage> *message) {
+    if (file == NULL) {
+        return ERROR;
+    }
+
+    if (done) {
+        // Behave like a quiet stick
+        usleep(readTimeout * 1000L);
+        return 0;
+    }
+
+    ant_time_point deadline = ant_clock::now()
+        + std::chrono::milliseconds(readTimeout);
+
+    int count = 0;
+    while (count < ANTPLUS_QUEUE_BATCH) {
+        // recLen is zero when we need a new record
+        if (!recLen && nextRecord()) {
+            DEBUG_PRINT("Replay finished after %lu frames\n",
+                    (unsigned long)frames);
+            done = true;
+            break;
+        }
+
+        if (recDir != ANTCapture::DIR_READ) {
+            recLen = 0;
+            continue;
+        }
+
+        if (!started) {
+            firstTs = recTs;
+            replayStart = ant_clock::now();
+            started = true;
+        }
+
+        auto offset = std::chrono::nanoseconds(recTs - firstTs);
+
+        if (speed > 0) {
+            ant_time_point due = replayStart
+                + std::chrono::duration_cast<std::chrono::nanoseconds>
+                (offset / speed);
+            ant_time_point now = ant_clock::now();
+            if (due > now) {
+                // Return what we have, or wait (up to the
+                // timeout) for the next frame to become due.
+                if (count) {
+                    break;
+                }
+                if (due > deadline) {
+                    if (deadline > now) {
+                        usleep(std::chrono::duration_cast
+                            <std::chrono::microseconds>
+                            (deadline - now).count());
+                    }
+                    break;
+                }
+                usleep(std::chrono::duration_cast
+                    <std::chrono::microseconds>(due - now).count());
+            }
+        }
+
+        // Keep the original spacing between messages,
+        // starting from when the replay started.
+        message->push_back(ANTMessage(recFrame, recLen));
+        message->back().setTimestamp(replayStart + offset);
+        recLen = 0;
+        frames++;
+        count++;
+    }
+
+    return count;
+}
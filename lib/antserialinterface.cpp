@@ -0,0 +1,330 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/epoll.h>
+
+#include <string>
+#include <vector>
+
+#include "antplus.h"
+#include "antserialinterface.h"
+#include "antdefs.h"
+#include "antdebug.h"
+
+static int baudToSpeed(int baud, speed_t *speed) {
+    switch (baud) {
+        case 4800:   *speed = B4800;   break;
+        case 9600:   *speed = B9600;   break;
+        case 19200:  *speed = B19200;  break;
+        case 38400:  *speed = B38400;  break;
+        case 57600:  *speed = B57600;  break;
+        case 115200: *speed = B115200; break;
+#ifdef B230400
+        case 230400: *speed = B230400; break;
+#endif
+#ifdef B460800
+        case 460800: *speed = B460800; break;
+#endif
+#ifdef B921600
+        case 921600: *speed = B921600; break;
+#endif
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static bool isHangup(int err) {
+    // The errors we get once the port has gone away
+    return (err == EIO) || (err == ENXIO) || (err == ENODEV);
+}
+
+ANTSerialInterface::ANTSerialInterface(std::string dev, int b) {
+    device       = dev;
+    baud         = b;
+    flowControl  = false;
+    fd           = -1;
+    epollFd      = -1;
+    deviceLost   = false;
+    readTimeout  = 256;
+    writeTimeout = 256;
+
+    pthread_mutex_init(&write_lock, NULL);
+}
+
+ANTSerialInterface::~ANTSerialInterface(void) {
+    close();
+    pthread_mutex_destroy(&write_lock);
+}
+
+int ANTSerialInterface::open(void) {
+    close();
+    deviceLost = false;
+
+    speed_t speed;
+    if (baudToSpeed(baud, &speed)) {
+        DEBUG_PRINT("Unsupported baud rate %d\n", baud);
+        return ERROR;
+    }
+
+    fd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        DEBUG_PRINT("Unable to open %s (errno = %d)\n",
+                device.c_str(), errno);
+        return ERROR;
+    }
+
+    // Raw 8N1, no echo or line processing and
+    // no blocking in read (we wait on epoll).
+    struct termios tty;
+    if (tcgetattr(fd, &tty)) {
+        DEBUG_PRINT("tcgetattr failed on %s\n", device.c_str());
+        close();
+        return ERROR;
+    }
+
+    cfmakeraw(&tty);
+    tty.c_cflag |= (CLOCAL | CREAD);
+    tty.c_cflag &= ~(CSTOPB | PARENB);
+    if (flowControl) {
+        tty.c_cflag |= CRTSCTS;
+    } else {
+        tty.c_cflag &= ~CRTSCTS;
+    }
+    tty.c_cc[VMIN]  = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+
+    if (tcsetattr(fd, TCSANOW, &tty)) {
+        DEBUG_PRINT("tcsetattr failed on %s\n", device.c_str());
+        close();
+        return ERROR;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        DEBUG_COMMENT("epoll_create1 failed\n");
+        close();
+        return ERROR;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev)) {
+        DEBUG_COMMENT("epoll_ctl failed\n");
+        close();
+        return ERROR;
+    }
+
+    DEBUG_PRINT("Opened %s at %d baud\n", device.c_str(), baud);
+
+    return NOERROR;
+}
+
+int ANTSerialInterface::close(void) {
+    if (epollFd >= 0) {
+        ::close(epollFd);
+        epollFd = -1;
+    }
+
+    // Writers may be on other threads
+    pthread_mutex_lock(&write_lock);
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    reassembler.reset();
+
+    return NOERROR;
+}
+
+int ANTSerialInterface::writeBytes(uint8_t *bytes, int size) {
+    // The port is non-blocking, so wait for it to drain
+    // (up to the write timeout) if the buffer is full. Called
+    // with the write lock held, so frames are not interleaved.
+    if (fd < 0) {
+        return ERROR;
+    }
+
+    int written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, bytes + written, size - written);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+
+        if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+            DEBUG_PRINT("write failed (errno = %d)\n", errno);
+            if (isHangup(errno)) {
+                deviceLost = true;
+            }
+            return ERROR;
+        }
+
+        struct pollfd p = { fd, POLLOUT, 0 };
+        if (poll(&p, 1, writeTimeout) <= 0) {
+            DEBUG_COMMENT("Timeout writing to serial port\n");
+            return ERROR;
+        }
+    }
+
+    return written;
+}
+
+int ANTSerialInterface::sendMessage(ANTMessage *message) {
+    int msg_len;
+    uint8_t msg[ANTPLUS_MAX_MESSAGE_SIZE];
+
+    message->encode(msg, &msg_len);
+
+    pthread_mutex_lock(&write_lock);
+
+    if (capture != nullptr) {
+        capture->record(ANTCapture::DIR_WRITE, msg, msg_len,
+                ant_clock::now());
+    }
+
+    int rc = writeBytes(msg, msg_len);
+
+    pthread_mutex_unlock(&write_lock);
+
+    return rc;
+}
+
+int ANTSerialInterface::sendMessages(ANTMessage *messages, int n) {
+    // There is no packet size on a UART, so send the lot in one go
+    std::vector<uint8_t> buffer;
+    buffer.reserve(n * ANTPLUS_MAX_MESSAGE_SIZE);
+
+    pthread_mutex_lock(&write_lock);
+
+    for (int i = 0; i < n; i++) {
+        int msg_len;
+        uint8_t msg[ANTPLUS_MAX_MESSAGE_SIZE];
+        messages[i].encode(msg, &msg_len);
+
+        if (capture != nullptr) {
+            capture->record(ANTCapture::DIR_WRITE, msg, msg_len,
+                    ant_clock::now());
+        }
+
+        buffer.insert(buffer.end(), msg, msg + msg_len);
+    }
+
+    int rc = 0;
+    if (!buffer.empty()) {
+        rc = writeBytes(buffer.data(), buffer.size());
+    }
+
+    pthread_mutex_unlock(&write_lock);
+
+    return rc;
+}
+
+int ANTSerialInterface::readMessage(std::vector<ANTMessage> *message) {
+    if (fd < 0) {
+        return ERROR;
+    }
+
+    struct epoll_event ev;
+    int rc = epoll_wait(epollFd, &ev, 1, readTimeout);
+    if (rc < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        DEBUG_PRINT("epoll_wait failed (errno = %d)\n", errno);
+        return ERROR;
+    }
+
+    if (rc == 0) {
+        return 0;
+    }
+
+    if (ev.events & (EPOLLERR | EPOLLHUP)) {
+        DEBUG_PRINT("Serial port %s closed\n", device.c_str());
+        deviceLost = true;
+        return ERROR;
+    }
+
+    // Drain everything available
+    uint8_t bytes[ANTPLUS_MAX_MESSAGE_SIZE];
+    int nbytes = 0;
+    for (;;) {
+        ssize_t n = read(fd, bytes, sizeof(bytes));
+        if (n > 0) {
+            processBytes(bytes, n, message);
+            nbytes += n;
+            continue;
+        }
+
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        if ((n < 0) && (errno != EAGAIN)) {
+            DEBUG_PRINT("read failed (errno = %d)\n", errno);
+            if (isHangup(errno)) {
+                deviceLost = true;
+            }
+            return ERROR;
+        }
+
+        break;
+    }
+
+    DEBUG_PRINT("Recieved %d bytes.\n", nbytes);
+
+    return nbytes;
+}
+
+int ANTSerialInterface::getPollFds(std::vector<struct pollfd> *fds) {
+    if (fd < 0) {
+        return ERROR;
+    }
+
+    struct pollfd p;
+    p.fd      = fd;
+    p.events  = POLLIN;
+    p.revents = 0;
+
+    fds->clear();
+    fds->push_back(p);
+
+    return NOERROR;
+}
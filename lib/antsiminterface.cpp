@@ -0,0 +1,483 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cmath>
+#include <vector>
+
+#include "antplus.h"
+#include "antsiminterface.h"
+#include "antdefs.h"
+#include "antdebug.h"
+
+extern ANTDeviceParams antDeviceParams[];
+
+ANTSimInterface::ANTSimInterface(void) {
+    isOpen      = false;
+    connected   = true;
+    readTimeout = 256;
+    rate        = 1.0;
+    loss        = 0.0;
+    jitter      = 0;
+    rssi        = -60;
+    libConfig   = 0x00;
+    sent        = 0;
+    lost        = 0;
+
+    for (int i = 0; i < ANTPLUS_SIM_CHANNELS; i++) {
+        channels[i] = {false, 0x00, 0x0000};
+    }
+
+    pthread_mutex_init(&sim_lock, NULL);
+    pthread_cond_init(&sim_cond, NULL);
+}
+
+ANTSimInterface::~ANTSimInterface(void) {
+    close();
+    pthread_cond_destroy(&sim_cond);
+    pthread_mutex_destroy(&sim_lock);
+}
+
+int ANTSimInterface::open(void) {
+    pthread_mutex_lock(&sim_lock);
+    isOpen = connected;
+    pthread_mutex_unlock(&sim_lock);
+    return isOpen ? NOERROR : ERROR;
+}
+
+void ANTSimInterface::setConnected(bool c) {
+    if (!c) {
+        close();
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    connected = c;
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+bool ANTSimInterface::isDeviceLost(void) {
+    // Only unplugging (or closing) the stick loses it
+    pthread_mutex_lock(&sim_lock);
+    bool lost = !isOpen;
+    pthread_mutex_unlock(&sim_lock);
+    return lost;
+}
+
+int ANTSimInterface::close(void) {
+    pthread_mutex_lock(&sim_lock);
+    isOpen = false;
+    for (int i = 0; i < ANTPLUS_SIM_CHANNELS; i++) {
+        channels[i].open = false;
+    }
+    pending.clear();
+    pthread_mutex_unlock(&sim_lock);
+    return NOERROR;
+}
+
+int ANTSimInterface::addDevice(uint8_t type, uint16_t id,
+        uint8_t transType) {
+    // Use the channel period for this device type
+    int i = 0;
+    while (antDeviceParams[i].type != ANTChannel::TYPE_NONE) {
+        if ((antDeviceParams[i].deviceType == type) && type) {
+            break;
+        }
+        i++;
+    }
+
+    if (antDeviceParams[i].type == ANTChannel::TYPE_NONE) {
+        DEBUG_PRINT("Unable to simulate device type 0x%02X\n", type);
+        return ERROR;
+    }
+
+    SimDevice dev;
+    dev.id           = ANTDeviceID(id, type, transType);
+    dev.period       = (int64_t)antDeviceParams[i].devicePeriod
+        * 1000000000L / 32768;
+    dev.next         = ant_clock::now();
+    dev.count        = 0;
+    dev.simTime      = 0;
+    dev.nextBeat     = 0;
+    dev.beatTime     = 0;
+    dev.prevBeatTime = 0;
+    dev.beatCount    = 0;
+    dev.accPower     = 0;
+
+    pthread_mutex_lock(&sim_lock);
+    // Spread the first broadcasts over one period
+    std::uniform_int_distribution<int64_t> phase(0, dev.period);
+    dev.next += std::chrono::nanoseconds(phase(rng));
+    devices.push_back(dev);
+    pthread_mutex_unlock(&sim_lock);
+
+    DEBUG_PRINT("Added sim device 0x%04X type 0x%02X\n", id, type);
+
+    return NOERROR;
+}
+
+int ANTSimInterface::addDevices(uint8_t type, int n, uint16_t firstID) {
+    for (int i = 0; i < n; i++) {
+        if (addDevice(type, firstID + i)) {
+            return ERROR;
+        }
+    }
+
+    return NOERROR;
+}
+
+void ANTSimInterface::respond(uint8_t chan, uint8_t msg, uint8_t code) {
+    // Must be called with sim_lock held
+    pending.push_back(ANTMessage(ANT_CHANNEL_EVENT, chan, msg, code));
+    pending.back().setTimestamp();
+}
+
+int ANTSimInterface::sendMessage(ANTMessage *message) {
+    uint8_t type = message->getType();
+    uint8_t chan = message->getChannel();
+    const uint8_t *data = message->getData();
+
+    pthread_mutex_lock(&sim_lock);
+
+    if (!isOpen) {
+        pthread_mutex_unlock(&sim_lock);
+        return ERROR;
+    }
+
+    // The network commands carry the network number in place
+    // of the channel, everything else must be a valid channel.
+    if ((type != ANT_SYSTEM_RESET) && (type != ANT_SET_NETWORK)
+            && (chan >= ANTPLUS_SIM_CHANNELS)) {
+        DEBUG_PRINT("Invalid sim channel %d\n", chan);
+        pthread_mutex_unlock(&sim_lock);
+        return ERROR;
+    }
+
+    switch (type) {
+        case ANT_SYSTEM_RESET:
+            for (int i = 0; i < ANTPLUS_SIM_CHANNELS; i++) {
+                channels[i] = {false, 0x00, 0x0000};
+            }
+            libConfig = 0x00;
+            pending.push_back(ANTMessage(ANT_NOTIF_STARTUP, 0x00));
+            pending.back().setTimestamp();
+            break;
+        case ANT_UNASSIGN_CHANNEL:
+            channels[chan] = {false, 0x00, 0x0000};
+            respond(chan, type, RESPONSE_NO_ERROR);
+            break;
+        case ANT_CHANNEL_ID:
+            channels[chan].id   = data[0] | (data[1] << 8);
+            channels[chan].type = data[2];
+            respond(chan, type, RESPONSE_NO_ERROR);
+            break;
+        case ANT_OPEN_CHANNEL:
+            channels[chan].open = true;
+            respond(chan, type, RESPONSE_NO_ERROR);
+            break;
+        case ANT_CLOSE_CHANNEL:
+            channels[chan].open = false;
+            respond(chan, type, RESPONSE_NO_ERROR);
+            respond(chan, 0x01, EVENT_CHANNEL_CLOSED);
+            break;
+        case ANT_REQ_MESSAGE:
+            if (data[0] == ANT_CHANNEL_ID) {
+                pending.push_back(ANTMessage(ANT_CHANNEL_ID, chan,
+                        (uint8_t)(channels[chan].id & 0xFF),
+                        (uint8_t)(channels[chan].id >> 8),
+                        channels[chan].type, 0x01));
+                pending.back().setTimestamp();
+            }
+            break;
+        case ANT_ACK_DATA:
+        case ANT_BROADCAST_DATA:
+            respond(chan, 0x01, EVENT_TRANSFER_TX_COMPLETED);
+            break;
+        case ANT_LIB_CONFIG:
+            libConfig = data[0];
+            respond(chan, type, RESPONSE_NO_ERROR);
+            break;
+        case ANT_SET_NETWORK:
+        case ANT_ASSIGN_CHANNEL:
+        case ANT_CHANNEL_PERIOD:
+        case ANT_SEARCH_TIMEOUT:
+        case ANT_LP_SEARCH_TIMEOUT:
+        case ANT_CHANNEL_FREQUENCY:
+            respond(chan, type, RESPONSE_NO_ERROR);
+            break;
+        default:
+            DEBUG_PRINT("Sim ignoring message 0x%02X\n", type);
+            break;
+    }
+
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+
+    // Like a bulk write, return the number of bytes sent
+    return message->getDataLen() + 5;
+}
+
+int ANTSimInterface::findChannel(ANTDeviceID id) {
+    for (int i = 0; i < ANTPLUS_SIM_CHANNELS; i++) {
+        if (channels[i].open
+                && (!channels[i].type || channels[i].type == id.getType())
+                && (!channels[i].id || channels[i].id == id.getID())) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void ANTSimInterface::makePage(SimDevice *dev, uint8_t *data) {
+    // Values follow a slow sinusoid in sensor time with some
+    // noise on top, so the series look like real sensor data.
+    std::uniform_real_distribution<double> noise(-1.0, 1.0);
+    double t = dev->simTime;
+    double power = 200 + 50 * sin(t / 30.0) + 10 * noise(rng);
+    double cadence = 90 + 5 * sin(t / 20.0) + noise(rng);
+
+    for (int i = 0; i < 8; i++) {
+        data[i] = 0xFF;
+    }
+
+    uint32_t n = dev->count;
+
+    if (dev->id.getType() == ANT_DEVICE_HR) {
+        double hr = 140 + 20 * sin(t / 60.0) + 2 * noise(rng);
+        while (dev->nextBeat <= t) {
+            dev->prevBeatTime = dev->beatTime;
+            dev->beatTime = (uint16_t)lround(dev->nextBeat * 1024);
+            dev->beatCount++;
+            dev->nextBeat += 60.0 / hr;
+        }
+
+        // Page 4 (previous beat) with page 2 and 3 interleaved,
+        // the toggle bit changes every 4 messages.
+        uint8_t page = ANT_DEVICE_HR_PREVIOUS;
+        if ((n % 65) == 64) {
+            page = ((n / 65) & 1) ? ANT_DEVICE_HR_INFO
+                : ANT_DEVICE_HR_MF_INFO;
+        }
+
+        data[0] = page | (((n / 4) & 1) << 7);
+        if (page == ANT_DEVICE_HR_PREVIOUS) {
+            data[1] = 0xFF;
+            data[2] = dev->prevBeatTime & 0xFF;
+            data[3] = dev->prevBeatTime >> 8;
+        } else if (page == ANT_DEVICE_HR_INFO) {
+            data[1] = 0x01;
+            data[2] = 0x02;
+            data[3] = 0x03;
+        } else {
+            data[1] = 0xFF;
+            data[2] = dev->id.getID() & 0xFF;
+            data[3] = dev->id.getID() >> 8;
+        }
+        data[4] = dev->beatTime & 0xFF;
+        data[5] = dev->beatTime >> 8;
+        data[6] = dev->beatCount;
+        data[7] = (uint8_t)lround(hr);
+
+    } else if (dev->id.getType() == ANT_DEVICE_PWR) {
+        if ((n % 121) == 120) {
+            data[0] = ANT_DEVICE_COMMON_DATA;
+            data[3] = 0x01;
+            data[4] = 0xFF;
+            data[5] = 0x00;
+            data[6] = 0x01;
+            data[7] = 0x00;
+        } else {
+            uint16_t inst = (uint16_t)lround(power);
+            dev->accPower += inst;
+            data[0] = ANT_DEVICE_POWER_STANDARD;
+            data[1] = n & 0xFF;
+            data[2] = 0x80 | 50;
+            data[3] = (uint8_t)lround(cadence);
+            data[4] = dev->accPower & 0xFF;
+            data[5] = dev->accPower >> 8;
+            data[6] = inst & 0xFF;
+            data[7] = inst >> 8;
+        }
+
+    } else if (dev->id.getType() == ANT_DEVICE_FEC) {
+        // FE-C alternates pages in pairs
+        if ((n % 66) >= 64) {
+            data[0] = ANT_DEVICE_COMMON_DATA;
+            data[3] = 0x01;
+            data[4] = 0xFF;
+            data[5] = 0x00;
+            data[6] = 0x01;
+            data[7] = 0x00;
+        } else if ((n / 2) & 1) {
+            uint16_t inst = (uint16_t)lround(power);
+            dev->accPower += inst;
+            data[0] = ANT_DEVICE_FEC_TRAINER;
+            data[1] = n & 0xFF;
+            data[2] = (uint8_t)lround(cadence);
+            data[3] = dev->accPower & 0xFF;
+            data[4] = dev->accPower >> 8;
+            data[5] = inst & 0xFF;
+            data[6] = ((inst >> 8) & 0x0F) | 0x20;
+            data[7] = 0x00;
+        } else {
+            uint16_t speed = (uint16_t)lround(
+                (9.0 + 0.02 * power) * 1000.0);  // mm/s
+            data[0] = ANT_DEVICE_FEC_GENERAL;
+            data[1] = 0x19;
+            data[2] = (uint8_t)(t * 4);
+            data[3] = 0x00;
+            data[4] = speed & 0xFF;
+            data[5] = speed >> 8;
+            data[6] = 0xFF;
+            data[7] = 0x24;
+        }
+    }
+}
+
+int ANTSimInterface::generate(ant_time_point now,
+        std::vector<ANTMessage> *message, ant_time_point *nextDue) {
+    // Must be called with sim_lock held
+    std::uniform_real_distribution<float> drop(0.0, 1.0);
+    std::uniform_int_distribution<int> jit(-jitter, jitter);
+    std::uniform_int_distribution<int> fade(-3, 3);
+    uint8_t data[16];
+    int count = 0;
+
+    *nextDue = now + std::chrono::milliseconds(readTimeout);
+
+    for (SimDevice& dev : devices) {
+        int64_t period = (int64_t)(dev.period / rate);
+        if (period < 1000) {
+            period = 1000;
+        }
+
+        // If we are a long way behind don't try to catch
+        // up, restart the schedule from now.
+        if ((now - dev.next) > std::chrono::seconds(1)) {
+            dev.next = now;
+        }
+
+        while (dev.next <= now) {
+            int chan = findChannel(dev.id);
+            if (chan >= 0) {
+                makePage(&dev, data);
+                int len = 13;
+                data[8]  = ANT_EXT_MSG_CHAN_ID;
+                data[9]  = dev.id.getID() & 0xFF;
+                data[10] = dev.id.getID() >> 8;
+                data[11] = dev.id.getType();
+                data[12] = dev.id.getTransType();
+                if (libConfig & ANT_EXT_MSG_RSSI) {
+                    data[8] |= ANT_EXT_MSG_RSSI;
+                    data[13] = 0x20;
+                    data[14] = (uint8_t)(int8_t)(rssi + fade(rng));
+                    data[15] = (uint8_t)(int8_t)-96;
+                    len = 16;
+                }
+
+                if (drop(rng) < loss) {
+                    lost++;
+                } else {
+                    // Round trip through the wire format so the
+                    // messages decode exactly as real ones do.
+                    uint8_t frame[ANTPLUS_MAX_MESSAGE_SIZE];
+                    int frameLen;
+                    ANTMessage(ANT_BROADCAST_DATA, chan, data,
+                            len).encode(frame, &frameLen);
+                    message->push_back(ANTMessage(frame, frameLen));
+                    message->back().setTimestamp(dev.next);
+                    sent++;
+                    count++;
+                }
+            }
+
+            // Sensor time always runs at the nominal rate
+            dev.count++;
+            dev.simTime += dev.period * 1e-9;
+            dev.next += std::chrono::nanoseconds(period)
+                + std::chrono::microseconds(jitter ? jit(rng) : 0);
+        }
+
+        if (dev.next < *nextDue) {
+            *nextDue = dev.next;
+        }
+    }
+
+    return count;
+}
+
+int ANTSimInterface::readMessage(std::vector<ANTMessage> *message) {
+    ant_time_point deadline = ant_clock::now()
+        + std::chrono::milliseconds(readTimeout);
+
+    pthread_mutex_lock(&sim_lock);
+
+    if (!isOpen) {
+        pthread_mutex_unlock(&sim_lock);
+        return ERROR;
+    }
+
+    int count = 0;
+    while (isOpen) {
+        for (ANTMessage& m : pending) {
+            message->push_back(m);
+        }
+        count += pending.size();
+        pending.clear();
+
+        ant_time_point now = ant_clock::now();
+        ant_time_point nextDue;
+        count += generate(now, message, &nextDue);
+
+        if (count || (now >= deadline)) {
+            break;
+        }
+
+        // Sleep until the next broadcast, the timeout or
+        // a command comes in (which needs a response).
+        if (nextDue > deadline) {
+            nextDue = deadline;
+        }
+
+        auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>
+            (nextDue - now).count();
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += (ts.tv_nsec + wait) / 1000000000L;
+        ts.tv_nsec  = (ts.tv_nsec + wait) % 1000000000L;
+        pthread_cond_timedwait(&sim_cond, &sim_lock, &ts);
+    }
+
+    if (!isOpen) {
+        // Closed (or unplugged) while we were waiting
+        count = ERROR;
+    }
+
+    pthread_mutex_unlock(&sim_lock);
+
+    return count;
+}
@@ -24,6 +24,11 @@
 // SOFTWARE.
 //
 
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "antplus.h"
@@ -31,21 +36,101 @@
 #include "antdefs.h"
 #include "antdebug.h"
 
-ANTUSBInterface::ANTUSBInterface(void) {
+static bool isANTDevice(const libusb_device_descriptor &desc) {
+    return desc.idVendor == GARMIN_USB2_VID &&
+        (desc.idProduct == GARMIN_USB2_PID
+         || desc.idProduct == GARMIN_OEM_PID);
+}
+
+int ANTUSBInterface::countDevices(void) {
+    libusb_context *ctx;
+    libusb_device **list;
+    libusb_device_descriptor desc;
+
+    if (libusb_init(&ctx)) {
+        return 0;
+    }
+
+    int count = 0;
+    ssize_t listCount = libusb_get_device_list(ctx, &list);
+    for (int i = 0; i < listCount; i++) {
+        if (!libusb_get_device_descriptor(list[i], &desc)
+                && isANTDevice(desc)) {
+            count++;
+        }
+    }
+
+    if (listCount >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(ctx);
+
+    return count;
+}
+
+ANTUSBInterface::ANTUSBInterface(int index) {
+    deviceIndex   = index;
     usb_ctx       = NULL;
     usb_handle    = NULL;
     usb_config    = NULL;
     readEndpoint  = -1;
     writeEndpoint = -1;
+    writePacketSize = ANTPLUS_USB_PACKET_SIZE;
     writeTimeout  = 256;
     readTimeout   = 256;
+
+    readTransfers   = 0;
+    activeTransfers = 0;
+    transferBytes   = 0;
+
+    hotplug       = false;
+    hotplugHandle = 0;
+    deviceLost    = false;
+    deviceArrived = false;
+
+    pthread_mutex_init(&transfer_lock, NULL);
+    pthread_mutex_init(&write_lock, NULL);
 }
 
 ANTUSBInterface::~ANTUSBInterface(void) {
     close();
+    pthread_mutex_destroy(&write_lock);
+    pthread_mutex_destroy(&transfer_lock);
 }
 
 int ANTUSBInterface::open(void) {
+    // The context (and hotplug callback) outlives the device
+    // handle, so that we can wait for the stick to come back.
+    if (usb_ctx == NULL) {
+        DEBUG_COMMENT("initializing USB\n");
+        int rc = libusb_init(&usb_ctx);
+        if (rc) {
+            DEBUG_PRINT("Error initializing libusb. rc = %d\n", rc);
+            usb_ctx = NULL;
+            return ERROR;
+        }
+
+        libusb_set_option(usb_ctx, LIBUSB_OPTION_LOG_LEVEL,
+                LIBUSB_LOG_LEVEL_NONE);
+
+        hotplug = false;
+        if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+            rc = libusb_hotplug_register_callback(usb_ctx,
+                    (libusb_hotplug_event)
+                    (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+                     | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                    (libusb_hotplug_flag)0, GARMIN_USB2_VID,
+                    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                    callHotplugCallback, (void *)this, &hotplugHandle);
+            hotplug = (rc == LIBUSB_SUCCESS);
+        }
+        DEBUG_PRINT("Hotplug %s\n", hotplug ? "enabled" : "not available");
+    }
+
+    return openDevice();
+}
+
+int ANTUSBInterface::openDevice(void) {
     ssize_t listCount;
     bool found;
     libusb_device **list;
@@ -53,27 +138,30 @@ int ANTUSBInterface::open(void) {
     libusb_device *dev;
     libusb_device_handle *handle;
 
-    DEBUG_COMMENT("initializing USB\n");
-    int rc = libusb_init(&usb_ctx);
-    if (rc) {
-        DEBUG_PRINT("Error initializing libusb. rc = %d\n", rc);
-        return ERROR;
-    }
+    deviceLost = false;
+    readEndpoint = -1;
+    writeEndpoint = -1;
 
-    libusb_set_option(usb_ctx, LIBUSB_OPTION_LOG_LEVEL,
-            LIBUSB_LOG_LEVEL_NONE);
+    // This is called over and over while waiting for the stick to
+    // come back, so every error path must free what it got.
 
-    // First go through list and reset the device
+    // First go through list and reset the device. With more
+    // than one stick attached we take the deviceIndex'th one.
     listCount = libusb_get_device_list(usb_ctx, &list);
+    if (listCount < 0) {
+        DEBUG_PRINT("Unable to get device list (rc = %d)\n",
+                (int)listCount);
+        return ERROR;
+    }
+
     found = false;
+    int match = 0;
     for (int i = 0; i < listCount; i++) {
         dev = list[i];
         int rc = libusb_get_device_descriptor(dev, &desc);
         if (!rc) {
             // We got a valid descriptor.
-            if (desc.idVendor == GARMIN_USB2_VID &&
-                    (desc.idProduct == GARMIN_USB2_PID
-                     || desc.idProduct == GARMIN_OEM_PID)) {
+            if (isANTDevice(desc) && (match++ == deviceIndex)) {
                 if (!libusb_open(dev, &handle)) {
                     DEBUG_PRINT("Found Device ... 0x%04X 0x%04X\n",
                             desc.idVendor, desc.idProduct);
@@ -97,29 +185,35 @@ int ANTUSBInterface::open(void) {
     // Now lets search again and open the device
 
     listCount = libusb_get_device_list(usb_ctx, &list);
+    if (listCount < 0) {
+        DEBUG_PRINT("Unable to get device list (rc = %d)\n",
+                (int)listCount);
+        return ERROR;
+    }
+
     found = false;
+    match = 0;
     for (int i = 0; i < listCount; i++) {
         dev = list[i];
         if (!libusb_get_device_descriptor(dev, &desc)) {
             // We got a valid descriptor.
-            if (desc.idVendor == GARMIN_USB2_VID &&
-                    (desc.idProduct == GARMIN_USB2_PID
-                     || desc.idProduct == GARMIN_OEM_PID)) {
+            if (isANTDevice(desc) && (match++ == deviceIndex)) {
                 DEBUG_PRINT("Found Device ... 0x%04X 0x%04X\n",
                         desc.idVendor, desc.idProduct);
                 if (libusb_open(dev, &handle)) {
                     DEBUG_PRINT("Failed to open device 0x%04X 0x%04X\n",
                             desc.idVendor, desc.idProduct);
-                    libusb_free_device_list(list, 1);
-                    return ERROR;
                 } else {
                     found = true;
-                    break;
                 }
+                break;
             }
         }
     }
 
+    // The open handle holds its own reference to the device
+    libusb_free_device_list(list, 1);
+
     if (!found) {
         // We never found the device
         DEBUG_COMMENT("Failed to find USB Device (OPEN)\n");
@@ -130,36 +224,35 @@ int ANTUSBInterface::open(void) {
             desc.bNumConfigurations);
     if (!desc.bNumConfigurations) {
         DEBUG_COMMENT("No valid configurations\n");
+        libusb_close(handle);
         return ERROR;
     }
 
     libusb_config_descriptor *config;
     if (libusb_get_config_descriptor(dev, 0, &config)) {
         DEBUG_COMMENT("Unable to get usb config\n");
-        libusb_free_config_descriptor(config);
+        libusb_close(handle);
         return ERROR;
     }
 
     DEBUG_PRINT("Number of Interfaces : %d\n",
             config->bNumInterfaces);
 
+    const char *invalid = NULL;
     if (config->bNumInterfaces != 1) {
-        DEBUG_COMMENT("Invalid number of interfaces.\n");
-        libusb_free_config_descriptor(config);
-        return ERROR;
-    }
-
-    if (config->interface[0].num_altsetting != 1) {
-        DEBUG_COMMENT("Invalid number of alt settings.\n");
-        libusb_free_config_descriptor(config);
-        return ERROR;
+        invalid = "Invalid number of interfaces.\n";
+    } else if (config->interface[0].num_altsetting != 1) {
+        invalid = "Invalid number of alt settings.\n";
+    } else if (config->interface[0].altsetting[0].bNumEndpoints != 2) {
+        DEBUG_PRINT("bNumEndpoints = %d\n",
+                config->interface[0].altsetting[0].bNumEndpoints);
+        invalid = "Invalid Number of endpoints.\n";
     }
 
-    DEBUG_PRINT("bNumEndpoints = %d\n",
-            config->interface[0].altsetting[0].bNumEndpoints);
-    if (config->interface[0].altsetting[0].bNumEndpoints != 2) {
-        DEBUG_COMMENT("Invalid Number of endpoints.\n");
+    if (invalid != NULL) {
+        DEBUG_PRINT("%s", invalid);
         libusb_free_config_descriptor(config);
+        libusb_close(handle);
         return ERROR;
     }
 
@@ -175,6 +268,22 @@ int ANTUSBInterface::open(void) {
         }
     }
 
+    if ((readEndpoint < 0) || (writeEndpoint < 0)) {
+        DEBUG_COMMENT("Did not find valid device.\n");
+        libusb_free_config_descriptor(config);
+        libusb_close(handle);
+        return ERROR;
+    }
+
+    // Batched writes are split on packet boundaries
+    int size = libusb_get_max_packet_size(dev, writeEndpoint);
+    if (size > 0) {
+        writePacketSize = size;
+    } else {
+        writePacketSize = ANTPLUS_USB_PACKET_SIZE;
+    }
+    DEBUG_PRINT("Write packet size = %d\n", writePacketSize);
+
     // Now we need to close the kernel driver
     // and claim the interface for ourselves
 
@@ -183,38 +292,124 @@ int ANTUSBInterface::open(void) {
     if (libusb_claim_interface(handle,
                 config->interface[0].altsetting[0].bInterfaceNumber)) {
         DEBUG_COMMENT("Unable to claim interface.\n");
+        libusb_free_config_descriptor(config);
+        libusb_close(handle);
         return ERROR;
     }
 
+    pthread_mutex_lock(&write_lock);
     usb_config = config;
     usb_handle = handle;
+    pthread_mutex_unlock(&write_lock);
 
-    libusb_free_device_list(list, 1);
+    return NOERROR;
+}
 
-    if ((readEndpoint < 0) || (writeEndpoint < 0)) {
-        DEBUG_COMMENT("Did not find valid device.\n");
-        return ERROR;
+int ANTUSBInterface::close(void) {
+    closeDevice();
+
+    if (usb_ctx != NULL) {
+        if (hotplug) {
+            libusb_hotplug_deregister_callback(usb_ctx, hotplugHandle);
+            hotplug = false;
+        }
+        libusb_exit(usb_ctx);
+        usb_ctx = NULL;
     }
 
     return NOERROR;
 }
 
-int ANTUSBInterface::close(void) {
+int ANTUSBInterface::closeDevice(void) {
+    stopTransfers();
+
+    // Writers may be on other threads
+    pthread_mutex_lock(&write_lock);
+
     if (usb_config != NULL) {
         libusb_free_config_descriptor(usb_config);
+        usb_config = NULL;
     }
 
     if (usb_handle != NULL) {
         libusb_close(usb_handle);
+        usb_handle = NULL;
     }
 
-    if (usb_ctx != NULL) {
-        libusb_exit(usb_ctx);
-    }
+    pthread_mutex_unlock(&write_lock);
+
+    reassembler.reset();
 
     return NOERROR;
 }
 
+int ANTUSBInterface::reopen(int timeout) {
+    closeDevice();
+
+    if (usb_ctx == NULL) {
+        return open();
+    }
+
+    // The stick may already be back (e.g. after a reset),
+    // if not wait for it to be plugged in.
+    deviceArrived = false;
+    if (!openDevice()) {
+        return NOERROR;
+    }
+
+    ant_time_point deadline = ant_clock::now()
+        + std::chrono::milliseconds(timeout);
+
+    if (!hotplug) {
+        // No arrival events, look for the stick every so often
+        // until it is back or the time is up
+        while (openDevice()) {
+            auto left = std::chrono::duration_cast<std::chrono::microseconds>
+                (deadline - ant_clock::now()).count();
+            if (left <= 0) {
+                DEBUG_COMMENT("USB stick did not come back\n");
+                return ERROR;
+            }
+            usleep(std::min<int64_t>(left, ANTPLUS_SLEEP_DURATION));
+        }
+        return NOERROR;
+    }
+
+    while (!deviceArrived) {
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>
+            (deadline - ant_clock::now()).count();
+        if (left <= 0) {
+            DEBUG_COMMENT("USB stick did not come back\n");
+            return ERROR;
+        }
+
+        struct timeval tv;
+        tv.tv_sec  = left / 1000000L;
+        tv.tv_usec = left % 1000000L;
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+
+    DEBUG_COMMENT("USB stick arrived\n");
+
+    return openDevice();
+}
+
+void ANTUSBInterface::hotplugCallback(libusb_device *dev,
+        libusb_hotplug_event event) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) || !isANTDevice(desc)) {
+        return;
+    }
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        deviceArrived = true;
+    } else if ((usb_handle != NULL)
+            && (dev == libusb_get_device(usb_handle))) {
+        DEBUG_COMMENT("USB stick removed\n");
+        deviceLost = true;
+    }
+}
+
 int ANTUSBInterface::bulkRead(uint8_t *bytes, int size, int timeout) {
     int actualSize;
     int rc = libusb_bulk_transfer(usb_handle, readEndpoint,
@@ -231,6 +426,9 @@ int ANTUSBInterface::bulkRead(uint8_t *bytes, int size, int timeout) {
 
     if (rc < 0 && rc != LIBUSB_ERROR_TIMEOUT) {
         DEBUG_PRINT("libusb_bulk_transfer failed with rc=%d\n", rc);
+        if (rc == LIBUSB_ERROR_NO_DEVICE) {
+            deviceLost = true;
+        }
         return rc;
     }
 
@@ -244,6 +442,9 @@ int ANTUSBInterface::bulkWrite(uint8_t *bytes, int size, int timeout) {
 
     if (rc < 0) {
         DEBUG_PRINT("libusb_bulk_transfer failed with rc=%d\n", rc);
+        if (rc == LIBUSB_ERROR_NO_DEVICE) {
+            deviceLost = true;
+        }
         return rc;
     }
 
@@ -262,29 +463,325 @@ int ANTUSBInterface::sendMessage(ANTMessage *message) {
 
     message->encode(msg, &msg_len);
 
-    return bulkWrite(msg, msg_len, writeTimeout);
+    if (capture != nullptr) {
+        capture->record(ANTCapture::DIR_WRITE, msg, msg_len,
+                ant_clock::now());
+    }
+
+    pthread_mutex_lock(&write_lock);
+    int rc = ERROR;
+    if ((usb_handle != NULL) && !deviceLost) {
+        rc = bulkWrite(msg, msg_len, writeTimeout);
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    return rc;
+}
+
+int ANTUSBInterface::sendMessages(ANTMessage *messages, int n) {
+    // Pack as many whole frames as fit into each bulk write. Frames
+    // are never split across packets and are written in order.
+    int size = writePacketSize;
+    std::vector<uint8_t> buffer(size + ANTPLUS_MAX_MESSAGE_SIZE);
+
+    pthread_mutex_lock(&write_lock);
+
+    int total = 0;
+    int len = 0;
+    int rc = NOERROR;
+    for (int i = 0; i < n; i++) {
+        int msg_len;
+        uint8_t msg[ANTPLUS_MAX_MESSAGE_SIZE];
+        messages[i].encode(msg, &msg_len);
+
+        if ((len > 0) && ((len + msg_len) > size)) {
+            rc = ERROR;
+            if ((usb_handle != NULL) && !deviceLost) {
+                rc = bulkWrite(buffer.data(), len, writeTimeout);
+            }
+            if (rc < 0) {
+                break;
+            }
+            total += rc;
+            len = 0;
+        }
+
+        if (capture != nullptr) {
+            capture->record(ANTCapture::DIR_WRITE, msg, msg_len,
+                    ant_clock::now());
+        }
+
+        memcpy(buffer.data() + len, msg, msg_len);
+        len += msg_len;
+    }
+
+    if ((rc >= 0) && (len > 0)) {
+        rc = ERROR;
+        if ((usb_handle != NULL) && !deviceLost) {
+            rc = bulkWrite(buffer.data(), len, writeTimeout);
+        }
+        if (rc >= 0) {
+            total += rc;
+        }
+    }
+
+    pthread_mutex_unlock(&write_lock);
+
+    if (rc < 0) {
+        return rc;
+    }
+
+    return total;
 }
 
 int ANTUSBInterface::readMessage(std::vector<ANTMessage> *message) {
+    if ((usb_handle == NULL) || deviceLost) {
+        return ERROR;
+    }
+
+    if (readTransfers > 0) {
+        return asyncRead(message);
+    }
+
+    // A libusb timeout of zero waits forever, so the
+    // shortest wait we can do synchronously is 1 ms.
     uint8_t bytes[ANTPLUS_MAX_MESSAGE_SIZE];
-    int nbytes = bulkRead(bytes, ANTPLUS_MAX_MESSAGE_SIZE, readTimeout);
+    int nbytes = bulkRead(bytes, ANTPLUS_MAX_MESSAGE_SIZE,
+            readTimeout > 0 ? readTimeout : 1);
 
     if (nbytes > 0) {
         DEBUG_PRINT("Recieved %d bytes.\n", nbytes);
-        // Now we walk the data looking for sync bytes
-        int i = 0;
-        while (i < nbytes) {
-            // Search for sync
-            if (bytes[i] == ANT_SYNC_BYTE) {
-                // We have a message, second byte is length
-                uint8_t len = bytes[i+1] + 4;
-                message->push_back(ANTMessage(&bytes[i], len));
-                message->back().setTimestamp();
-                i += len;
+        processBytes(bytes, nbytes, message);
+    }
+
+    return nbytes;
+}
+
+int ANTUSBInterface::startTransfers(void) {
+    // Allocate the ring of read transfers and put every transfer
+    // which is not in flight (all of them the first time round,
+    // after that any which failed) back in flight. Completions are
+    // resubmitted from the callback so the endpoint always has a
+    // read pending.
+
+    if (transfers.size() != (size_t)readTransfers) {
+        // We can not free transfers in flight
+        if (stopTransfers()) {
+            return ERROR;
+        }
+        for (auto t : transfers) {
+            libusb_free_transfer(t);
+        }
+        transfers.clear();
+
+        transferBuffer.resize(readTransfers * ANTPLUS_MAX_MESSAGE_SIZE);
+        for (int i = 0; i < readTransfers; i++) {
+            libusb_transfer *t = libusb_alloc_transfer(0);
+            if (t == NULL) {
+                DEBUG_COMMENT("Unable to allocate transfer\n");
+                return ERROR;
+            }
+            libusb_fill_bulk_transfer(t, usb_handle, readEndpoint,
+                    &transferBuffer[i * ANTPLUS_MAX_MESSAGE_SIZE],
+                    ANTPLUS_MAX_MESSAGE_SIZE, callTransferCallback,
+                    (void *)this, 0);
+            transfers.push_back(t);
+        }
+
+        pthread_mutex_lock(&transfer_lock);
+        idleTransfers = transfers;
+        pthread_mutex_unlock(&transfer_lock);
+    }
+
+    std::vector<libusb_transfer*> idle;
+    pthread_mutex_lock(&transfer_lock);
+    idle.swap(idleTransfers);
+    pthread_mutex_unlock(&transfer_lock);
+
+    for (size_t i = 0; i < idle.size(); i++) {
+        libusb_transfer *t = idle[i];
+        t->dev_handle = usb_handle;
+
+        // Count it first, it can complete before submit returns
+        activeTransfers++;
+        int rc = libusb_submit_transfer(t);
+        if (rc < 0) {
+            activeTransfers--;
+            DEBUG_PRINT("libusb_submit_transfer failed with rc=%d\n", rc);
+            if (rc == LIBUSB_ERROR_NO_DEVICE) {
+                deviceLost = true;
+            }
+
+            // Try these again on the next read
+            pthread_mutex_lock(&transfer_lock);
+            idleTransfers.insert(idleTransfers.end(),
+                    idle.begin() + i, idle.end());
+            pthread_mutex_unlock(&transfer_lock);
+            return ERROR;
+        }
+    }
+
+    if (idle.size()) {
+        DEBUG_PRINT("%d read transfers in flight\n",
+                activeTransfers.load());
+    }
+
+    return NOERROR;
+}
+
+int ANTUSBInterface::stopTransfers(void) {
+    if (!transfers.size()) {
+        return NOERROR;
+    }
+
+    for (auto t : transfers) {
+        libusb_cancel_transfer(t);
+    }
+
+    // Run the event loop until all cancellations have
+    // been delivered, we can not free transfers in flight.
+    int tries = 100;
+    while (activeTransfers > 0 && tries--) {
+        struct timeval tv = { 0, 10000 };
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+
+    if (activeTransfers > 0) {
+        DEBUG_PRINT("%d transfers did not cancel\n",
+                activeTransfers.load());
+        return ERROR;
+    }
+
+    for (auto t : transfers) {
+        libusb_free_transfer(t);
+    }
+    transfers.clear();
+
+    pthread_mutex_lock(&transfer_lock);
+    idleTransfers.clear();
+    transferQueue.clear();
+    pthread_mutex_unlock(&transfer_lock);
+
+    return NOERROR;
+}
+
+void ANTUSBInterface::transferCallback(libusb_transfer *transfer) {
+    // Callbacks are run from whichever thread is handling libusb
+    // events (this can be a writer in libusb_bulk_transfer) so the
+    // queue is protected by the transfer lock.
+
+    pthread_mutex_lock(&transfer_lock);
+
+    bool resubmit = false;
+    switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            if (transfer->actual_length > 0) {
+                processBytes(transfer->buffer, transfer->actual_length,
+                        &transferQueue);
+                transferBytes += transfer->actual_length;
             }
+            resubmit = true;
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            resubmit = true;
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            DEBUG_COMMENT("Transfer failed, no device\n");
+            deviceLost = true;
+            break;
+        default:
+            // Leave it for the next read to resubmit, rather than
+            // spin here if the endpoint keeps failing.
+            DEBUG_PRINT("Transfer failed with status=%d\n",
+                    transfer->status);
+            idleTransfers.push_back(transfer);
+            break;
+    }
+
+    if (resubmit) {
+        int rc = libusb_submit_transfer(transfer);
+        if (rc == 0) {
+            pthread_mutex_unlock(&transfer_lock);
+            return;
+        }
+        DEBUG_PRINT("libusb_submit_transfer failed with rc=%d\n", rc);
+        if (rc == LIBUSB_ERROR_NO_DEVICE) {
+            deviceLost = true;
+        } else {
+            idleTransfers.push_back(transfer);
         }
     }
 
+    activeTransfers--;
+    pthread_mutex_unlock(&transfer_lock);
+}
+
+int ANTUSBInterface::asyncRead(std::vector<ANTMessage> *message) {
+    // Put back any transfers which failed, so the ring keeps its
+    // size. We can carry on reading while some are still in flight.
+    if (startTransfers() && (activeTransfers == 0)) {
+        return ERROR;
+    }
+
+    struct timeval tv;
+    tv.tv_sec  = readTimeout / 1000;
+    tv.tv_usec = (readTimeout % 1000) * 1000;
+
+    int rc = libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+        DEBUG_PRINT("libusb_handle_events failed with rc=%d\n", rc);
+        if (rc == LIBUSB_ERROR_NO_DEVICE) {
+            deviceLost = true;
+        }
+        return rc;
+    }
+
+    pthread_mutex_lock(&transfer_lock);
+    int nbytes = transferBytes;
+    transferBytes = 0;
+    for (ANTMessage& m : transferQueue) {
+        message->push_back(m);
+    }
+    transferQueue.clear();
+    pthread_mutex_unlock(&transfer_lock);
+
     return nbytes;
 }
 
+int ANTUSBInterface::getPollFds(std::vector<struct pollfd> *fds) {
+    // Only the asynchronous path can be driven from an external
+    // loop, the synchronous one blocks inside libusb.
+    if (readTransfers <= 0) {
+        DEBUG_COMMENT("Poll fds need asynchronous reads enabled\n");
+        return ERROR;
+    }
+
+    if (usb_ctx == NULL) {
+        return ERROR;
+    }
+
+    if (startTransfers() && (activeTransfers == 0)) {
+        return ERROR;
+    }
+
+    const libusb_pollfd **list = libusb_get_pollfds(usb_ctx);
+    if (list == NULL) {
+        DEBUG_COMMENT("libusb_get_pollfds failed\n");
+        return ERROR;
+    }
+
+    fds->clear();
+    for (int i = 0; list[i] != NULL; i++) {
+        struct pollfd p;
+        p.fd      = list[i]->fd;
+        p.events  = list[i]->events;
+        p.revents = 0;
+        fds->push_back(p);
+    }
+
+    libusb_free_pollfds(list);
+
+    return NOERROR;
+}
@@ -0,0 +1,113 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <sched.h>
+
+#include <memory>
+
+#include "antplus.h"
+#include "antworkerpool.h"
+#include "antdebug.h"
+
+ANTWorkerPool::ANTWorkerPool(int nWorkers) {
+    if (nWorkers < 1) {
+        nWorkers = 1;
+    }
+
+    threadRun = true;
+
+    for (int i = 0; i < nWorkers; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        Worker *w = workers.back().get();
+        w->pool = this;
+
+        DEBUG_PRINT("Starting worker thread %d ...\n", i);
+        pthread_create(&w->threadId, NULL, callThread, (void *)w);
+    }
+}
+
+ANTWorkerPool::~ANTWorkerPool(void) {
+    stop();
+}
+
+int ANTWorkerPool::stop(void) {
+    if (!threadRun) {
+        return NOERROR;
+    }
+
+    DEBUG_COMMENT("Stopping worker threads.....\n");
+    threadRun = false;
+
+    for (auto& w : workers) {
+        w->queue.notify();
+    }
+
+    for (auto& w : workers) {
+        pthread_join(w->threadId, NULL);
+    }
+
+    DEBUG_COMMENT("Worker threads joined.\n");
+
+    return NOERROR;
+}
+
+int ANTWorkerPool::submit(ANTChannel *channel, ANTMessage *message) {
+    // Shard on the channel number so that a channel
+    // is always handled by the same worker.
+    Worker *w = workers[channel->getChannelNum() % workers.size()].get();
+
+    Task task;
+    task.channel = channel;
+    task.message = *message;
+
+    // Wait for the worker to catch up rather than drop
+    while (w->queue.full() && threadRun) {
+        sched_yield();
+    }
+
+    if (!w->queue.push(task)) {
+        return ERROR;
+    }
+
+    return NOERROR;
+}
+
+void* ANTWorkerPool::thread(Worker *w) {
+    DEBUG_COMMENT("Worker thread started.....\n");
+
+    Task batch[ANTPLUS_QUEUE_BATCH];
+
+    while (threadRun) {
+        size_t n = w->queue.wait(batch, ANTPLUS_QUEUE_BATCH,
+                ANTPLUS_SLEEP_DURATION);
+        for (size_t i = 0; i < n; i++) {
+            batch[i].channel->dispatchMessage(&batch[i].message);
+        }
+    }
+
+    return NULL;
+}
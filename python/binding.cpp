@@ -29,6 +29,7 @@
 #include <pybind11/stl.h>
 #include <pybind11/chrono.h>
 #include <pybind11/stl_bind.h>
+#include <pybind11/functional.h>
 #include <vector>
 #include <memory>
 
@@ -40,6 +41,7 @@ namespace py = pybind11;
 using pybind11::literals::operator""_a;
 
 PYBIND11_MAKE_OPAQUE(std::vector<float>)
+PYBIND11_MAKE_OPAQUE(std::vector<int64_t>)
 PYBIND11_MAKE_OPAQUE(ANTTsData)
 PYBIND11_MAKE_OPAQUE(ANTMetaData)
 
@@ -50,29 +52,142 @@ PYBIND11_MODULE(_pyantplus, m) {
 
     py::bind_vector<std::vector<float>>(m, "VectorFloat",
         py::buffer_protocol());
+    py::bind_vector<std::vector<int64_t>>(m, "VectorInt64",
+        py::buffer_protocol());
     py::bind_map<ANTTsData>(m, "TimeSeriesMap",
         py::buffer_protocol());
     py::bind_map<ANTMetaData>(m, "MetaDataMap",
         py::buffer_protocol());
 
-    py::class_<ANTUSBInterface,
+    py::class_<ANTInterface, shared_ptr<ANTInterface>>(m, "ANTInterface")
+        .def("isDeviceLost", &ANTInterface::isDeviceLost);
+
+    py::class_<ANTUSBInterface, ANTInterface,
         shared_ptr<ANTUSBInterface>>(m, "ANTUSBInterface")
-        .def(py::init())
+        .def(py::init<int>(), "index"_a = 0)
+        .def_static("countDevices", &ANTUSBInterface::countDevices)
         .def("open", &ANTUSBInterface::open)
-        .def("close", &ANTUSBInterface::close);
+        .def("close", &ANTUSBInterface::close)
+        .def("setReadTransfers", &ANTUSBInterface::setReadTransfers)
+        .def("getReadTransfers", &ANTUSBInterface::getReadTransfers)
+        .def("setReadTimeout", &ANTUSBInterface::setReadTimeout)
+        .def("setCapture", &ANTUSBInterface::setCapture);
+
+    py::class_<ANTSerialInterface, ANTInterface,
+        shared_ptr<ANTSerialInterface>>(m, "ANTSerialInterface")
+        .def(py::init<std::string, int>(), "device"_a, "baud"_a = 57600)
+        .def("open", &ANTSerialInterface::open)
+        .def("close", &ANTSerialInterface::close)
+        .def("setBaudRate", &ANTSerialInterface::setBaudRate)
+        .def("getBaudRate", &ANTSerialInterface::getBaudRate)
+        .def("setFlowControl", &ANTSerialInterface::setFlowControl)
+        .def("setReadTimeout", &ANTSerialInterface::setReadTimeout)
+        .def("setCapture", &ANTSerialInterface::setCapture);
+
+    py::class_<ANTCapture, shared_ptr<ANTCapture>>(m, "ANTCapture")
+        .def(py::init<std::string>())
+        .def("isOpen", &ANTCapture::isOpen)
+        .def("flush", &ANTCapture::flush);
+
+    py::class_<ANTReplayInterface, ANTInterface,
+        shared_ptr<ANTReplayInterface>>(m, "ANTReplayInterface")
+        .def(py::init<std::string>())
+        .def("open", &ANTReplayInterface::open)
+        .def("close", &ANTReplayInterface::close)
+        .def("setSpeed", &ANTReplayInterface::setSpeed)
+        .def("getSpeed", &ANTReplayInterface::getSpeed)
+        .def("setReadTimeout", &ANTReplayInterface::setReadTimeout)
+        .def("isDone", &ANTReplayInterface::isDone)
+        .def("getFrames", &ANTReplayInterface::getFrames);
+
+    py::class_<ANTSimInterface, ANTInterface,
+        shared_ptr<ANTSimInterface>>(m, "ANTSimInterface")
+        .def(py::init())
+        .def("open", &ANTSimInterface::open)
+        .def("close", &ANTSimInterface::close)
+        .def("addDevice", &ANTSimInterface::addDevice,
+            "type"_a, "id"_a, "transType"_a = 0x01)
+        .def("addDevices", &ANTSimInterface::addDevices,
+            "type"_a, "n"_a, "firstID"_a = 1)
+        .def("setRate", &ANTSimInterface::setRate)
+        .def("setLoss", &ANTSimInterface::setLoss)
+        .def("setJitter", &ANTSimInterface::setJitter)
+        .def("setSeed", &ANTSimInterface::setSeed)
+        .def("setRSSI", &ANTSimInterface::setRSSI)
+        .def("setConnected", &ANTSimInterface::setConnected)
+        .def("setReadTimeout", &ANTSimInterface::setReadTimeout)
+        .def("getSent", &ANTSimInterface::getSent)
+        .def("getLost", &ANTSimInterface::getLost);
 
-    py::class_<ANT>(m, "ANT")
-        .def(py::init<shared_ptr<ANTUSBInterface>>())
-        .def("init", &ANT::init)
-        .def("getChannel", &ANT::getChannel)
-        .def("getChannels", &ANT::getChannels);
+    py::class_<ANT> ant(m, "ANT");
+        ant.def(py::init<shared_ptr<ANTInterface>, int, int, int>(),
+            "iface"_a, "nChannels"_a = 8, "nWorkers"_a = 1,
+            "mode"_a = (int)ANT::MODE_THREADED);
+        ant.def("init", &ANT::init);
+        ant.def("getChannel", &ANT::getChannel);
+        ant.def("getChannels", &ANT::getChannels);
+        ant.def("getMode", &ANT::getMode);
+        ant.def("getLoad", &ANT::getLoad);
+        ant.def("reconnect", &ANT::reconnect,
+            py::call_guard<py::gil_scoped_release>(),
+            "timeout"_a = ANTPLUS_RECONNECT_TIMEOUT);
+        ant.def("runOnce", &ANT::runOnce,
+            py::call_guard<py::gil_scoped_release>(), "timeout"_a = 0);
+        ant.def("getPollFds", [](ANT &a) {
+            // Returned as (fd, events) pairs
+            std::vector<struct pollfd> fds;
+            std::vector<std::pair<int, int>> rtn;
+            if (!a.getPollFds(&fds)) {
+                for (auto& p : fds) {
+                    rtn.push_back(std::make_pair(p.fd, (int)p.events));
+                }
+            }
+            return rtn;
+        });
+
+    py::enum_<ANT::MODE>(ant, "MODE")
+        .value("THREADED", ANT::MODE_THREADED)
+        .value("EVENT_LOOP", ANT::MODE_EVENT_LOOP)
+        .export_values();
+
+    py::class_<ANTAggregator>(m, "ANTAggregator")
+        .def(py::init<int, int>(), "nWorkers"_a = 1,
+            "mode"_a = (int)ANT::MODE_THREADED)
+        .def("addInterface", &ANTAggregator::addInterface,
+            "iface"_a, "nChannels"_a = 8)
+        .def("addUSBInterfaces", &ANTAggregator::addUSBInterfaces,
+            "nChannels"_a = 8)
+        .def("init", &ANTAggregator::init)
+        .def("runOnce", &ANTAggregator::runOnce,
+            py::call_guard<py::gil_scoped_release>(), "timeout"_a = 0)
+        .def("openChannel", &ANTAggregator::openChannel,
+            py::call_guard<py::gil_scoped_release>(),
+            "type"_a, "id"_a = 0x0000, "wait"_a = 1)
+        .def("getChannel", &ANTAggregator::getChannel)
+        .def("getChannels", &ANTAggregator::getChannels)
+        .def("getNumChannels", &ANTAggregator::getNumChannels)
+        .def("getNumInterfaces", &ANTAggregator::getNumInterfaces)
+        .def("setDedupWindow", &ANTAggregator::setDedupWindow)
+        .def("getDedupWindow", &ANTAggregator::getDedupWindow)
+        .def("getDeviceList", &ANTAggregator::getDeviceList);
 
     py::class_<ANTChannel, shared_ptr<ANTChannel>>
         antchannel(m, "ANTChannel");
         antchannel.def("open", &ANTChannel::open,
+            py::call_guard<py::gil_scoped_release>(),
             "type"_a, "id"_a = 0x0000, "wait"_a = 1);
+        antchannel.def("openAsync", [](ANTChannel &c, int type, uint16_t id,
+                ANTChannel::OpenCallback callback) {
+            // The callback is run from the listener thread
+            c.openAsync(type, id, callback);
+        }, "type"_a, "id"_a = 0x0000, "callback"_a = nullptr);
         antchannel.def("close", &ANTChannel::close);
         antchannel.def("getDeviceList", &ANTChannel::getDeviceList);
+        antchannel.def("getState", &ANTChannel::getState);
+        antchannel.def("setPipelined", &ANTChannel::setPipelined);
+        antchannel.def("getPipelined", &ANTChannel::getPipelined);
+        antchannel.def("setRetention", &ANTChannel::setRetention,
+            "maxSamples"_a, "window"_a = 0, "sink"_a = nullptr);
 
     py::enum_<ANTChannel::TYPE>(m, "TYPE")
         .value("NONE", ANTChannel::TYPE_NONE)
@@ -81,23 +196,70 @@ PYBIND11_MODULE(_pyantplus, m) {
         .value("PWR", ANTChannel::TYPE_PWR)
         .value("FEC", ANTChannel::TYPE_FEC);
 
+    py::enum_<ANTDevice::STORE>(m, "STORE")
+        .value("ALWAYS", ANTDevice::STORE_ALWAYS)
+        .value("ON_CHANGE", ANTDevice::STORE_ON_CHANGE)
+        .value("HEARTBEAT", ANTDevice::STORE_HEARTBEAT);
+
     py::class_<ANTDevice, shared_ptr<ANTDevice>>(m, "ANTDevice")
         .def(py::init<>())
         .def("getDeviceID", &ANTDevice::getDeviceID)
         .def("getDeviceName", &ANTDevice::getDeviceName)
-        .def("getTsData", &ANTDevice::getTsData)
+        .def("getTsData", py::overload_cast<>(&ANTDevice::getTsData))
+        .def("getTsData", py::overload_cast<int>(&ANTDevice::getTsData))
+        .def("getNumFields", &ANTDevice::getNumFields)
+        .def("getFieldName", &ANTDevice::getFieldName)
+        .def("setDedupWindow", &ANTDevice::setDedupWindow)
+        .def("getDuplicates", &ANTDevice::getDuplicates)
+        .def("getPreferredReceiver", &ANTDevice::getPreferredReceiver)
+        .def("getRSSI", &ANTDevice::getRSSI)
+        .def("setRetention", &ANTDevice::setRetention,
+            "maxSamples"_a, "window"_a = 0, "sink"_a = nullptr)
+        .def("setStorePolicy", &ANTDevice::setStorePolicy,
+            "Set when a field's samples are stored (see STORE).\n\n"
+            "Fields are STORE.ALWAYS by default, except the power meter\n"
+            "battery and parameter fields and the FE-C settings and\n"
+            "status. These are STORE.HEARTBEAT, so a repeated value is\n"
+            "only stored again once the heartbeat (ms) has passed. Set\n"
+            "STORE.ALWAYS to keep every sample.",
+            "field"_a, "policy"_a,
+            "heartbeat"_a = ANTPLUS_STORE_HEARTBEAT)
         // .def("getData", &ANTDevice::getData)
         .def("getMetaData", &ANTDevice::getMetaData);
 
+    py::class_<ANTDevicePWR, ANTDevice, shared_ptr<ANTDevicePWR>>(m,
+            "ANTDevicePWR")
+        .def("getPower3s", &ANTDevicePWR::getPower3s)
+        .def("getPower30s", &ANTDevicePWR::getPower30s)
+        .def("getNormalizedPower", &ANTDevicePWR::getNormalizedPower)
+        .def("setWheelCircumference", &ANTDevicePWR::setWheelCircumference)
+        .def("getWheelCircumference", &ANTDevicePWR::getWheelCircumference);
+
+    py::class_<ANTDeviceHR, ANTDevice, shared_ptr<ANTDeviceHR>>(m,
+            "ANTDeviceHR")
+        .def("setHrvWindow", &ANTDeviceHR::setHrvWindow)
+        .def("getRMSSD", &ANTDeviceHR::getRMSSD)
+        .def("getSDNN", &ANTDeviceHR::getSDNN)
+        .def("getPNN50", &ANTDeviceHR::getPNN50)
+        .def("getMissedBeats", &ANTDeviceHR::getMissedBeats);
+
+    py::class_<ANTDataSink, shared_ptr<ANTDataSink>>(m, "ANTDataSink");
+
+    py::class_<ANTFileDataSink, ANTDataSink,
+        shared_ptr<ANTFileDataSink>>(m, "ANTFileDataSink")
+        .def(py::init<std::string>());
+
     py::class_<ANTDeviceID>(m, "ANTDeviceID")
         .def(py::init<>())
         .def("getID", &ANTDeviceID::getID)
         .def("getType", &ANTDeviceID::getType)
+        .def("getTransType", &ANTDeviceID::getTransType)
         .def("isValid", &ANTDeviceID::isValid);
 
     py::class_<ANTDeviceData<float>, shared_ptr<ANTDeviceData<float>>>
         (m, "ANTDeviceData")
         .def(py::init<>())
+        .def("size", &ANTDeviceData<float>::size)
         .def("getValue", &ANTDeviceData<float>::getValue)
         .def("getTimestamp", &ANTDeviceData<float>::getTimestamp);
 
@@ -0,0 +1,221 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#ifndef ANTPLUS_TESTS_ANTPLUS_TEST_H_
+#define ANTPLUS_TESTS_ANTPLUS_TEST_H_
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+
+// Minimal checks for the C++ tests, each test is a program
+// which CTest runs and which fails if any check failed.
+
+static int _test_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", \
+                    __FILE__, __LINE__, #cond); \
+            _test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(a, b, tol) \
+    do { \
+        double _a = (a); \
+        double _b = (b); \
+        if (!(std::fabs(_a - _b) <= (tol))) { \
+            fprintf(stderr, "%s:%d: CHECK_NEAR(%s, %s) failed " \
+                    "(%g != %g)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            _test_failures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() \
+    (_test_failures ? (fprintf(stderr, "%d check(s) failed\n", \
+            _test_failures), 1) : 0)
+
+// The simulated stick, losing, delaying or refusing (busy) commands
+// on request and counting the channels it is asked to open.
+class LossySim : public ANTSimInterface {
+ public:
+    LossySim(void) : drops(0), dropType(0), opens(0) {
+        pthread_mutex_init(&lossy_lock, NULL);
+    }
+    ~LossySim(void) {
+        pthread_mutex_destroy(&lossy_lock);
+    }
+
+    // Lose the next n commands of a type, as if the stick
+    // never saw them
+    void drop(uint8_t type, int n) {
+        dropType = type;
+        drops    = n;
+    }
+    // Answer the next n commands of a type with TRANSFER_IN_PROGRESS
+    void busy(uint8_t type, int n) {
+        pthread_mutex_lock(&lossy_lock);
+        busies[type] = n;
+        pthread_mutex_unlock(&lossy_lock);
+    }
+    // Hold the next n commands of a type for ms before the
+    // stick sees them (so their responses come in late)
+    void delay(uint8_t type, int n, int ms) {
+        pthread_mutex_lock(&lossy_lock);
+        delays[type] = n;
+        delayTime    = std::chrono::milliseconds(ms);
+        pthread_mutex_unlock(&lossy_lock);
+    }
+    int getOpens(void)  { return opens; }
+    // Commands of a type written to the stick, lost or not
+    int getSends(uint8_t type) {
+        pthread_mutex_lock(&lossy_lock);
+        int n = sends[type];
+        pthread_mutex_unlock(&lossy_lock);
+        return n;
+    }
+
+    int sendMessage(ANTMessage *message) {
+        uint8_t type = message->getType();
+        int len = message->getDataLen() + 5;
+
+        pthread_mutex_lock(&lossy_lock);
+        sends[type]++;
+        if (busies[type] > 0) {
+            busies[type]--;
+            replies.push_back(ANTMessage(ANT_CHANNEL_EVENT,
+                        message->getChannel(), type,
+                        TRANSFER_IN_PROGRESS));
+            pthread_mutex_unlock(&lossy_lock);
+            return len;
+        }
+        if (delays[type] > 0) {
+            delays[type]--;
+            held.push_back({ *message, ant_clock::now() + delayTime });
+            pthread_mutex_unlock(&lossy_lock);
+            return len;
+        }
+        pthread_mutex_unlock(&lossy_lock);
+
+        if ((type == dropType) && (drops > 0)) {
+            drops--;
+            return len;
+        }
+        if (type == ANT_OPEN_CHANNEL) {
+            opens++;
+        }
+        return ANTSimInterface::sendMessage(message);
+    }
+
+    int readMessage(std::vector<ANTMessage> *message) {
+        // Let the held commands through once they are due
+        std::vector<ANTMessage> due;
+        pthread_mutex_lock(&lossy_lock);
+        ant_time_point now = ant_clock::now();
+        for (auto it = held.begin(); it != held.end(); ) {
+            if (it->due <= now) {
+                due.push_back(it->message);
+                it = held.erase(it);
+            } else {
+                it++;
+            }
+        }
+        std::vector<ANTMessage> busy;
+        busy.swap(replies);
+        pthread_mutex_unlock(&lossy_lock);
+
+        for (ANTMessage &m : due) {
+            ANTSimInterface::sendMessage(&m);
+        }
+
+        if (busy.size()) {
+            message->insert(message->end(), busy.begin(), busy.end());
+            return busy.size();
+        }
+        return ANTSimInterface::readMessage(message);
+    }
+
+ private:
+    struct Held {
+        ANTMessage      message;
+        ant_time_point  due;
+    };
+
+    std::atomic<int> drops;
+    std::atomic<uint8_t> dropType;
+    std::atomic<int> opens;
+
+    pthread_mutex_t lossy_lock;
+    std::map<uint8_t, int> busies;
+    std::map<uint8_t, int> delays;
+    std::map<uint8_t, int> sends;
+    std::chrono::milliseconds delayTime;
+    std::vector<Held> held;
+    std::vector<ANTMessage> replies;
+};
+
+// A power meter added to a channel, fed pages as if they were
+// received t s after it was made. The tests derive from it to keep
+// the counters the pages carry.
+struct TestMeter {
+    shared_ptr<ANTDevicePWR> dev;
+    ant_time_point t0;
+
+    TestMeter(ANTChannel *chan, uint16_t id) {
+        ANTDeviceID devID(id, ANT_DEVICE_PWR);
+        dev = std::dynamic_pointer_cast<ANTDevicePWR>(
+                chan->addDevice(&devID));
+        t0 = ant_clock::now();
+    }
+
+    void sendPage(uint8_t *page, double t) {
+        ANTMessage m(ANT_BROADCAST_DATA, 0, page, 8);
+        m.setTimestamp(t0 + std::chrono::microseconds(
+                    (int64_t)(t * 1e6)));
+        dev->parseMessage(&m);
+    }
+
+    // Every stored value of field is within tol of value
+    void checkAll(int field, double value, double tol) {
+        auto data = dev->getTsData(field)->getValue();
+        CHECK(!data->empty());
+        for (float v : *data) {
+            CHECK_NEAR(v, value, tol);
+        }
+    }
+};
+
+#endif  // ANTPLUS_TESTS_ANTPLUS_TEST_H_
@@ -0,0 +1,85 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Two simulated sticks, one hearing HR straps and the other power
+// meters, added to an aggregator some time apart. Every device must
+// be timestamped from the aggregator's start time, so samples taken
+// at the same moment on either stick have the same timestamp.
+
+#define GAP         300   // ms between adding the sticks
+#define TOLERANCE   100   // ms
+
+int main(void) {
+    auto hrSim = std::make_shared<ANTSimInterface>();
+    hrSim->setRate(10);
+    hrSim->addDevices(ANT_DEVICE_HR, 2);
+
+    auto pwrSim = std::make_shared<ANTSimInterface>();
+    pwrSim->setRate(10);
+    pwrSim->addDevices(ANT_DEVICE_PWR, 2, 100);
+
+    ANTAggregator agg;
+    CHECK(agg.addInterface(hrSim, 2) == 0);
+    usleep(GAP * 1000);
+    CHECK(agg.addInterface(pwrSim, 2) == 0);
+
+    CHECK(agg.getANT(0)->getStartTime() == agg.getStartTime());
+    CHECK(agg.getANT(1)->getStartTime() == agg.getStartTime());
+
+    CHECK(agg.init() == 0);
+    CHECK(agg.getChannel(0)->open(ANTChannel::TYPE_HR) == 0);
+    CHECK(agg.getChannel(2)->open(ANTChannel::TYPE_PWR) == 0);
+
+    usleep(1000000);
+
+    // The last sample of every device is from the last few
+    // broadcasts, so it must be close to now on the shared clock
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (ant_clock::now() - agg.getStartTime()).count();
+
+    auto devices = agg.getDeviceList();
+    CHECK(devices.size() == 4);
+    for (auto dev : devices) {
+        CHECK(dev->getStartTime() == agg.getStartTime());
+
+        auto ts = dev->getTsData(0)->getTimestamp();
+        CHECK(!ts->empty());
+        if (!ts->empty()) {
+            CHECK_NEAR((now - ts->back()) / 1e6, 0, TOLERANCE);
+        }
+    }
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,108 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Channel config over a stick which loses commands. A lost response
+// is retried, a command which never gets through fails the open
+// (rather than leaving it waiting forever) and the rollback must not
+// upset the next open of the channel.
+
+static void testRetry(void) {
+    auto sim = std::make_shared<LossySim>();
+    sim->addDevice(ANT_DEVICE_HR, 0x1234);
+
+    ANT ant(sim, 4);
+    CHECK(ant.init() == 0);
+
+    // Not open until the resent command gets its response
+    sim->drop(ANT_CHANNEL_FREQUENCY, 1);
+    auto start = ant_clock::now();
+    auto chan = ant.getChannel(0);
+    CHECK(chan->open(ANTChannel::TYPE_HR) == 0);
+    CHECK((ant_clock::now() - start)
+            >= std::chrono::milliseconds(ANTPLUS_COMMAND_TIMEOUT));
+    CHECK(chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+    CHECK(sim->getOpens() == 1);
+}
+
+static void testTimeout(void) {
+    auto sim = std::make_shared<LossySim>();
+    sim->addDevice(ANT_DEVICE_HR, 0x1234);
+
+    ANT ant(sim, 4);
+    CHECK(ant.init() == 0);
+
+    // Every try is lost, the open must fail once the retries run
+    // out. Open again straight away from the callback, before the
+    // responses to the rollback come in.
+    sim->drop(ANT_CHANNEL_FREQUENCY, ANTPLUS_COMMAND_RETRIES + 1);
+
+    auto chan = ant.getChannel(0);
+    std::promise<std::future<int>> reopened;
+    auto result = chan->openAsync(ANTChannel::TYPE_HR, 0x0000,
+        [&](int rc) {
+            if (rc != 0) {
+                reopened.set_value(chan->openAsync(ANTChannel::TYPE_HR));
+            }
+        });
+
+    int timeout = (ANTPLUS_COMMAND_RETRIES + 2) * ANTPLUS_COMMAND_TIMEOUT;
+    CHECK(result.wait_for(std::chrono::milliseconds(timeout))
+            == std::future_status::ready);
+    CHECK(result.get() == ANTChannel::ERROR);
+
+    auto second = reopened.get_future().get();
+    CHECK(second.wait_for(std::chrono::seconds(2))
+            == std::future_status::ready);
+    CHECK(second.get() == 0);
+
+    // The close from the rollback must not close (and reopen)
+    // the channel again
+    usleep(200000);
+    CHECK(chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+    CHECK(sim->getOpens() == 2);
+    CHECK(sim->getCommandsInFlight() == 0);
+
+    usleep(500000);
+    CHECK(chan->getDeviceList().size() == 1);
+}
+
+int main(void) {
+    testRetry();
+    testTimeout();
+
+    return TEST_RESULT();
+}
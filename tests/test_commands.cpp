@@ -0,0 +1,195 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// The command tracking in ANTInterface, driven by hand over a stick
+// which is busy, slow or loses commands. Each command must complete
+// exactly once: with the response, after its retries, or cancelled
+// when the stick goes.
+
+static ANTMessage period(void) {
+    return ANTMessage(ANT_CHANNEL_PERIOD, 0, 0x86, 0x1F);
+}
+
+// Pump responses into the command tracking until the future
+// completes or timeout (ms) runs out.
+static bool run(LossySim *sim, std::future<int> *result, int timeout) {
+    auto start = ant_clock::now();
+    while ((ant_clock::now() - start)
+            < std::chrono::milliseconds(timeout)) {
+        std::vector<ANTMessage> messages;
+        sim->readMessage(&messages);
+        for (ANTMessage &m : messages) {
+            sim->completeCommand(&m);
+        }
+        sim->checkCommands();
+
+        if (result->wait_for(std::chrono::seconds(0))
+                == std::future_status::ready) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::chrono::milliseconds since(ant_time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>
+        (ant_clock::now() - start);
+}
+
+static void testBusy(void) {
+    LossySim sim;
+    sim.setReadTimeout(10);
+    CHECK(sim.open() == 0);
+
+    // Each busy response uses a retry and resends straight
+    // away, rather than waiting for the timeout
+    sim.busy(ANT_CHANNEL_PERIOD, 2);
+    ANTMessage m = period();
+    auto start = ant_clock::now();
+    auto result = sim.sendCommand(&m, 1000, 3);
+    CHECK(run(&sim, &result, 2000));
+    CHECK(result.get() == RESPONSE_NO_ERROR);
+    CHECK(since(start) < std::chrono::milliseconds(500));
+    CHECK(sim.getSends(ANT_CHANNEL_PERIOD) == 3);
+    CHECK(sim.getCommandsInFlight() == 0);
+
+    // Busy for longer than there are retries, the last busy is
+    // the result
+    sim.busy(ANT_CHANNEL_PERIOD, 5);
+    auto busy = sim.sendCommand(&m, 1000, 2);
+    CHECK(run(&sim, &busy, 2000));
+    CHECK(busy.get() == TRANSFER_IN_PROGRESS);
+    CHECK(sim.getSends(ANT_CHANNEL_PERIOD) == 6);
+    CHECK(sim.getCommandsInFlight() == 0);
+
+    sim.close();
+}
+
+static void testTimeout(void) {
+    LossySim sim;
+    sim.setReadTimeout(10);
+    CHECK(sim.open() == 0);
+
+    // Nothing comes back, the command is tried 1 + retries times
+    // and then fails once the last deadline is past
+    sim.drop(ANT_CHANNEL_PERIOD, 10);
+    ANTMessage m = period();
+    auto start = ant_clock::now();
+    auto result = sim.sendCommand(&m, 100, 2);
+    CHECK(run(&sim, &result, 2000));
+    CHECK(result.get() == ANTInterface::CMD_TIMEOUT);
+    CHECK(since(start) >= std::chrono::milliseconds(300));
+    CHECK(since(start) < std::chrono::milliseconds(1000));
+    CHECK(sim.getSends(ANT_CHANNEL_PERIOD) == 3);
+    CHECK(sim.getCommandsInFlight() == 0);
+
+    sim.close();
+}
+
+static void testDelay(void) {
+    LossySim sim;
+    sim.setReadTimeout(10);
+    CHECK(sim.open() == 0);
+
+    // A late response inside the timeout completes the command
+    // without a resend
+    sim.delay(ANT_CHANNEL_PERIOD, 1, 100);
+    ANTMessage m = period();
+    auto start = ant_clock::now();
+    auto result = sim.sendCommand(&m, 500, 2);
+    CHECK(run(&sim, &result, 2000));
+    CHECK(result.get() == RESPONSE_NO_ERROR);
+    CHECK(since(start) >= std::chrono::milliseconds(100));
+    CHECK(sim.getSends(ANT_CHANNEL_PERIOD) == 1);
+
+    // Too late, the resend is answered first and the late
+    // response (for the same key) is not matched to anything
+    sim.delay(ANT_CHANNEL_PERIOD, 1, 300);
+    auto late = sim.sendCommand(&m, 100, 2);
+    CHECK(run(&sim, &late, 2000));
+    CHECK(late.get() == RESPONSE_NO_ERROR);
+    CHECK(sim.getSends(ANT_CHANNEL_PERIOD) == 3);
+    usleep(300000);
+    std::vector<ANTMessage> messages;
+    sim.readMessage(&messages);
+    for (ANTMessage &msg : messages) {
+        CHECK(!sim.completeCommand(&msg));
+    }
+    CHECK(sim.getCommandsInFlight() == 0);
+
+    sim.close();
+}
+
+static void testCancel(void) {
+    auto sim = std::make_shared<LossySim>();
+    ANT ant(sim, 4);
+    CHECK(ant.init() == 0);
+
+    // Unplugged with a command waiting on its response, the
+    // reconnect cancels it rather than leaving it to time out
+    sim->drop(ANT_CHANNEL_PERIOD, 10);
+    ANTMessage m = period();
+    auto start = ant_clock::now();
+    auto result = sim->sendCommand(&m, 5000, 0);
+    usleep(100000);
+    CHECK(sim->getCommandsInFlight() == 1);
+
+    sim->setConnected(false);
+    CHECK(result.wait_for(std::chrono::seconds(2))
+            == std::future_status::ready);
+    CHECK(result.get() == ANTInterface::CMD_CANCELLED);
+    CHECK(since(start) < std::chrono::milliseconds(2500));
+    CHECK(sim->getCommandsInFlight() == 0);
+
+    // Commands work again once the stick is back
+    sim->drop(ANT_CHANNEL_PERIOD, 0);
+    sim->setConnected(true);
+    usleep(500000);
+    auto after = sim->sendCommand(&m);
+    CHECK(after.wait_for(std::chrono::seconds(2))
+            == std::future_status::ready);
+    CHECK(after.get() == RESPONSE_NO_ERROR);
+}
+
+int main(void) {
+    testBusy();
+    testTimeout();
+    testDelay();
+    testCancel();
+
+    return TEST_RESULT();
+}
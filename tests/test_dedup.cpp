@@ -0,0 +1,141 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <chrono>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Two receivers hear the same HR sensor, one with a much better
+// signal. Whichever order the copies arrive in, each page must be
+// stored once and it must be the strong receiver's copy, unless the
+// strong receiver missed the page.
+
+#define STRONG      1
+#define WEAK        0
+#define PERIOD      250  // ms
+#define LATE        5    // ms
+
+static ANTMessage makePage(int n, int rssi, ant_time_point t) {
+    uint8_t data[16];
+    data[0]  = ANT_DEVICE_HR_PREVIOUS | (((n / 4) & 1) << 7);
+    data[1]  = 0xFF;
+    data[2]  = ((n - 1) * 512) & 0xFF;
+    data[3]  = ((n - 1) * 512) >> 8;
+    data[4]  = (n * 512) & 0xFF;
+    data[5]  = (n * 512) >> 8;
+    data[6]  = n;
+    data[7]  = 120;
+    data[8]  = ANT_EXT_MSG_CHAN_ID | ANT_EXT_MSG_RSSI;
+    data[9]  = 0x34;
+    data[10] = 0x12;
+    data[11] = ANT_DEVICE_HR;
+    data[12] = 0x01;
+    data[13] = 0x20;
+    data[14] = (uint8_t)(int8_t)rssi;
+    data[15] = (uint8_t)(int8_t)-96;
+
+    // Through the wire format, so the RSSI is decoded
+    uint8_t frame[ANTPLUS_MAX_MESSAGE_SIZE];
+    int len;
+    ANTMessage(ANT_BROADCAST_DATA, 0, data, sizeof(data))
+        .encode(frame, &len);
+    ANTMessage m(frame, len);
+    m.setTimestamp(t);
+    return m;
+}
+
+static void deliver(ANTDevice *dev, int n, int receiver,
+        ant_time_point t) {
+    ANTMessage m = makePage(n, receiver == STRONG ? -50 : -80, t);
+    CHECK(m.getRSSI() == (receiver == STRONG ? -50 : -80));
+    dev->parseMessage(&m, receiver);
+}
+
+int main(void) {
+    ant_time_point t0 = ant_clock::now();
+    ANTDeviceHR dev(ANTDeviceID(0x1234, ANT_DEVICE_HR, 0x01));
+    dev.setStartTime(t0);
+    dev.setDedupWindow(100);
+
+    std::vector<int64_t> expected;
+    auto ms = [](int n) { return std::chrono::milliseconds(n); };
+    auto ns = [&t0](ant_time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>
+            (t - t0).count();
+    };
+
+    // Alternate which receiver is heard first
+    int n;
+    for (n = 1; n <= 20; n++) {
+        ant_time_point t = t0 + ms(n * PERIOD);
+        if (n & 1) {
+            deliver(&dev, n, STRONG, t);
+            deliver(&dev, n, WEAK, t + ms(LATE));
+            expected.push_back(ns(t));
+        } else {
+            deliver(&dev, n, WEAK, t);
+            deliver(&dev, n, STRONG, t + ms(LATE));
+            expected.push_back(ns(t + ms(LATE)));
+        }
+    }
+
+    CHECK(dev.getPreferredReceiver() == STRONG);
+    CHECK(dev.getDuplicates() == 20);
+
+    // The strong receiver misses a page, the weak copy is used
+    // when the next page shows it is not coming.
+    ant_time_point t = t0 + ms(n * PERIOD);
+    deliver(&dev, n, WEAK, t);
+    expected.push_back(ns(t));
+    n++;
+
+    t = t0 + ms(n * PERIOD);
+    deliver(&dev, n, STRONG, t);
+    deliver(&dev, n, WEAK, t + ms(LATE));
+    expected.push_back(ns(t));
+
+    CHECK(dev.getDuplicates() == 21);
+
+    auto hr = dev.getTsData(ANTDeviceHR::FIELD_HEARTRATE);
+    auto ts = hr->getTimestamp();
+    CHECK(hr->size() == expected.size());
+    CHECK(*ts == expected);
+
+    // Without the strong receiver nothing is held back
+    for (n++; n < 30; n++) {
+        t = t0 + ms(10000 + n * PERIOD);
+        deliver(&dev, n, WEAK, t);
+        expected.push_back(ns(t));
+    }
+    ts = hr->getTimestamp();
+    CHECK(*ts == expected);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,188 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// HRV statistics. The running sums in ANTHrv must match the
+// statistics worked out from scratch over the beats in the window,
+// and a heart rate strap losing pages must still give the right RR
+// intervals and HRV.
+
+struct Beat {
+    int64_t t;
+    double  rr;
+    bool    consecutive;
+};
+
+static void checkWindow(ANTHrv *hrv, const std::vector<Beat> &beats,
+        int64_t window) {
+    // The beats still in the window, the first of which has
+    // nothing to difference against
+    std::vector<Beat> kept;
+    for (const Beat &b : beats) {
+        if ((beats.back().t - b.t) < window) {
+            kept.push_back(b);
+        }
+    }
+
+    double sum = 0;
+    double sumDiff2 = 0;
+    int nDiff = 0;
+    int nNN50 = 0;
+    for (size_t i = 0; i < kept.size(); i++) {
+        sum += kept[i].rr;
+        if ((i > 0) && kept[i].consecutive) {
+            double d = kept[i].rr - kept[i - 1].rr;
+            sumDiff2 += d * d;
+            nDiff++;
+            if (std::fabs(d) > 50) {
+                nNN50++;
+            }
+        }
+    }
+    double mean = sum / kept.size();
+    double var = 0;
+    for (const Beat &b : kept) {
+        var += (b.rr - mean) * (b.rr - mean);
+    }
+
+    CHECK(hrv->getBeats() == (int)kept.size());
+    if (kept.size() > 1) {
+        CHECK_NEAR(hrv->getSDNN(), std::sqrt(var / (kept.size() - 1)),
+                1e-3);
+    }
+    if (nDiff) {
+        CHECK_NEAR(hrv->getRMSSD(), std::sqrt(sumDiff2 / nDiff), 1e-3);
+        CHECK_NEAR(hrv->getPNN50(), (100.0 * nNN50) / nDiff, 1e-6);
+    } else {
+        CHECK(std::isnan(hrv->getRMSSD()));
+        CHECK(std::isnan(hrv->getPNN50()));
+    }
+}
+
+static void testWindow(void) {
+    // A wandering heart rate with a missed beat now and then
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> step(-60, 60);
+
+    int window = 30000;
+    ANTHrv hrv(window);
+    std::vector<Beat> beats;
+
+    double rr = 800;
+    int64_t t = 0;
+    for (int i = 0; i < 2000; i++) {
+        rr = std::min(std::max(rr + step(rng), 400.0), 1500.0);
+        bool consecutive = (rng() % 10) != 0;
+        t += static_cast<int64_t>(rr * 1e6);
+        if (!consecutive) {
+            // The missed beat's time passes too
+            t += static_cast<int64_t>(rr * 1e6);
+        }
+
+        hrv.addBeat(t, rr, consecutive);
+        beats.push_back({ t, rr, consecutive });
+        checkWindow(&hrv, beats, static_cast<int64_t>(window) * 1000000L);
+    }
+
+    hrv.clear();
+    CHECK(hrv.getBeats() == 0);
+    CHECK(std::isnan(hrv.getSDNN()));
+    CHECK(std::isnan(hrv.getRMSSD()));
+}
+
+static void testStrap(void) {
+    ANTChannel chan(ANTChannel::TYPE_HR, 0, nullptr);
+    ANTDeviceID id(1, ANT_DEVICE_HR);
+    auto dev = std::dynamic_pointer_cast<ANTDeviceHR>(chan.addDevice(&id));
+    auto t0 = ant_clock::now();
+
+    // Beats alternately 800 and 860 ms apart for ten minutes, the
+    // strap sends page 4 (with the previous beat time) two pages in
+    // three. One page in seven is lost, and a second's worth (which
+    // takes a beat with it) every 20 s.
+    std::vector<double> beatTimes;
+    double bt = 0.3;
+    for (int i = 0; bt < 600; i++) {
+        beatTimes.push_back(bt);
+        bt += (i & 1) ? 0.860 : 0.800;
+    }
+
+    size_t next = 0;
+    uint8_t count = 0;
+    uint16_t eventTime = 0;
+    uint16_t previous = 0;
+    for (int i = 0; i < 4 * 600; i++) {
+        double t = i * 0.25;
+        while ((next < beatTimes.size()) && (beatTimes[next] <= t)) {
+            previous  = eventTime;
+            eventTime = (uint16_t)lround(beatTimes[next] * 1024);
+            count++;
+            next++;
+        }
+        if ((count < 2) || ((i % 7) == 3) || ((i % 80) < 4)) {
+            continue;
+        }
+
+        uint8_t page = (i % 3) ? 0x04 : 0x00;
+        uint8_t data[8] = {
+            (uint8_t)(page | (((i / 4) & 1) << 7)), 0xFF,
+            (uint8_t)(previous & 0xFF), (uint8_t)(previous >> 8),
+            (uint8_t)(eventTime & 0xFF), (uint8_t)(eventTime >> 8),
+            count, 72
+        };
+        ANTMessage m(ANT_BROADCAST_DATA, 0, data, sizeof(data));
+        m.setTimestamp(t0 + std::chrono::milliseconds(250 * i));
+        dev->parseMessage(&m);
+    }
+
+    auto rr = dev->getTsData(ANTDeviceHR::FIELD_RR_INTERVAL)->getValue();
+    CHECK(rr->size() > (beatTimes.size() / 2));
+    for (float r : *rr) {
+        CHECK((std::fabs(r - 800) <= 1) || (std::fabs(r - 860) <= 1));
+    }
+
+    CHECK_NEAR(dev->getRMSSD(), 60, 1);
+    CHECK_NEAR(dev->getSDNN(), 30, 1);
+    CHECK_NEAR(dev->getPNN50(), 100, 1e-3);
+    CHECK(dev->getMissedBeats() > 0);
+    CHECK(dev->getMissedBeats() + rr->size() <= beatTimes.size());
+}
+
+int main(void) {
+    testWindow();
+    testStrap();
+
+    return TEST_RESULT();
+}
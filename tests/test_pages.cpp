@@ -0,0 +1,193 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cmath>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Data pages with known contents through each device type's page
+// table: scaling, offsets, signed and bit fields, meta data, and
+// fields which must be skipped when marked invalid.
+
+static void feed(shared_ptr<ANTDevice> dev, uint8_t b0, uint8_t b1,
+        uint8_t b2, uint8_t b3, uint8_t b4, uint8_t b5, uint8_t b6,
+        uint8_t b7) {
+    uint8_t data[8] = { b0, b1, b2, b3, b4, b5, b6, b7 };
+    ANTMessage m(ANT_BROADCAST_DATA, 0, data, sizeof(data));
+    m.setTimestamp();
+    dev->parseMessage(&m);
+}
+
+static size_t count(shared_ptr<ANTDevice> dev, int field) {
+    return dev->getTsData(field)->size();
+}
+
+static double last(shared_ptr<ANTDevice> dev, int field) {
+    auto v = dev->getTsData(field)->getValue();
+    return v->empty() ? NAN : v->back();
+}
+
+static double meta(shared_ptr<ANTDevice> dev, const char *name) {
+    auto m = dev->getMetaData();
+    auto it = m->find(name);
+    return (it == m->end()) ? NAN : it->second;
+}
+
+static shared_ptr<ANTDevice> makeDevice(ANTChannel *chan, uint8_t type) {
+    ANTDeviceID id(1, type);
+    return chan->addDevice(&id);
+}
+
+static void testCommon(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    auto dev = makeDevice(&chan, ANT_DEVICE_PWR);
+
+    feed(dev, ANT_DEVICE_COMMON_DATA, 0xFF, 0xFF, 3, 0x01, 0x00,
+            0x34, 0x12);
+    CHECK(meta(dev, "HW_REVISION") == 3);
+    CHECK(meta(dev, "MANUFACTURER_ID") == 1);
+    CHECK(meta(dev, "MODEL_NUMBER") == 0x1234);
+
+    feed(dev, ANT_DEVICE_COMMON_INFO, 0xFF, 0xFF, 0xFF, 0x40, 0xE2,
+            0x01, 0x00);
+    CHECK(meta(dev, "SERIAL_NUMBER") == 123456);
+}
+
+static void testFEC(void) {
+    ANTChannel chan(ANTChannel::TYPE_FEC, 0, nullptr);
+    auto dev = makeDevice(&chan, ANT_DEVICE_FEC);
+
+    // 10.5 m/s
+    feed(dev, ANT_DEVICE_FEC_GENERAL, 0x19, 0x00, 0x00, 0x04, 0x29,
+            0xFF, 0x24);
+    CHECK_NEAR(last(dev, ANTDeviceFEC::FIELD_GENERAL_INST_SPEED),
+            10.5, 1e-4);
+
+    // 2.07 m cycle, -2.5 % incline, 50 % resistance
+    feed(dev, ANT_DEVICE_FEC_GENERAL_SETTINGS, 0xFF, 0xFF, 207, 0x06,
+            0xFF, 100, 0x00);
+    CHECK_NEAR(last(dev, ANTDeviceFEC::FIELD_SETTINGS_CYCLE_LENGTH),
+            2.07, 1e-4);
+    CHECK_NEAR(last(dev, ANTDeviceFEC::FIELD_SETTINGS_INCLINE),
+            -2.5, 1e-4);
+    CHECK_NEAR(last(dev, ANTDeviceFEC::FIELD_SETTINGS_RESISTANCE),
+            50, 1e-4);
+
+    // 90 rpm, 4660 W accumulated, 1234 W with the trainer status
+    // in the top of the same byte, and the flags
+    feed(dev, ANT_DEVICE_FEC_TRAINER, 0x01, 90, 0x34, 0x12, 0xD2,
+            0x34, 0x35);
+    CHECK(last(dev, ANTDeviceFEC::FIELD_TRAINER_CADENCE) == 90);
+    CHECK(last(dev, ANTDeviceFEC::FIELD_TRAINER_ACC_POWER) == 0x1234);
+    CHECK(last(dev, ANTDeviceFEC::FIELD_TRAINER_INST_POWER) == 1234);
+    CHECK(last(dev, ANTDeviceFEC::FIELD_TRAINER_STATUS) == 3);
+    CHECK(last(dev, ANTDeviceFEC::FIELD_TRAINER_FLAGS) == 5);
+}
+
+static void testPWR(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    auto dev = makeDevice(&chan, ANT_DEVICE_PWR);
+
+    // 48 % balance (right pedal), 95 rpm, 250 W
+    feed(dev, ANT_DEVICE_POWER_STANDARD, 1, 0x80 | 48, 95, 0xE8, 0x03,
+            250, 0);
+    CHECK(last(dev, ANTDevicePWR::FIELD_BALANCE) == 48);
+    CHECK(last(dev, ANTDevicePWR::FIELD_CADENCE) == 95);
+    CHECK(last(dev, ANTDevicePWR::FIELD_ACC_POWER) == 1000);
+    CHECK(last(dev, ANTDevicePWR::FIELD_INST_POWER) == 250);
+
+    // No balance, without the right pedal bit or when not used
+    feed(dev, ANT_DEVICE_POWER_STANDARD, 2, 48, 95, 0xE8, 0x04, 0, 1);
+    feed(dev, ANT_DEVICE_POWER_STANDARD, 3, 0xFF, 95, 0xE8, 0x05, 0, 1);
+    CHECK(count(dev, ANTDevicePWR::FIELD_BALANCE) == 1);
+    CHECK(count(dev, ANTDevicePWR::FIELD_INST_POWER) == 3);
+    CHECK(last(dev, ANTDevicePWR::FIELD_INST_POWER) == 256);
+
+    // No cadence from a torque page which has none
+    feed(dev, ANT_DEVICE_POWER_CRANK_TORQUE, 1, 1, 0xFF, 0x00, 0x08,
+            0x00, 0x04);
+    CHECK(count(dev, ANTDevicePWR::FIELD_CADENCE) == 3);
+
+    // Crank parameters (sub page 1), 172.5 mm
+    feed(dev, ANT_DEVICE_POWER_PARAMS, ANT_DEVICE_POWER_PARAMS_CRANK,
+            0xFF, 0xFF, 125, 0x02, 0x08, 0x00);
+    CHECK(last(dev, ANTDevicePWR::FIELD_CRANK_LENGTH) == 172.5);
+    CHECK(last(dev, ANTDevicePWR::FIELD_CRANK_STATUS) == 2);
+    CHECK(last(dev, ANTDevicePWR::FIELD_SENSOR_STATUS) == 1);
+    CHECK(count(dev, ANTDevicePWR::FIELD_PEAK_TORQUE_THRESHOLD) == 0);
+
+    // Torque parameters (sub page 2), 25 %
+    feed(dev, ANT_DEVICE_POWER_PARAMS, ANT_DEVICE_POWER_PARAMS_TORQUE,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 50);
+    CHECK(last(dev, ANTDevicePWR::FIELD_PEAK_TORQUE_THRESHOLD) == 25);
+    CHECK(count(dev, ANTDevicePWR::FIELD_CRANK_LENGTH) == 1);
+
+    // Torque effectiveness and pedal smoothness, in 0.5 %
+    feed(dev, ANT_DEVICE_POWER_TEPS, 1, 150, 160, 40, 50, 0xFF, 0xFF);
+    CHECK(last(dev, ANTDevicePWR::FIELD_LEFT_TE) == 75);
+    CHECK(last(dev, ANTDevicePWR::FIELD_RIGHT_TE) == 80);
+    CHECK(last(dev, ANTDevicePWR::FIELD_LEFT_PS) == 20);
+    CHECK(last(dev, ANTDevicePWR::FIELD_RIGHT_PS) == 25);
+
+    // Two batteries, 0x010203 operating time
+    feed(dev, ANT_DEVICE_POWER_BATTERY, 0xFF, 0x12, 0x03, 0x02, 0x01,
+            0xC0, 0x33);
+    CHECK(last(dev, ANTDevicePWR::FIELD_N_BATTERIES) == 2);
+    CHECK(last(dev, ANTDevicePWR::FIELD_OPERATING_TIME) == 0x010203);
+    CHECK(last(dev, ANTDevicePWR::FIELD_BATTERY_VOLTAGE) == 0xC0);
+}
+
+static void testHR(void) {
+    ANTChannel chan(ANTChannel::TYPE_HR, 0, nullptr);
+    auto dev = makeDevice(&chan, ANT_DEVICE_HR);
+
+    // The toggle bit is not part of the page number
+    feed(dev, 0x80 | ANT_DEVICE_HR_MF_INFO, 7, 0x39, 0x30, 0x00, 0x04,
+            1, 72);
+    CHECK(meta(dev, "HR_MANUFACTURER_ID") == 7);
+    CHECK(meta(dev, "HR_SERIAL_NUMBER") == 12345);
+
+    feed(dev, ANT_DEVICE_HR_INFO, 4, 21, 9, 0x00, 0x08, 2, 73);
+    CHECK(meta(dev, "HR_HW_VERSION") == 4);
+    CHECK(meta(dev, "HR_SW_VERSION") == 21);
+    CHECK(meta(dev, "HR_MODEL_NUMBER") == 9);
+
+    CHECK(count(dev, ANTDeviceHR::FIELD_HEARTRATE) == 2);
+    CHECK(last(dev, ANTDeviceHR::FIELD_HEARTRATE) == 73);
+}
+
+int main(void) {
+    testCommon();
+    testFEC();
+    testPWR();
+    testHR();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,121 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cmath>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Average power from the accumulated power page (0x10). Pages are
+// lost and repeated and both counters wrap, the averages must still
+// be the power the meter saw. After a gap in which the counters may
+// have wrapped more than once no average must be made up.
+
+struct PowerMeter : TestMeter {
+    double   t;          // s
+    uint8_t  events;
+    uint16_t accPower;
+
+    explicit PowerMeter(ANTChannel *chan) : TestMeter(chan, 1) {
+        t = 0;
+        events = 250;
+        accPower = 65000;
+    }
+};
+
+// Run the meter for n events at rate (Hz), sending the pages
+// for which send(i) is true.
+template <typename F>
+static void run(PowerMeter *meter, int n, double rate, int watts,
+        F send) {
+    for (int i = 0; i < n; i++) {
+        meter->t += 1.0 / rate;
+        meter->events++;
+        meter->accPower += watts;
+        if (!send(i)) {
+            continue;
+        }
+
+        uint8_t page[8] = {
+            ANT_DEVICE_POWER_STANDARD, meter->events, 0xFF, 90,
+            (uint8_t)(meter->accPower & 0xFF),
+            (uint8_t)(meter->accPower >> 8),
+            (uint8_t)(watts & 0xFF), (uint8_t)(watts >> 8)
+        };
+        meter->sendPage(page, meter->t);
+    }
+}
+
+static void testAveragePower(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    PowerMeter meter(&chan);
+
+    // Two minutes at 200 W, losing 3 pages in 10
+    run(&meter, 4 * 120, 4.0, 200, [](int i) {
+        return ((i % 10) != 3) && ((i % 10) != 6) && ((i % 10) != 9);
+    });
+
+    meter.checkAll(ANTDevicePWR::FIELD_AVG_POWER, 200, 0.5);
+    CHECK_NEAR(meter.dev->getPower3s(), 200, 0.5);
+    CHECK_NEAR(meter.dev->getPower30s(), 200, 0.5);
+    CHECK_NEAR(meter.dev->getNormalizedPower(), 200, 0.5);
+}
+
+static void testPowerGap(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    PowerMeter meter(&chan);
+    auto all = [](int) { return true; };
+    auto none = [](int) { return false; };
+
+    // 1000 W for 20 s wraps the accumulated power once, the
+    // event count is still good.
+    run(&meter, 40, 4.0, 1000, all);
+    run(&meter, 80, 4.0, 1000, none);
+    run(&meter, 40, 4.0, 1000, all);
+    meter.checkAll(ANTDevicePWR::FIELD_AVG_POWER, 1000, 0.5);
+
+    // A fast meter, 40 events in 5 s wrap it at 2000 W
+    run(&meter, 40, 8.0, 2000, all);
+    run(&meter, 40, 8.0, 2000, none);
+    run(&meter, 40, 8.0, 2000, all);
+
+    auto avg = meter.dev->getTsData(ANTDevicePWR::FIELD_AVG_POWER)
+        ->getValue();
+    CHECK(avg->size() == (39 + 39 + 40 + 39));
+    for (float p : *avg) {
+        CHECK((std::fabs(p - 1000) < 0.5) || (std::fabs(p - 2000) < 0.5));
+    }
+}
+
+int main(void) {
+    testAveragePower();
+    testPowerGap();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,153 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Frames split across reads at every point, with garbage between
+// them: a stray sync byte with an impossible length, a sync and
+// length which look like the start of a frame but fail the
+// checksum, and a frame with a bad checksum. Every good frame must
+// come out whole and in order, and nothing else.
+
+static void addFrame(std::vector<uint8_t> *stream, uint8_t chan,
+        uint8_t seq, bool corrupt = false) {
+    uint8_t page[8] = { 0x04, seq, 0x00, 0x00, 0x00, 0x00, 0x00, 60 };
+    ANTMessage m(ANT_BROADCAST_DATA, chan, page, sizeof(page));
+
+    uint8_t frame[ANT_MAX_MESSAGE_LEN + 4];
+    int len;
+    m.encode(frame, &len);
+    if (corrupt) {
+        frame[len - 1] ^= 0xFF;
+    }
+    stream->insert(stream->end(), frame, frame + len);
+}
+
+static std::vector<uint8_t> makeStream(void) {
+    std::vector<uint8_t> stream = { 0x00, ANT_SYNC_BYTE, 0x55 };
+    addFrame(&stream, 1, 1);
+    addFrame(&stream, 1, 2, true);
+    stream.insert(stream.end(), { ANT_SYNC_BYTE, 0x03, 0x4E });
+    addFrame(&stream, 2, 3);
+    stream.push_back(0x13);
+    addFrame(&stream, 3, 4);
+    return stream;
+}
+
+// Pull out what we can, checking each frame is the next we expect
+static void drain(ANTReassembler *r, int *seq) {
+    static const uint8_t expect[][2] = {
+        { 1, 1 }, { 2, 3 }, { 3, 4 }
+    };
+
+    ANTFrame frame;
+    while (r->nextFrame(&frame)) {
+        ANTMessage m(frame.data, frame.len);
+        CHECK(*seq < 3);
+        if (*seq >= 3) {
+            return;
+        }
+        CHECK(m.getType() == ANT_BROADCAST_DATA);
+        CHECK(m.getChannel() == expect[*seq][0]);
+        CHECK(m.getData(1) == expect[*seq][1]);
+        (*seq)++;
+    }
+}
+
+static void testSplit(void) {
+    std::vector<uint8_t> stream = makeStream();
+
+    for (size_t split = 1; split < stream.size(); split++) {
+        ANTReassembler r;
+        int seq = 0;
+
+        CHECK(r.push(stream.data(), split) == (int)split);
+        drain(&r, &seq);
+        CHECK(r.push(stream.data() + split, stream.size() - split)
+                == (int)(stream.size() - split));
+        drain(&r, &seq);
+
+        CHECK(seq == 3);
+        CHECK(r.getDropped() > 0);
+    }
+}
+
+static void testBytes(void) {
+    // One byte per read, the worst a serial port can do
+    std::vector<uint8_t> stream = makeStream();
+    ANTReassembler r;
+    int seq = 0;
+
+    for (uint8_t b : stream) {
+        r.push(&b, 1);
+        drain(&r, &seq);
+    }
+    CHECK(seq == 3);
+}
+
+static void testFull(void) {
+    // Only what fits is taken, the rest must be pushed again
+    // once the frames have been read.
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 100; i++) {
+        addFrame(&stream, 0, i);
+    }
+
+    ANTReassembler r;
+    size_t sent = 0;
+    int frames = 0;
+    while (sent < stream.size()) {
+        int n = r.push(stream.data() + sent, stream.size() - sent);
+        CHECK(n > 0);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+
+        ANTFrame frame;
+        while (r.nextFrame(&frame)) {
+            ANTMessage m(frame.data, frame.len);
+            CHECK(m.getData(1) == (uint8_t)frames);
+            frames++;
+        }
+    }
+
+    CHECK(frames == 100);
+    CHECK(r.getDropped() == 0);
+}
+
+int main(void) {
+    testSplit();
+    testBytes();
+    testFull();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,144 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Unplug the simulated stick and plug it back in. The channels must
+// be opened again with the same devices (and the data they already
+// had), and an open in progress must complete once the stick is back.
+
+static bool waitOpen(std::vector<shared_ptr<ANTChannel>> chans,
+        int timeout) {
+    auto start = ant_clock::now();
+    while ((ant_clock::now() - start)
+            < std::chrono::milliseconds(timeout)) {
+        bool open = true;
+        for (auto chan : chans) {
+            open &= (chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+        }
+        if (open) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static size_t countSamples(shared_ptr<ANTDevice> dev, int field) {
+    return dev->getTsData(field)->size();
+}
+
+static void testReconnect(void) {
+    auto sim = std::make_shared<LossySim>();
+    sim->setRate(10);
+    sim->addDevice(ANT_DEVICE_HR, 0x1234);
+    sim->addDevice(ANT_DEVICE_PWR, 0x5678);
+
+    ANT ant(sim, 4);
+    CHECK(ant.init() == 0);
+
+    auto hr  = ant.getChannel(0);
+    auto pwr = ant.getChannel(1);
+    CHECK(hr->open(ANTChannel::TYPE_HR) == 0);
+    CHECK(pwr->open(ANTChannel::TYPE_PWR) == 0);
+
+    usleep(500000);
+    CHECK(hr->getDeviceList().size() == 1);
+    CHECK(pwr->getDeviceList().size() == 1);
+    if (hr->getDeviceList().empty() || pwr->getDeviceList().empty()) {
+        return;
+    }
+    auto hrDev  = hr->getDeviceList()[0];
+    auto pwrDev = pwr->getDeviceList()[0];
+
+    sim->setConnected(false);
+    usleep(300000);
+    size_t hrBefore  = countSamples(hrDev, ANTDeviceHR::FIELD_HEARTRATE);
+    size_t pwrBefore = countSamples(pwrDev, ANTDevicePWR::FIELD_INST_POWER);
+    CHECK(hrBefore > 0);
+    CHECK(pwrBefore > 0);
+    CHECK(ant.getChannel(2)->getState() == ANTChannel::STATE_IDLE);
+
+    sim->setConnected(true);
+    CHECK(waitOpen({ hr, pwr }, 3000));
+    usleep(500000);
+
+    // The same devices, with more data than before
+    CHECK(hr->getDeviceList().size() == 1);
+    CHECK(pwr->getDeviceList().size() == 1);
+    CHECK(hr->getDeviceList()[0] == hrDev);
+    CHECK(pwr->getDeviceList()[0] == pwrDev);
+    CHECK(countSamples(hrDev, ANTDeviceHR::FIELD_HEARTRATE) > hrBefore);
+    CHECK(countSamples(pwrDev, ANTDevicePWR::FIELD_INST_POWER)
+            > pwrBefore);
+
+    // Unused channels stay that way
+    CHECK(ant.getChannel(2)->getState() == ANTChannel::STATE_IDLE);
+}
+
+static void testOpenAcrossReconnect(void) {
+    auto sim = std::make_shared<LossySim>();
+    sim->addDevice(ANT_DEVICE_HR, 0x1234);
+
+    ANT ant(sim, 4);
+    CHECK(ant.init() == 0);
+
+    // Unplug before the open can complete, the open carries on
+    // when the stick is back
+    sim->drop(ANT_OPEN_CHANNEL, 1);
+    auto chan = ant.getChannel(0);
+    int callbackRc = 1;
+    auto result = chan->openAsync(ANTChannel::TYPE_HR, 0x0000,
+            [&](int rc) { callbackRc = rc; });
+    sim->setConnected(false);
+    usleep(300000);
+    CHECK(result.wait_for(std::chrono::seconds(0))
+            == std::future_status::timeout);
+
+    sim->setConnected(true);
+    CHECK(result.wait_for(std::chrono::seconds(3))
+            == std::future_status::ready);
+    CHECK(result.get() == 0);
+    CHECK(callbackRc == 0);
+    CHECK(chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+}
+
+int main(void) {
+    testReconnect();
+    testOpenAcrossReconnect();
+
+    return TEST_RESULT();
+}
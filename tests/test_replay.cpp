@@ -0,0 +1,205 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Capture a session with the simulated stick and replay it, as fast
+// as possible and at four times real time. The replay must give the
+// same devices with the same data, with the spacing of the
+// timestamps kept exactly, and the frames written to the stick must
+// not be played back.
+
+// The simulated stick, logging what it reads and is sent like the
+// USB and serial interfaces do
+class RecordingSim : public ANTSimInterface {
+ public:
+    explicit RecordingSim(std::string filename)
+        : capture(filename), reads(0), writes(0) {}
+
+    int sendMessage(ANTMessage *message) {
+        record(ANTCapture::DIR_WRITE, message, ant_clock::now());
+        writes++;
+        return ANTSimInterface::sendMessage(message);
+    }
+
+    int readMessage(std::vector<ANTMessage> *message) {
+        size_t n = message->size();
+        int rc = ANTSimInterface::readMessage(message);
+        for (size_t i = n; i < message->size(); i++) {
+            record(ANTCapture::DIR_READ, &(*message)[i],
+                    (*message)[i].getTimestamp());
+            reads++;
+        }
+        return rc;
+    }
+
+    ANTCapture capture;
+    uint64_t reads;
+    uint64_t writes;
+
+ private:
+    void record(int dir, ANTMessage *m, ant_time_point t) {
+        uint8_t frame[ANTPLUS_MAX_MESSAGE_SIZE];
+        int len;
+        m->encode(frame, &len);
+        capture.record(dir, frame, len, t);
+    }
+};
+
+struct Series {
+    std::vector<float> value;
+    std::vector<int64_t> ts;
+};
+
+typedef std::map<std::pair<uint16_t, uint8_t>, std::vector<Series>> Data;
+
+static Data collect(ANT *ant) {
+    // Every field of every device, keyed on the device ID
+    Data data;
+    for (auto chan : ant->getChannels()) {
+        for (auto dev : chan->getDeviceList()) {
+            ANTDeviceID id = dev->getDeviceID();
+            auto &fields = data[{ id.getID(), id.getType() }];
+            for (int f = 0; f < dev->getNumFields(); f++) {
+                fields.push_back({ *dev->getTsData(f)->getValue(),
+                        *dev->getTsData(f)->getTimestamp() });
+            }
+        }
+    }
+    return data;
+}
+
+static void compare(const Data &a, const Data &b) {
+    CHECK(a.size() == b.size());
+    for (auto &dev : a) {
+        auto it = b.find(dev.first);
+        CHECK(it != b.end());
+        if (it == b.end()) {
+            continue;
+        }
+        CHECK(dev.second.size() == it->second.size());
+        for (size_t f = 0; f < dev.second.size(); f++) {
+            const Series &s = dev.second[f];
+            const Series &r = it->second[f];
+            CHECK(s.value == r.value);
+            CHECK(s.ts.size() == r.ts.size());
+            if (s.ts.empty() || (s.ts.size() != r.ts.size())) {
+                continue;
+            }
+            // The replay starts later, the spacing must be exact
+            bool same = true;
+            for (size_t i = 0; i < s.ts.size(); i++) {
+                same &= ((s.ts[i] - s.ts[0]) == (r.ts[i] - r.ts[0]));
+            }
+            CHECK(same);
+        }
+    }
+}
+
+static Data record(std::string filename, uint64_t *reads) {
+    auto sim = std::make_shared<RecordingSim>(filename);
+    sim->setRate(10);
+    sim->setSeed(1);
+    sim->addDevices(ANT_DEVICE_HR, 3);
+    sim->addDevices(ANT_DEVICE_PWR, 3, 100);
+    CHECK(sim->capture.isOpen());
+
+    ANT ant(sim, 8, 1, ANT::MODE_EVENT_LOOP);
+    CHECK(ant.init() == 0);
+    CHECK(ant.getChannel(0)->open(ANTChannel::TYPE_HR, 0x0000,
+                false) == 0);
+    CHECK(ant.getChannel(1)->open(ANTChannel::TYPE_PWR, 0x0000,
+                false) == 0);
+
+    auto start = ant_clock::now();
+    while ((ant_clock::now() - start) < std::chrono::milliseconds(1000)) {
+        CHECK(ant.runOnce(20) >= 0);
+    }
+    sim->capture.flush();
+
+    CHECK(sim->writes > 0);
+    *reads = sim->reads;
+
+    Data data = collect(&ant);
+    CHECK(data.size() == 6);
+    return data;
+}
+
+static Data replay(std::string filename, float speed, uint64_t reads,
+        int64_t *took) {
+    auto iface = std::make_shared<ANTReplayInterface>(filename);
+    iface->setSpeed(speed);
+
+    ANT ant(iface, 8, 1, ANT::MODE_EVENT_LOOP);
+    auto start = ant_clock::now();
+    CHECK(ant.init() == 0);
+    while (!iface->isDone()) {
+        CHECK(ant.runOnce(20) >= 0);
+    }
+    *took = std::chrono::duration_cast<std::chrono::milliseconds>
+        (ant_clock::now() - start).count();
+
+    // Only what was read from the stick is played back
+    CHECK(iface->getFrames() == reads);
+
+    return collect(&ant);
+}
+
+int main(void) {
+    char name[] = "/tmp/test_replay_XXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    if (fd < 0) {
+        return TEST_RESULT();
+    }
+    close(fd);
+
+    uint64_t reads;
+    Data recorded = record(name, &reads);
+
+    int64_t took;
+    compare(recorded, replay(name, 0, reads, &took));
+    CHECK(took < 500);
+
+    // Four times real time, a one second capture takes about 250 ms
+    compare(recorded, replay(name, 4, reads, &took));
+    CHECK(took >= 200);
+    CHECK(took < 600);
+
+    unlink(name);
+
+    return TEST_RESULT();
+}
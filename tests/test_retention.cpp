@@ -0,0 +1,226 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Bounded retention of device time series. Whole chunks are evicted
+// (and spilled) as new ones are started, while reads are trimmed to
+// exactly the retention policy. At every step the spilled samples
+// must be the oldest ones in order, the samples read back must be
+// exactly the ones the policy keeps, and size() must agree.
+
+struct Sample {
+    int64_t t;
+    float v;
+    bool operator==(const Sample &s) const {
+        return (t == s.t) && (v == s.v);
+    }
+};
+
+static std::vector<Sample> read(ANTDeviceData<float> *d) {
+    auto t = d->getTimestamp();
+    auto v = d->getValue();
+    CHECK(t->size() == v->size());
+
+    std::vector<Sample> out;
+    for (size_t i = 0; i < std::min(t->size(), v->size()); i++) {
+        out.push_back({ (*t)[i], (*v)[i] });
+    }
+    return out;
+}
+
+static void check(ANTDeviceData<float> *d, const std::vector<Sample> &all,
+        const std::vector<Sample> &spilled, size_t max, int64_t window) {
+    // The oldest sample the policy keeps
+    size_t first = 0;
+    if (max && (all.size() > max)) {
+        first = all.size() - max;
+    }
+    if (window) {
+        while ((first < all.size())
+                && (all[first].t < (all.back().t - window))) {
+            first++;
+        }
+    }
+
+    std::vector<Sample> expect(all.begin() + first, all.end());
+    CHECK(read(d) == expect);
+    CHECK(d->size() == expect.size());
+
+    // Nothing kept has been spilled and nothing older is lost.
+    // Chunks are only evicted as new ones are started, so up to
+    // two chunks' worth can be held beyond the policy.
+    CHECK(spilled.size() <= first);
+    CHECK(std::equal(spilled.begin(), spilled.end(), all.begin()));
+    CHECK((first - spilled.size()) < 2 * ANTPLUS_TS_CHUNK_SIZE);
+}
+
+static void run(size_t max, int64_t window) {
+    ANTDeviceData<float> d;
+    std::vector<Sample> all;
+    std::vector<Sample> spilled;
+
+    d.setRetention(max, window,
+            [&spilled](const int64_t *ts, const float *v, int n) {
+        for (int i = 0; i < n; i++) {
+            spilled.push_back({ ts[i], v[i] });
+        }
+    });
+
+    // Uneven spacing, so the window edge falls inside a chunk
+    int64_t t = 0;
+    for (int i = 0; i < 5000; i++) {
+        t += 1000000 + (i % 7) * 250000;
+        d.addDatum(i, t);
+        all.push_back({ t, (float)i });
+        if (((i % 97) == 0) || (i == 4999)) {
+            check(&d, all, spilled, max, window);
+        }
+    }
+
+    // Something must actually have been evicted
+    CHECK(spilled.size() > 0);
+    CHECK((spilled.size() % ANTPLUS_TS_CHUNK_SIZE) == 0);
+}
+
+// Keeps what the device spills, per field
+class TestSink : public ANTDataSink {
+ public:
+    int write(ANTDeviceID id, const char *field,
+            const int64_t *ts, const float *value, int n) {
+        CHECK(id == ANTDeviceID(0x1234, ANT_DEVICE_HR));
+        if (std::string(field) == "HEARTRATE") {
+            for (int i = 0; i < n; i++) {
+                rows.push_back({ ts[i], value[i] });
+            }
+        }
+        return 0;
+    }
+
+    std::vector<Sample> rows;
+};
+
+static void testDevice(void) {
+    // Through the device, spilling to a data sink
+    ant_time_point t0 = ant_clock::now();
+    ANTDeviceHR dev(ANTDeviceID(0x1234, ANT_DEVICE_HR));
+    dev.setStartTime(t0);
+
+    auto sink = std::make_shared<TestSink>();
+    dev.setRetention(600, 0, sink);
+
+    std::vector<Sample> all;
+    for (int i = 0; i < 2000; i++) {
+        uint8_t hr = 60 + (i % 100);
+        uint8_t data[8] = { 0x00, 0xFF, 0xFF, 0xFF,
+            0x00, 0x00, (uint8_t)(i / 4), hr };
+        ANTMessage m(ANT_BROADCAST_DATA, 0, data, sizeof(data));
+        ant_time_point t = t0 + std::chrono::milliseconds(250 * i);
+        m.setTimestamp(t);
+        dev.parseMessage(&m);
+        all.push_back({ std::chrono::duration_cast
+                <std::chrono::nanoseconds>(t - t0).count(), (float)hr });
+    }
+
+    auto data = dev.getTsData(ANTDeviceHR::FIELD_HEARTRATE);
+    check(data.get(), all, sink->rows, 600, 0);
+    CHECK(sink->rows.size() > 0);
+    CHECK((sink->rows.size() % ANTPLUS_TS_CHUNK_SIZE) == 0);
+}
+
+static void testFileSink(void) {
+    // Records written to a file read back as they were spilled
+    char name[] = "/tmp/test_retention_XXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+
+    int64_t ts[3] = { 1, 2, 3000000000000LL };
+    float v[3] = { 1.5, -2, 300 };
+    {
+        ANTFileDataSink sink(name);
+        CHECK(sink.write(ANTDeviceID(0x1234, ANT_DEVICE_PWR), "POWER",
+                    ts, v, 3) == 0);
+    }
+
+    FILE *f = fopen(name, "rb");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        uint16_t id;
+        uint8_t type, len;
+        char field[6] = { 0 };
+        uint32_t n;
+        int64_t rts[3];
+        float rv[3];
+        CHECK(fread(&id, sizeof(id), 1, f) == 1);
+        CHECK(fread(&type, sizeof(type), 1, f) == 1);
+        CHECK(fread(&len, sizeof(len), 1, f) == 1);
+        CHECK(len == 5);
+        CHECK(fread(field, 1, 5, f) == 5);
+        CHECK(fread(&n, sizeof(n), 1, f) == 1);
+        CHECK(fread(rts, sizeof(int64_t), 3, f) == 3);
+        CHECK(fread(rv, sizeof(float), 3, f) == 3);
+        CHECK(fgetc(f) == EOF);
+        fclose(f);
+
+        CHECK(id == 0x1234);
+        CHECK(type == ANT_DEVICE_PWR);
+        CHECK(std::string(field) == "POWER");
+        CHECK(n == 3);
+        CHECK(std::equal(rts, rts + 3, ts));
+        CHECK(std::equal(rv, rv + 3, v));
+    }
+
+    unlink(name);
+}
+
+int main(void) {
+    // By sample count, including trimming inside the oldest chunk
+    run(1000, 0);
+    // By time window (ns), the edge moves between evictions
+    run(0, 700000000LL);
+    // Both, whichever keeps less
+    run(300, 700000000LL);
+    run(1000, 300000000LL);
+
+    testDevice();
+    testFileSink();
+
+    return TEST_RESULT();
+}
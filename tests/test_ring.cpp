@@ -0,0 +1,138 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "antplus.h"
+#include "antplus_test.h"
+
+// The SPSC queue between the listener and the processor. A small
+// queue is wrapped many times, filled to force the backpressure
+// path, and run flat out and with pauses between two threads so
+// the consumer parks and must be woken. Every entry must come out
+// once, whole and in order, and no wake up may be lost.
+
+struct Entry {
+    uint64_t seq;
+    uint64_t check;
+};
+
+static void testWrap(void) {
+    ANTRingBuffer<Entry> ring(3);  // rounded up to 4
+
+    uint64_t in = 0;
+    uint64_t out = 0;
+    for (int round = 0; round < 1000; round++) {
+        // Fill it, the next push must fail and be counted
+        while (ring.push({ in, ~in })) {
+            in++;
+        }
+        CHECK(ring.full());
+        CHECK((in - out) == 4);
+        CHECK(ring.getDropped() == (size_t)(round + 1));
+
+        // Take some (a different number each time round)
+        Entry e[4];
+        size_t n = ring.pop(e, 1 + (round % 4));
+        CHECK(n == (size_t)(1 + (round % 4)));
+        for (size_t i = 0; i < n; i++, out++) {
+            CHECK(e[i].seq == out);
+            CHECK(e[i].check == ~out);
+        }
+        CHECK(!ring.full());
+    }
+
+    Entry e[8];
+    size_t n = ring.pop(e, 8);
+    CHECK(n == (in - out));
+    CHECK(ring.empty());
+    CHECK(ring.pop(e, 8) == 0);
+}
+
+static void testThreads(uint64_t total, int pauseEvery) {
+    ANTRingBuffer<Entry> ring(8);
+    std::atomic<bool> done(false);
+    uint64_t retries = 0;
+
+    std::thread producer([&]() {
+        for (uint64_t i = 0; i < total; i++) {
+            // Backpressure, wait for the consumer to make room
+            while (!ring.push({ i, ~i })) {
+                retries++;
+                std::this_thread::yield();
+            }
+            if (pauseEvery && ((i % pauseEvery) == 0)) {
+                // Long enough for the consumer to park
+                usleep(200);
+            }
+        }
+        done = true;
+    });
+
+    uint64_t next = 0;
+    int slow = 0;
+    int torn = 0;
+    int order = 0;
+    Entry e[3];
+    while (next < total) {
+        auto start = ant_clock::now();
+        size_t n = ring.wait(e, 3, 2000000);
+        if ((ant_clock::now() - start) > std::chrono::seconds(1)) {
+            // Parked with data waiting, the wake up was lost
+            slow++;
+        }
+        for (size_t i = 0; i < n; i++, next++) {
+            order += (e[i].seq != next);
+            torn += (e[i].check != ~e[i].seq);
+        }
+        if (slow > 2) {
+            break;
+        }
+    }
+    producer.join();
+
+    CHECK(next == total);
+    CHECK(order == 0);
+    CHECK(torn == 0);
+    CHECK(slow == 0);
+    CHECK(done);
+    CHECK(ring.empty());
+    CHECK(ring.getDropped() == retries);
+}
+
+int main(void) {
+    testWrap();
+    // Flat out, the queue is full most of the time
+    testThreads(200000, 0);
+    // With pauses, the consumer parks and is woken
+    testThreads(20000, 10);
+
+    return TEST_RESULT();
+}
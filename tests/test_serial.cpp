@@ -0,0 +1,229 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// The serial interface over a pseudo terminal. The other end plays
+// the ANT module, bridging frames to and from the simulated stick
+// and writing each frame in two halves so they have to be put back
+// together. Hanging up the other end must lose the device.
+
+class PtyStick {
+ public:
+    PtyStick(void) : run(true) {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if ((master < 0) || grantpt(master) || unlockpt(master)) {
+            return;
+        }
+        port = ptsname(master);
+
+        sim = std::make_shared<ANTSimInterface>();
+        sim->setRate(10);
+        sim->addDevices(ANT_DEVICE_HR, 5);
+        sim->addDevices(ANT_DEVICE_PWR, 5, 100);
+        sim->open();
+        sim->setReadTimeout(5);
+
+        tx = std::thread(&PtyStick::transmit, this);
+        rx = std::thread(&PtyStick::receive, this);
+    }
+
+    ~PtyStick(void) {
+        hangup();
+    }
+
+    void hangup(void) {
+        run = false;
+        if (tx.joinable()) {
+            tx.join();
+        }
+        if (rx.joinable()) {
+            rx.join();
+        }
+        if (master >= 0) {
+            ::close(master);
+            master = -1;
+        }
+    }
+
+    std::string getPort(void)  { return port; }
+
+ private:
+    void transmit(void) {
+        std::vector<ANTMessage> message;
+        while (run) {
+            message.clear();
+            sim->readMessage(&message);
+            for (ANTMessage &m : message) {
+                uint8_t frame[ANTPLUS_MAX_MESSAGE_SIZE];
+                int len;
+                m.encode(frame, &len);
+                int half = len / 2;
+                if ((write(master, frame, half) != half)
+                        || (write(master, frame + half, len - half)
+                            != (len - half))) {
+                    return;
+                }
+            }
+        }
+    }
+
+    void receive(void) {
+        ANTReassembler reassembler;
+        ANTFrame frame;
+        uint8_t bytes[256];
+        while (run) {
+            struct pollfd p = { master, POLLIN, 0 };
+            if (poll(&p, 1, 10) <= 0) {
+                continue;
+            }
+            int n = read(master, bytes, sizeof(bytes));
+            if (n <= 0) {
+                continue;
+            }
+            reassembler.push(bytes, n);
+            while (reassembler.nextFrame(&frame)) {
+                ANTMessage m(frame.data, frame.len);
+                sim->sendMessage(&m);
+            }
+        }
+    }
+
+    int master;
+    std::string port;
+    shared_ptr<ANTSimInterface> sim;
+    std::atomic<bool> run;
+    std::thread tx;
+    std::thread rx;
+};
+
+static void checkChannels(ANT *ant) {
+    for (int c = 0; c < 2; c++) {
+        auto chan = ant->getChannel(c);
+        CHECK(chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+        CHECK(chan->getDeviceList().size() == 5);
+        for (auto dev : chan->getDeviceList()) {
+            CHECK(dev->getTsData(0)->size() > 0);
+        }
+    }
+}
+
+static void testEventLoop(void) {
+    PtyStick stick;
+    CHECK(!stick.getPort().empty());
+
+    auto serial = std::make_shared<ANTSerialInterface>(stick.getPort(),
+            115200);
+    ANT ant(serial, 8, 1, ANT::MODE_EVENT_LOOP);
+
+    std::vector<struct pollfd> fds;
+    CHECK(ant.getPollFds(&fds) == 0);
+    CHECK(fds.size() == 1);
+
+    CHECK(ant.init() == 0);
+    CHECK(ant.getChannel(0)->open(ANTChannel::TYPE_HR, 0x0000,
+                false) == 0);
+    CHECK(ant.getChannel(1)->open(ANTChannel::TYPE_PWR, 0x0000,
+                false) == 0);
+
+    auto start = ant_clock::now();
+    while ((ant_clock::now() - start) < std::chrono::milliseconds(1500)) {
+        CHECK(ant.runOnce(50) >= 0);
+    }
+    checkChannels(&ant);
+    CHECK(serial->getCommandsInFlight() == 0);
+
+    // Nothing more from the module
+    stick.hangup();
+    CHECK(ant.runOnce(50) < 0);
+    CHECK(serial->isDeviceLost());
+}
+
+static void testThreaded(void) {
+    PtyStick stick;
+
+    auto serial = std::make_shared<ANTSerialInterface>(stick.getPort(),
+            115200);
+    ANT ant(serial, 8, 1);
+
+    CHECK(ant.init() == 0);
+    CHECK(ant.getChannel(0)->open(ANTChannel::TYPE_HR) == 0);
+    CHECK(ant.getChannel(1)->open(ANTChannel::TYPE_PWR) == 0);
+
+    usleep(1500000);
+    checkChannels(&ant);
+}
+
+static void testConcurrent(void) {
+    // Channels opened from several threads at once, their commands
+    // must reach the module as whole frames and all be answered
+    PtyStick stick;
+
+    auto serial = std::make_shared<ANTSerialInterface>(stick.getPort(),
+            115200);
+    ANT ant(serial, 8, 1);
+    CHECK(ant.init() == 0);
+
+    std::atomic<int> opened(0);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < 8; c++) {
+        threads.push_back(std::thread([&ant, &opened, c]() {
+            int type = (c % 2) ? ANTChannel::TYPE_PWR
+                : ANTChannel::TYPE_HR;
+            if (ant.getChannel(c)->open(type) == 0) {
+                opened++;
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    CHECK(opened == 8);
+    CHECK(serial->getCommandsInFlight() == 0);
+}
+
+int main(void) {
+    testEventLoop();
+    testThreaded();
+    testConcurrent();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,136 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Load test on the simulated stick: many sensors broadcasting much
+// faster than the ANT+ rate. Every sensor must be found, and every
+// page the stick delivers must end up in the time series.
+
+#define N_SENSORS   40
+#define SIM_RATE    20
+#define RUN_TIME    1500  // ms
+
+static shared_ptr<ANTSimInterface> makeSim(void) {
+    auto sim = std::make_shared<ANTSimInterface>();
+    sim->setSeed(1);
+    sim->setRate(SIM_RATE);
+    sim->setLoss(0.05);
+    sim->setJitter(500);
+    return sim;
+}
+
+static size_t countSamples(shared_ptr<ANTChannel> chan, int field,
+        size_t *empty) {
+    size_t total = 0;
+    *empty = 0;
+    for (auto dev : chan->getDeviceList()) {
+        size_t n = dev->getTsData(field)->size();
+        if (!n) {
+            (*empty)++;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static void testThreaded(void) {
+    auto sim = makeSim();
+    sim->addDevices(ANT_DEVICE_HR, N_SENSORS);
+    sim->addDevices(ANT_DEVICE_PWR, N_SENSORS, 1000);
+    sim->addDevices(ANT_DEVICE_FEC, N_SENSORS, 2000);
+
+    ANT ant(sim, 8, 2);
+    ant.init();
+
+    CHECK(ant.getChannel(0)->open(ANTChannel::TYPE_HR) == 0);
+    CHECK(ant.getChannel(1)->open(ANTChannel::TYPE_PWR) == 0);
+    CHECK(ant.getChannel(2)->open(ANTChannel::TYPE_FEC) == 0);
+
+    usleep(RUN_TIME * 1000L);
+
+    size_t empty;
+    CHECK(ant.getChannel(0)->getDeviceList().size() == N_SENSORS);
+    CHECK(countSamples(ant.getChannel(0),
+                ANTDeviceHR::FIELD_HEARTRATE, &empty) > 0);
+    CHECK(empty == 0);
+
+    CHECK(ant.getChannel(1)->getDeviceList().size() == N_SENSORS);
+    CHECK(countSamples(ant.getChannel(1),
+                ANTDevicePWR::FIELD_INST_POWER, &empty) > 0);
+    CHECK(empty == 0);
+
+    CHECK(ant.getChannel(2)->getDeviceList().size() == N_SENSORS);
+    CHECK(countSamples(ant.getChannel(2),
+                ANTDeviceFEC::FIELD_GENERAL_INST_SPEED, &empty) > 0);
+    CHECK(empty == 0);
+
+    CHECK(sim->getSent() > 0);
+    CHECK(sim->getLost() > 0);
+}
+
+static void testEventLoop(void) {
+    // Without threads every page read is processed before runOnce()
+    // returns, so the samples must account for every page sent.
+    auto sim = makeSim();
+    sim->addDevices(ANT_DEVICE_HR, N_SENSORS);
+
+    ANT ant(sim, 8, 1, ANT::MODE_EVENT_LOOP);
+    ant.init();
+
+    auto chan = ant.getChannel(0);
+    CHECK(chan->open(ANTChannel::TYPE_HR, 0x0000, false) == 0);
+
+    auto start = ant_clock::now();
+    while ((ant_clock::now() - start)
+            < std::chrono::milliseconds(RUN_TIME)) {
+        CHECK(ant.runOnce(10) >= 0);
+    }
+
+    CHECK(chan->getState() == ANTChannel::STATE_OPEN_UNPAIRED);
+    CHECK(chan->getDeviceList().size() == N_SENSORS);
+
+    size_t empty;
+    size_t samples = countSamples(chan, ANTDeviceHR::FIELD_HEARTRATE,
+            &empty);
+    CHECK(empty == 0);
+    CHECK(samples == sim->getSent());
+}
+
+int main(void) {
+    testThreaded();
+    testEventLoop();
+
+    return TEST_RESULT();
+}
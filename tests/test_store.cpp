@@ -0,0 +1,140 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// The per-field store policies. A power meter repeats its battery
+// page, which by default is only stored again when a value changes
+// or once the heartbeat has passed, while fields left at
+// STORE_ALWAYS keep every repeat.
+
+#define PERIOD  250  // ms
+
+static ant_time_point t0;
+
+static void feed(ANTDevice *dev, int ms, uint8_t b0, uint8_t b1,
+        uint8_t b2, uint8_t b3, uint8_t b4, uint8_t b5, uint8_t b6,
+        uint8_t b7) {
+    uint8_t data[8] = { b0, b1, b2, b3, b4, b5, b6, b7 };
+    ANTMessage m(ANT_BROADCAST_DATA, 0, data, sizeof(data));
+    m.setTimestamp(t0 + std::chrono::milliseconds(ms));
+    dev->parseMessage(&m);
+}
+
+static void battery(ANTDevice *dev, int ms, uint8_t volts) {
+    feed(dev, ms, ANT_DEVICE_POWER_BATTERY, 0xFF, 0x12, 0x03, 0x02,
+            0x01, volts, 0x33);
+}
+
+static std::vector<int64_t> times(ANTDevice *dev, int field) {
+    // Stored timestamps in ms
+    auto ts = dev->getTsData(field)->getTimestamp();
+    std::vector<int64_t> ms;
+    for (int64_t t : *ts) {
+        ms.push_back(t / 1000000);
+    }
+    return ms;
+}
+
+static void testDefaults(void) {
+    ANTDevicePWR dev(ANTDeviceID(1, ANT_DEVICE_PWR));
+    dev.setStartTime(t0);
+
+    // Three minutes of the same battery page, with the voltage
+    // changing once at 90 s
+    int ms;
+    for (ms = 0; ms <= 180000; ms += PERIOD) {
+        battery(&dev, ms, ms < 90000 ? 0xC0 : 0xB0);
+    }
+
+    // Heartbeat: on change, and again each time nothing has been
+    // stored for ANTPLUS_STORE_HEARTBEAT
+    std::vector<int64_t> expect = { 0, 60000, 90000, 150000 };
+    CHECK(times(&dev, ANTDevicePWR::FIELD_BATTERY_VOLTAGE) == expect);
+    auto v = dev.getTsData(ANTDevicePWR::FIELD_BATTERY_VOLTAGE)
+        ->getValue();
+    std::vector<float> volts = { 0xC0, 0xC0, 0xB0, 0xB0 };
+    CHECK(*v == volts);
+
+    expect = { 0, 60000, 120000, 180000 };
+    CHECK(times(&dev, ANTDevicePWR::FIELD_N_BATTERIES) == expect);
+
+    // The operating time is not meta data, every repeat is kept
+    CHECK(dev.getTsData(ANTDevicePWR::FIELD_OPERATING_TIME)->size()
+            == (180000 / PERIOD) + 1);
+}
+
+static void testPolicies(void) {
+    ANTDevicePWR dev(ANTDeviceID(1, ANT_DEVICE_PWR));
+    dev.setStartTime(t0);
+
+    dev.setStorePolicy(ANTDevicePWR::FIELD_N_BATTERIES,
+            ANTDevice::STORE_ALWAYS);
+    dev.setStorePolicy(ANTDevicePWR::FIELD_BATTERY_VOLTAGE,
+            ANTDevice::STORE_ON_CHANGE);
+    dev.setStorePolicy(ANTDevicePWR::FIELD_OPERATING_TIME,
+            ANTDevice::STORE_HEARTBEAT, 1000);
+
+    // Voltage 0xC0 for 2 s, 0xB0 for 2 s and back to 0xC0
+    int ms;
+    for (ms = 0; ms < 6000; ms += PERIOD) {
+        battery(&dev, ms, ((ms >= 2000) && (ms < 4000)) ? 0xB0 : 0xC0);
+    }
+
+    CHECK(dev.getTsData(ANTDevicePWR::FIELD_N_BATTERIES)->size()
+            == 6000 / PERIOD);
+
+    std::vector<int64_t> expect = { 0, 2000, 4000 };
+    CHECK(times(&dev, ANTDevicePWR::FIELD_BATTERY_VOLTAGE) == expect);
+
+    // A heartbeat of 1 s, every fourth page
+    expect = { 0, 1000, 2000, 3000, 4000, 5000 };
+    CHECK(times(&dev, ANTDevicePWR::FIELD_OPERATING_TIME) == expect);
+
+    // Back to storing everything
+    dev.setStorePolicy(ANTDevicePWR::FIELD_BATTERY_VOLTAGE,
+            ANTDevice::STORE_ALWAYS);
+    for (; ms < 7000; ms += PERIOD) {
+        battery(&dev, ms, 0xC0);
+    }
+    CHECK(dev.getTsData(ANTDevicePWR::FIELD_BATTERY_VOLTAGE)->size()
+            == 3 + (1000 / PERIOD));
+}
+
+int main(void) {
+    t0 = ant_clock::now();
+
+    testDefaults();
+    testPolicies();
+
+    return TEST_RESULT();
+}
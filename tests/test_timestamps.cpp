@@ -0,0 +1,139 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Timestamps are int64 ns, kept as 32 bit deltas within a chunk. A
+// delta which does not fit (a gap of more than about 4.29 s, or time
+// going backwards) starts a new chunk, and every timestamp must come
+// back out exactly as it went in.
+
+#define GAP  ((int64_t)UINT32_MAX)
+
+static std::vector<int64_t> series(void) {
+    // Odd ns steps from a large base, with gaps just inside and
+    // just outside a 32 bit delta and a step back in time
+    std::vector<int64_t> t;
+    int64_t ns = 1700000000123456789LL;
+    for (int i = 0; i < 10; i++) {
+        t.push_back(ns += 250000001);
+    }
+    t.push_back(ns += GAP);
+    t.push_back(ns += GAP + 1);
+    t.push_back(ns);
+    for (int i = 0; i < 10; i++) {
+        t.push_back(ns += 1);
+    }
+    t.push_back(ns += 3600 * 1000000000LL);
+    t.push_back(ns -= 7);
+    for (int i = 0; i < 600; i++) {
+        t.push_back(ns += 123456789);
+    }
+    return t;
+}
+
+static void testExact(void) {
+    std::vector<int64_t> t = series();
+
+    ANTDeviceData<float> d;
+    for (size_t i = 0; i < t.size(); i++) {
+        d.addDatum(i, t[i]);
+    }
+
+    auto ts = d.getTimestamp();
+    auto v = d.getValue();
+    CHECK(*ts == t);
+    CHECK(v->size() == t.size());
+    for (size_t i = 0; i < v->size(); i++) {
+        CHECK((*v)[i] == i);
+    }
+}
+
+static void testChunks(void) {
+    std::vector<int64_t> t = series();
+
+    // Keeping one sample spills every chunk but the newest, so the
+    // spills show where the chunks were started
+    std::vector<int> sizes;
+    std::vector<int64_t> spilled;
+    ANTDeviceData<float> d;
+    d.setRetention(1, 0, [&](const int64_t *ts, const float *v, int n) {
+        (void)v;
+        sizes.push_back(n);
+        spilled.insert(spilled.end(), ts, ts + n);
+    });
+    for (int64_t ns : t) {
+        d.addDatum(0, ns);
+    }
+
+    // 10 steps and the gap which just fits, the gap which does not
+    // with the repeat and 10 more steps, the hour gap alone, then
+    // the step back starts a full chunk. The last two chunks (256
+    // and 89 samples) are held.
+    std::vector<int> expect = { 11, 12, 1, 256 };
+    CHECK(sizes == expect);
+    CHECK(spilled.size() + 256 + 89 == t.size());
+    CHECK(std::equal(spilled.begin(), spilled.end(), t.begin()));
+    CHECK(d.getTimestamp()->size() == 1);
+    CHECK(d.getTimestamp()->back() == t.back());
+}
+
+static void testDevice(void) {
+    // From the stick's clock to ns since the start time
+    ant_time_point t0 = ant_clock::now();
+    ANTDevicePWR dev(ANTDeviceID(1, ANT_DEVICE_PWR));
+    dev.setStartTime(t0);
+
+    std::vector<int64_t> t = { 0, 1, 250000001, 250000001 + GAP,
+        250000002 + 2 * GAP, 10000000000LL * 3600 };
+    for (size_t i = 0; i < t.size(); i++) {
+        uint8_t page[8] = { ANT_DEVICE_POWER_STANDARD, (uint8_t)i,
+            0xFF, 90, 0, 0, (uint8_t)(100 + i), 0 };
+        ANTMessage m(ANT_BROADCAST_DATA, 0, page, sizeof(page));
+        m.setTimestamp(t0 + std::chrono::nanoseconds(t[i]));
+        dev.parseMessage(&m);
+    }
+
+    auto ts = dev.getTsData(ANTDevicePWR::FIELD_INST_POWER)
+        ->getTimestamp();
+    CHECK(*ts == t);
+}
+
+int main(void) {
+    testExact();
+    testChunks();
+    testDevice();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,133 @@
+//
+// antplus : ANT+ Utilities
+//
+// MIT License
+//
+// Copyright (c) 2020 Stuart Wilkins
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+
+#include <cmath>
+#include <memory>
+
+#include "antplus.h"
+#include "antdefs.h"
+#include "antplus_test.h"
+
+// Torque, power, cadence and wheel speed from the crank (0x12) and
+// wheel (0x11) torque pages. The meter sends a page at 4 Hz with the
+// counts up to its last rotation, losing some and wrapping all the
+// counters. The torque pages, not page 0x10, feed the power windows.
+
+struct TorqueMeter : TestMeter {
+    uint8_t  page;
+    double   revs;
+    uint8_t  events;
+    double   period;     // 1/2048 s
+    double   torque;     // 1/32 Nm
+
+    TorqueMeter(ANTChannel *chan, uint8_t p) : TestMeter(chan, p) {
+        page = p;
+        revs = 0;
+        events = 250;
+        period = 60000;
+        torque = 65000;
+    }
+};
+
+// Turn at rpm with torque Nm for the given time, sending a page
+// every 0.25 s (bar 3 in 10) with a 100 W page 0x10 after it.
+static void run(TorqueMeter *meter, double start, double seconds,
+        double rpm, double nm) {
+    for (int i = 0; i < seconds * 4; i++) {
+        double t = start + i * 0.25;
+        while (meter->revs + 1 <= (t - start) * rpm / 60.0) {
+            meter->revs   += 1;
+            meter->events += 1;
+            meter->period += 2048.0 * 60.0 / rpm;
+            meter->torque += 32.0 * nm;
+        }
+        if (((i % 10) == 3) || ((i % 10) == 6) || ((i % 10) == 9)) {
+            continue;
+        }
+
+        uint16_t period = (uint64_t)llround(meter->period) & 0xFFFF;
+        uint16_t torque = (uint64_t)llround(meter->torque) & 0xFFFF;
+        uint8_t page[8] = {
+            meter->page, meter->events, (uint8_t)meter->revs,
+            (uint8_t)rpm, (uint8_t)(period & 0xFF),
+            (uint8_t)(period >> 8), (uint8_t)(torque & 0xFF),
+            (uint8_t)(torque >> 8)
+        };
+        meter->sendPage(page, t);
+
+        uint8_t standard[8] = {
+            ANT_DEVICE_POWER_STANDARD, (uint8_t)i, 0xFF, 90,
+            (uint8_t)((i * 100) & 0xFF), (uint8_t)((i * 100) >> 8),
+            100, 0
+        };
+        meter->sendPage(standard, t + 0.001);
+    }
+}
+
+static void testCrankTorque(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    TorqueMeter meter(&chan, ANT_DEVICE_POWER_CRANK_TORQUE);
+
+    // 30 Nm at 90 rpm, then again after a 10 s gap
+    run(&meter, 0, 60, 90, 30);
+    run(&meter, 70, 60, 90, 30);
+
+    double power = 30 * 90 * 2 * M_PI / 60;
+    meter.checkAll(ANTDevicePWR::FIELD_TORQUE, 30, 0.05);
+    meter.checkAll(ANTDevicePWR::FIELD_TORQUE_POWER, power, 0.5);
+    meter.checkAll(ANTDevicePWR::FIELD_TORQUE_CADENCE, 90, 0.1);
+    CHECK(meter.dev->getTsData(ANTDevicePWR::FIELD_WHEEL_SPEED)
+            ->size() == 0);
+
+    CHECK_NEAR(meter.dev->getPower3s(), power, 0.5);
+    CHECK_NEAR(meter.dev->getPower30s(), power, 0.5);
+}
+
+static void testWheelTorque(void) {
+    ANTChannel chan(ANTChannel::TYPE_PWR, 0, nullptr);
+    TorqueMeter meter(&chan, ANT_DEVICE_POWER_WHEEL_TORQUE);
+    meter.dev->setWheelCircumference(2.1);
+
+    // 10 Nm at 5 wheel revolutions a second
+    run(&meter, 0, 60, 300, 10);
+
+    double power = 10 * 5 * 2 * M_PI;
+    meter.checkAll(ANTDevicePWR::FIELD_TORQUE, 10, 0.05);
+    meter.checkAll(ANTDevicePWR::FIELD_TORQUE_POWER, power, 0.5);
+    meter.checkAll(ANTDevicePWR::FIELD_WHEEL_SPEED, 2.1 * 5, 0.05);
+    CHECK(meter.dev->getTsData(ANTDevicePWR::FIELD_TORQUE_CADENCE)
+            ->size() == 0);
+
+    CHECK_NEAR(meter.dev->getPower30s(), power, 0.5);
+}
+
+int main(void) {
+    testCrankTorque();
+    testWheelTorque();
+
+    return TEST_RESULT();
+}